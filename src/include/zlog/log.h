@@ -2,6 +2,7 @@
 #define LIBZLOG_ZLOG_HPP
 #include <rados/librados.hpp>
 #include "libseq/libseqr.h"
+#include "zlog/scanner.h"
 #include "zlog/stream.h"
 
 namespace zlog {
@@ -14,15 +15,105 @@ class AioCompletion {
   virtual int ReturnValue() = 0;
 };
 
+/*
+ * Options for a log handle.
+ */
+struct Options {
+  Options() :
+    reservation_size(0),
+    reservation_low_water(0),
+    append_window_entries(0),
+    append_window_us(0),
+    entry_cache_size(0),
+    entry_cache_write_through(false),
+    stripe_width_min(0),
+    stripe_width_max(0),
+    stripe_latency_high_us(10000),
+    stripe_latency_low_us(1000),
+    stripe_queue_depth_high(8),
+    stripe_reconfig_interval_sec(60),
+    stripe_block_size(0)
+  {}
+
+  /*
+   * When non-zero the log handle keeps a local pool of up to this many
+   * positions reserved from the sequencer. Appends draw positions from the
+   * pool without a round-trip to the sequencer, and the pool is refilled in
+   * the background when it drops below the low-water mark. Unused positions
+   * are filled when the handle is closed or the epoch changes.
+   */
+  size_t reservation_size;
+  size_t reservation_low_water;
+
+  /*
+   * When non-zero, asynchronous appends issued within a short window are
+   * coalesced: the window is closed after append_window_us microseconds or
+   * once it holds append_window_entries appends, all of its positions are
+   * then reserved with a single sequencer request, and the appends that map
+   * to the same stripe object are written back to back. Coalescing
+   * takes precedence over the reservation pool for asynchronous appends.
+   */
+  size_t append_window_entries;
+  uint64_t append_window_us;
+
+  /*
+   * When non-zero the log handle caches up to this many entries that it has
+   * read, so that re-reading a position doesn't go to RADOS. With write
+   * through enabled, entries appended by this handle are cached too; the
+   * appended buffers are shared with the cache and must not be modified
+   * after the append.
+   *
+   * The cache is only invalidated by Trim on the same handle. Entries trimmed
+   * through any other handle, in this process or another, keep being read
+   * from the cache with their old contents (instead of failing with
+   * -EFAULT) until they are evicted. Only enable the cache on logs that are
+   * trimmed through the caching handle, or whose readers can tolerate
+   * seeing trimmed entries.
+   */
+  size_t entry_cache_size;
+  bool entry_cache_write_through;
+
+  /*
+   * When stripe_width_min is non-zero the log handle adapts the stripe
+   * width to its append load, between stripe_width_min and
+   * stripe_width_max. The stripe is widened when the mean append latency
+   * exceeds stripe_latency_high_us or an object has more than
+   * stripe_queue_depth_high appends outstanding, and narrowed when latency
+   * is below stripe_latency_low_us with no queueing. Each change seals the
+   * log, so changes are at least stripe_reconfig_interval_sec apart. Only
+   * one handle per log should enable this.
+   */
+  int stripe_width_min;
+  int stripe_width_max;
+  uint64_t stripe_latency_high_us;
+  uint64_t stripe_latency_low_us;
+  int stripe_queue_depth_high;
+  int stripe_reconfig_interval_sec;
+
+  /*
+   * Mapping of positions to stripe objects for a newly created log. By
+   * default consecutive positions are spread round robin across the
+   * objects. When non-zero, stripe_block_size consecutive positions are
+   * placed on each object before moving to the next (block striping), which
+   * keeps neighbouring entries together for scans and batched reads.
+   */
+  uint32_t stripe_block_size;
+};
+
 class Log {
  public:
   Log() {}
+  virtual ~Log();
 
   /*
    * Synchronous API
    */
   virtual int Append(ceph::bufferlist& data, uint64_t *pposition = NULL) = 0;
+  virtual int AppendBatch(std::vector<ceph::bufferlist>& data,
+      std::vector<uint64_t> *pposition = NULL) = 0;
   virtual int Read(uint64_t position, ceph::bufferlist& bl) = 0;
+  virtual int ReadMany(const std::vector<uint64_t>& positions,
+      std::vector<ceph::bufferlist>& bls, std::vector<int>& results) = 0;
   virtual int Fill(uint64_t position) = 0;
   virtual int CheckTail(uint64_t *pposition) = 0;
   virtual int Trim(uint64_t position) = 0;
@@ -31,6 +122,8 @@ class Log {
    * Asynchronous API
    */
   virtual int AioAppend(AioCompletion *c, ceph::bufferlist& data, uint64_t *pposition = NULL) = 0;
+  virtual int AioAppendBatch(AioCompletion *c, std::vector<ceph::bufferlist>& data,
+      std::vector<uint64_t> *pposition = NULL) = 0;
   virtual int AioRead(uint64_t position, AioCompletion *c, ceph::bufferlist *bpl) = 0;
 
   static AioCompletion *aio_create_completion();
@@ -45,6 +138,20 @@ class Log {
       const std::set<uint64_t>& stream_ids, uint64_t *pposition = NULL) = 0;
   virtual int StreamMembership(std::set<uint64_t>& stream_ids, uint64_t position) = 0;
 
+  /*
+   * Scan API
+   *
+   * Read the positions [start, end) in order, keeping up to window reads in
+   * flight.
+   */
+  virtual int Scan(uint64_t start, uint64_t end, Scanner **scannerptr,
+      size_t window = 64) = 0;
+
+  /*
+   * Entry cache hit and miss counts (zero when the cache is disabled)
+   */
+  virtual void CacheStats(uint64_t *phits, uint64_t *pmisses) = 0;
+
   /*
    * Log Management
    */
@@ -52,17 +159,34 @@ class Log {
   static int Create(librados::IoCtx& ioctx, const std::string& name,
       SeqrClient *seqr, Log **logptr);
 
+  static int Create(librados::IoCtx& ioctx, const std::string& name,
+      SeqrClient *seqr, const Options& options, Log **logptr);
+
   static int Open(librados::IoCtx& ioctx, const std::string& name,
       SeqrClient *seqr, Log **logptr);
 
+  static int Open(librados::IoCtx& ioctx, const std::string& name,
+      SeqrClient *seqr, const Options& options, Log **logptr);
+
   static int OpenOrCreate(librados::IoCtx& ioctx, const std::string& name,
       SeqrClient *seqr, Log **logptr) {
-    int ret = Open(ioctx, name, seqr, logptr);
-    if (ret != -ENOENT)
-      return ret;
-    return Create(ioctx, name, seqr, logptr);
+    return OpenOrCreate(ioctx, name, seqr, Options(), logptr);
   }
 
+  static int OpenOrCreate(librados::IoCtx& ioctx, const std::string& name,
+      SeqrClient *seqr, const Options& options, Log **logptr);
+
+  /*
+   * Open a log without blocking. On success *logptr is set before the
+   * completion fires.
+   */
+  static int AioOpen(librados::IoCtx& ioctx, const std::string& name,
+      SeqrClient *seqr, AioCompletion *c, Log **logptr);
+
+  static int AioOpen(librados::IoCtx& ioctx, const std::string& name,
+      SeqrClient *seqr, const Options& options, AioCompletion *c,
+      Log **logptr);
+
  private:
   Log(const Log&);
   void operator=(const Log&);
@@ -0,0 +1,23 @@
+#ifndef ZLOG_INCLUDE_ZLOG_SCANNER_H_
+#define ZLOG_INCLUDE_ZLOG_SCANNER_H_
+#include <rados/librados.hpp>
+
+namespace zlog {
+
+/*
+ * Scan API
+ *
+ * Returns the entries of a range of log positions in order. Next returns 0
+ * for a written entry, -ENODEV for a hole and -EFAULT for an invalidated
+ * (filled or trimmed) entry, and in each case sets the position that the
+ * result is for. Once the range is exhausted Next returns -EBADF.
+ */
+class Scanner {
+ public:
+  virtual ~Scanner();
+  virtual int Next(ceph::bufferlist& bl, uint64_t *pposition = NULL) = 0;
+};
+
+}
+
+#endif
@@ -1,119 +1,1305 @@
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <list>
+#include <mutex>
 #include <set>
 #include <map>
+#include <endian.h>
 #include <boost/asio.hpp>
 #include "libseqr.h"
+#include "shm_ring.h"
 #include "proto/zlog.pb.h"
 
+/*
+ * Upper bound on the size of a reply. Anything larger is treated as a
+ * corrupt stream.
+ */
+#define SEQR_MAX_MSG_SIZE (1 << 20)
+
 namespace zlog {
 
-void SeqrClient::Connect() {
-  boost::asio::ip::tcp::resolver resolver(io_service_);
-  boost::asio::ip::tcp::resolver::query query(
-      boost::asio::ip::tcp::v4(), host_.c_str(), port_);
-  boost::asio::ip::tcp::resolver::iterator iterator = resolver.resolve(query);
-  socket_.connect(*iterator);
+/*
+ * Set on the client's io_service threads, which must never wait for a reply.
+ */
+static thread_local bool seqr_io_thread = false;
+
+/*
+ * A connection to the sequencer. All of its state is only touched through
+ * its strand, so the connections in a pool make progress independently.
+ *
+ * Every read and write handler records the generation of the socket it was
+ * issued on. When the connection fails the generation changes, so handlers
+ * for the old socket that complete afterwards are ignored.
+ *
+ * Which endpoint to connect to is decided by the client, which keeps every
+ * connection on the same sequencer.
+ */
+class SeqrClient::Connection {
+ public:
+  explicit Connection(SeqrClient *client) :
+    client_(client), strand_(client->io_service_),
+    socket_(client->io_service_), timer_(client->io_service_),
+    endpoints_(client->endpoints_), endpoint_(0), connected_(false), gen_(0),
+    backoff_ms_(SEQR_RECONNECT_MIN_MS), writing_(false)
+  {}
+
+  /*
+   * Initial connection, before the io_service threads start. Tries each
+   * endpoint once and throws if none can be reached.
+   */
+  void Connect();
+
+  bool Connected() const {
+    return connected_;
+  }
+
+  /*
+   * Drop the connection if it isn't to the client's current endpoint. Safe
+   * to call from any thread.
+   */
+  void Reset() {
+    strand_.post([this] {
+      if (connected_ && endpoint_ != client_->endpoint_)
+        Fail(-EAGAIN);
+    });
+  }
+
+  /*
+   * Queue a framed request. Safe to call from any thread.
+   */
+  void Send(uint64_t req_id, std::shared_ptr<std::string> msg,
+      reply_cb_t callback) {
+    Pending p;
+    p.callback = callback;
+    strand_.post(std::bind(&Connection::QueueRequest, this,
+          req_id, msg, p));
+  }
+
+  void SendFrame(uint64_t req_id, std::shared_ptr<std::string> msg,
+      frame_cb_t callback) {
+    Pending p;
+    p.frame_callback = callback;
+    strand_.post(std::bind(&Connection::QueueRequest, this,
+          req_id, msg, p));
+  }
+
+  /*
+   * Close the connection for good, failing its requests with -ESHUTDOWN.
+   * Safe to call from any thread, once the client is shutting down.
+   */
+  void Shutdown() {
+    strand_.post([this] {
+      connected_ = false;
+      gen_++;
+      writing_ = false;
+
+      boost::system::error_code ec;
+      socket_.close(ec);
+      timer_.cancel(ec);
+
+      FailPending(-ESHUTDOWN);
+    });
+  }
+
+ private:
+  /*
+   * Exactly one callback is set, depending on how the request was sent.
+   */
+  struct Pending {
+    reply_cb_t callback;
+    frame_cb_t frame_callback;
+  };
+
+  void QueueRequest(uint64_t req_id, std::shared_ptr<std::string> msg,
+      Pending pending);
+  void StartWrite();
+  void HandleWrite(uint64_t gen, const boost::system::error_code& err);
+  void StartRead();
+  void HandleHdr(uint64_t gen, const boost::system::error_code& err);
+  void HandleMsg(uint64_t gen, const boost::system::error_code& err);
+  void HandleFrame(uint64_t gen, const boost::system::error_code& err);
+
+  void Established();
+  void Fail(int ret);
+  void FailPending(int ret);
+  void ScheduleReconnect();
+  void HandleConnect(size_t endpoint, const boost::system::error_code& err);
+
+  SeqrClient *client_;
+  boost::asio::io_service::strand strand_;
+  boost::asio::generic::stream_protocol::socket socket_;
+  boost::asio::deadline_timer timer_;
+
+  /*
+   * endpoints_, endpoint_:
+   *   - candidate sequencers and the one last connected to
+   * connected_, gen_:
+   *   - connection state and socket generation
+   * backoff_ms_:
+   *   - delay before the next reconnect attempt
+   */
+  const std::vector<Endpoint>& endpoints_;
+  size_t endpoint_;
+  std::atomic<bool> connected_;
+  uint64_t gen_;
+  int backoff_ms_;
+
+  /*
+   * pending_:
+   *   - requests waiting for a reply, by request id
+   * out_queue_, out_buf_, writing_:
+   *   - framed requests waiting to be sent. Everything queued while a write
+   *     is in progress goes out together in the next write.
+   * in_hdr_, in_buf_, in_frame_:
+   *   - reply being received
+   */
+  std::map<uint64_t, Pending> pending_;
+  std::deque<std::shared_ptr<std::string>> out_queue_;
+  std::shared_ptr<std::string> out_buf_;
+  bool writing_;
+  uint32_t in_hdr_;
+  std::vector<char> in_buf_;
+  SeqrFrameReply in_frame_;
+};
+
+void SeqrClient::Connection::Connect()
+{
+  boost::system::error_code ec = boost::asio::error::host_not_found;
+  for (size_t i = 0; i < endpoints_.size(); i++) {
+    size_t endpoint = client_->endpoint_;
+    boost::system::error_code unused;
+    socket_.close(unused);
+    socket_.connect(endpoints_[endpoint].ep, ec);
+    if (!ec) {
+      endpoint_ = endpoint;
+      break;
+    }
+    std::cerr << "seqr client failed to connect to "
+      << endpoints_[endpoint].name << ": " << ec.message() << std::endl;
+    client_->Failover(endpoint);
+  }
+
+  if (ec)
+    throw boost::system::system_error(ec);
+
+  Established();
 }
 
-int SeqrClient::CheckTail(uint64_t epoch, const std::string& pool,
-    const std::string& name, uint64_t *position, bool next) {
-  // fill in msg
-  zlog_proto::MSeqRequest req;
-  req.set_epoch(epoch);
-  req.set_name(name);
-  req.set_next(next);
-  req.set_pool(pool);
-  req.set_count(1);
+void SeqrClient::Connection::Established()
+{
+  // fails harmlessly on unix domain sockets
+  boost::system::error_code ec;
+  socket_.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+
+  connected_ = true;
+  backoff_ms_ = SEQR_RECONNECT_MIN_MS;
+
+  StartRead();
+  StartWrite();
+}
+
+/*
+ * Requests made while the connection is down are held until the next
+ * reconnect attempt: they are sent if it succeeds and fail with -EAGAIN if
+ * it doesn't.
+ */
+void SeqrClient::Connection::QueueRequest(uint64_t req_id,
+    std::shared_ptr<std::string> msg, Pending pending)
+{
+  if (client_->shutdown_) {
+    if (pending.callback)
+      pending.callback(-ESHUTDOWN, zlog_proto::MSeqReply());
+    else
+      pending.frame_callback(-ESHUTDOWN, SeqrFrameReply());
+    return;
+  }
+
+  pending_[req_id] = pending;
+  out_queue_.push_back(msg);
+  StartWrite();
+}
+
+void SeqrClient::Connection::StartWrite()
+{
+  if (!connected_ || writing_ || out_queue_.empty())
+    return;
+
+  out_buf_ = std::make_shared<std::string>();
+  for (const auto& msg : out_queue_)
+    out_buf_->append(*msg);
+  out_queue_.clear();
+
+  writing_ = true;
+  uint64_t gen = gen_;
+  std::shared_ptr<std::string> buf = out_buf_;
+  boost::asio::async_write(socket_, boost::asio::buffer(*buf),
+      strand_.wrap([this, gen, buf](const boost::system::error_code& err,
+          size_t size) {
+    HandleWrite(gen, err);
+  }));
+}
+
+void SeqrClient::Connection::HandleWrite(uint64_t gen,
+    const boost::system::error_code& err)
+{
+  if (gen != gen_)
+    return;
+
+  writing_ = false;
+
+  if (err) {
+    std::cerr << "seqr client write failed: " << err.message() << std::endl;
+    Fail(-EAGAIN);
+    return;
+  }
+
+  StartWrite();
+}
+
+void SeqrClient::Connection::StartRead()
+{
+  uint64_t gen = gen_;
+  boost::asio::async_read(socket_,
+      boost::asio::buffer(&in_hdr_, sizeof(in_hdr_)),
+      strand_.wrap([this, gen](const boost::system::error_code& err,
+          size_t size) {
+    HandleHdr(gen, err);
+  }));
+}
+
+void SeqrClient::Connection::HandleHdr(uint64_t gen,
+    const boost::system::error_code& err)
+{
+  if (gen != gen_)
+    return;
+
+  if (err) {
+    std::cerr << "seqr client read failed: " << err.message() << std::endl;
+    Fail(-EAGAIN);
+    return;
+  }
+
+  uint32_t msg_size = ntohl(in_hdr_);
+
+  if (msg_size & SEQR_FRAME_FLAG) {
+    if ((msg_size & ~SEQR_FRAME_FLAG) != sizeof(in_frame_)) {
+      std::cerr << "seqr client received invalid frame" << std::endl;
+      Fail(-EIO);
+      return;
+    }
+    boost::asio::async_read(socket_,
+        boost::asio::buffer(&in_frame_, sizeof(in_frame_)),
+        strand_.wrap([this, gen](const boost::system::error_code& err,
+            size_t size) {
+      HandleFrame(gen, err);
+    }));
+    return;
+  }
+
+  if (msg_size > SEQR_MAX_MSG_SIZE) {
+    std::cerr << "seqr client reply too large (" << msg_size << ")" << std::endl;
+    Fail(-EIO);
+    return;
+  }
+
+  in_buf_.resize(msg_size);
+  boost::asio::async_read(socket_, boost::asio::buffer(in_buf_),
+      strand_.wrap([this, gen](const boost::system::error_code& err,
+          size_t size) {
+    HandleMsg(gen, err);
+  }));
+}
+
+/*
+ * A sequencer that predates request ids doesn't echo them, but it also
+ * replies in order, so the oldest pending request is the one being answered.
+ */
+void SeqrClient::Connection::HandleMsg(uint64_t gen,
+    const boost::system::error_code& err)
+{
+  if (gen != gen_)
+    return;
+
+  if (err) {
+    std::cerr << "seqr client read failed: " << err.message() << std::endl;
+    Fail(-EAGAIN);
+    return;
+  }
+
+  zlog_proto::MSeqReply reply;
+  if (!reply.ParseFromArray(in_buf_.data(), in_buf_.size()) ||
+      !reply.IsInitialized()) {
+    std::cerr << "seqr client received invalid reply" << std::endl;
+    Fail(-EIO);
+    return;
+  }
+
+  auto it = reply.has_req_id() ? pending_.find(reply.req_id()) :
+    pending_.begin();
+  if (it == pending_.end() || !it->second.callback) {
+    std::cerr << "seqr client received unexpected reply" << std::endl;
+    Fail(-EIO);
+    return;
+  }
+
+  reply_cb_t callback = it->second.callback;
+  pending_.erase(it);
+
+  StartRead();
+
+  callback(0, reply);
+}
+
+void SeqrClient::Connection::HandleFrame(uint64_t gen,
+    const boost::system::error_code& err)
+{
+  if (gen != gen_)
+    return;
+
+  if (err) {
+    std::cerr << "seqr client read failed: " << err.message() << std::endl;
+    Fail(-EAGAIN);
+    return;
+  }
+
+  SeqrFrameReply reply;
+  reply.status = le32toh(in_frame_.status);
+  reply.count = le32toh(in_frame_.count);
+  reply.req_id = le64toh(in_frame_.req_id);
+  reply.position = le64toh(in_frame_.position);
+
+  auto it = pending_.find(reply.req_id);
+  if (it == pending_.end() || !it->second.frame_callback) {
+    std::cerr << "seqr client received unexpected reply" << std::endl;
+    Fail(-EIO);
+    return;
+  }
+
+  frame_cb_t callback = it->second.frame_callback;
+  pending_.erase(it);
+
+  StartRead();
+
+  callback(0, reply);
+}
+
+/*
+ * Drop the connection and start reconnecting. When the socket is lost,
+ * whether the sequencer saw the requests in flight is unknown, so they fail
+ * with -EAGAIN and are retried by the caller. A request for a new position
+ * that did reach the sequencer only leaves a hole in the log. A protocol
+ * error fails them with -EIO: retrying against the same sequencer won't
+ * help.
+ */
+void SeqrClient::Connection::Fail(int ret)
+{
+  connected_ = false;
+  gen_++;
+  writing_ = false;
+
+  boost::system::error_code ec;
+  socket_.close(ec);
+
+  FailPending(ret);
+
+  ScheduleReconnect();
+}
+
+void SeqrClient::Connection::FailPending(int ret)
+{
+  std::map<uint64_t, Pending> pending;
+  pending.swap(pending_);
+  out_queue_.clear();
+
+  zlog_proto::MSeqReply reply;
+  SeqrFrameReply frame;
+  memset(&frame, 0, sizeof(frame));
+  for (auto& it : pending) {
+    if (it.second.callback)
+      it.second.callback(ret, reply);
+    else
+      it.second.frame_callback(ret, frame);
+  }
+}
+
+void SeqrClient::Connection::ScheduleReconnect()
+{
+  if (client_->shutdown_)
+    return;
+
+  timer_.expires_from_now(boost::posix_time::milliseconds(backoff_ms_));
+  timer_.async_wait(strand_.wrap([this](const boost::system::error_code& err) {
+    if (err || client_->shutdown_)
+      return;
+    size_t endpoint = client_->endpoint_;
+    socket_.async_connect(endpoints_[endpoint].ep,
+        strand_.wrap([this, endpoint](const boost::system::error_code& err) {
+      HandleConnect(endpoint, err);
+    }));
+  }));
+}
+
+/*
+ * After a failed attempt the client moves on to the next endpoint, which is
+ * tried after a longer delay. A connection made to an endpoint the client
+ * has since moved off is dropped again.
+ */
+void SeqrClient::Connection::HandleConnect(size_t endpoint,
+    const boost::system::error_code& err)
+{
+  if (client_->shutdown_) {
+    boost::system::error_code ec;
+    socket_.close(ec);
+    return;
+  }
+
+  if (err) {
+    std::cerr << "seqr client failed to reconnect to "
+      << endpoints_[endpoint].name << ": " << err.message() << std::endl;
+
+    boost::system::error_code ec;
+    socket_.close(ec);
+
+    client_->Failover(endpoint);
+    backoff_ms_ = std::min(backoff_ms_ * 2, SEQR_RECONNECT_MAX_MS);
+
+    FailPending(-EAGAIN);
+    ScheduleReconnect();
+    return;
+  }
+
+  std::cerr << "seqr client reconnected to "
+    << endpoints_[endpoint].name << std::endl;
+
+  endpoint_ = endpoint;
+  Established();
+
+  if (endpoint_ != client_->endpoint_)
+    Fail(-EAGAIN);
+}
+
+SeqrClient::SeqrClient(const char *host, const char *port,
+    size_t connections) :
+  use_shm_(false), endpoint_(0), probe_timer_(io_service_),
+  shutdown_(false), connected_(false),
+  num_conns_(std::max(connections, (size_t)1)),
+  binary_frames_(false), next_req_id_(1), next_conn_(0)
+{
+  endpoint_names_.push_back(std::string(host) + ":" + port);
+}
+
+SeqrClient::SeqrClient(const std::vector<std::string>& endpoints,
+    size_t connections) :
+  endpoint_names_(endpoints), use_shm_(false), endpoint_(0),
+  probe_timer_(io_service_), shutdown_(false), connected_(false),
+  num_conns_(std::max(connections, (size_t)1)),
+  binary_frames_(false), next_req_id_(1), next_conn_(0)
+{}
+
+/*
+ * The io_service isn't stopped out from under pending requests. Requests
+ * waiting on a connection or a retry timer fail with -ESHUTDOWN instead, so
+ * every callback runs (and aio completions waiting on one complete), and the
+ * io_service threads exit once nothing is left to run.
+ */
+SeqrClient::~SeqrClient()
+{
+  {
+    std::lock_guard<std::mutex> l(timers_lock_);
+    shutdown_ = true;
+    boost::system::error_code ec;
+    probe_timer_.cancel(ec);
+    for (auto& timer : retry_timers_)
+      timer->cancel(ec);
+  }
+
+  for (auto conn : conns_)
+    conn->Shutdown();
+
+  if (shm_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> l(shm_queue_lock_);
+      shm_cond_.notify_one();
+    }
+    shm_thread_.join();
+  }
+
+  if (!threads_.empty()) {
+    work_.reset();
+    for (auto& thread : threads_)
+      thread.join();
+  }
+
+  for (auto conn : conns_)
+    delete conn;
+}
+
+/*
+ * Socket endpoints are resolved once, here. Endpoints that don't resolve
+ * are skipped.
+ */
+void SeqrClient::Connect()
+{
+  std::lock_guard<std::mutex> l(lock_);
+
+  if (connected_)
+    return;
+
+  boost::system::error_code ec = boost::asio::error::host_not_found;
+
+  if (endpoints_.empty()) {
+    boost::asio::ip::tcp::resolver resolver(io_service_);
+    for (const auto& name : endpoint_names_) {
+      if (name.compare(0, 4, "shm:") == 0) {
+        if (!shm_) {
+          shm_name_ = name.substr(4);
+          shm_.reset(ShmRing::Open(shm_name_));
+          shm_reopened_ = std::chrono::steady_clock::now();
+        }
+        continue;
+      }
+
+      Endpoint endpoint;
+      endpoint.name = name;
+
+      if (name.compare(0, 5, "unix:") == 0) {
+        endpoint.ep = boost::asio::local::stream_protocol::endpoint(
+            name.substr(5));
+        endpoints_.push_back(endpoint);
+        continue;
+      }
+
+      size_t pos = name.rfind(':');
+      if (pos == std::string::npos) {
+        std::cerr << "seqr client ignoring endpoint without a port: "
+          << name << std::endl;
+        continue;
+      }
+
+      boost::asio::ip::tcp::resolver::query query(
+          boost::asio::ip::tcp::v4(), name.substr(0, pos),
+          name.substr(pos + 1));
+      boost::asio::ip::tcp::resolver::iterator iterator =
+        resolver.resolve(query, ec);
+      if (ec) {
+        std::cerr << "seqr client failed to resolve " << name
+          << ": " << ec.message() << std::endl;
+        continue;
+      }
+      endpoint.ep = boost::asio::ip::tcp::endpoint(*iterator);
+      endpoints_.push_back(endpoint);
+    }
+  }
+
+  /*
+   * The poller thread serves asynchronous requests, and the io_service
+   * thread runs their callbacks and retry timers.
+   */
+  if (shm_) {
+    use_shm_ = true;
+    work_.reset(new boost::asio::io_service::work(io_service_));
+    threads_.push_back(std::thread([this] {
+      seqr_io_thread = true;
+      io_service_.run();
+    }));
+    shm_thread_ = std::thread([this] {
+      seqr_io_thread = true;
+      ShmPoll();
+    });
+    connected_ = true;
+    return;
+  }
+
+  if (endpoints_.empty())
+    throw boost::system::system_error(ec);
+
+  std::vector<Connection*> conns;
+  try {
+    for (size_t i = 0; i < num_conns_; i++) {
+      Connection *conn = new Connection(this);
+      conns.push_back(conn);
+      conn->Connect();
+    }
+  } catch (...) {
+    for (auto conn : conns)
+      delete conn;
+    throw;
+  }
+  conns_.swap(conns);
+
+  /*
+   * Connections made before a later one failed over are still on the old
+   * endpoint.
+   */
+  ResetConnections();
+  if (endpoints_.size() > 1)
+    StartProbe();
+
+  work_.reset(new boost::asio::io_service::work(io_service_));
+  for (size_t i = 0; i < num_conns_; i++) {
+    threads_.push_back(std::thread([this] {
+      seqr_io_thread = true;
+      io_service_.run();
+    }));
+  }
+
+  connected_ = true;
+}
+
+void SeqrClient::Failover(size_t failed)
+{
+  size_t next = (failed + 1) % endpoints_.size();
+  if (!endpoint_.compare_exchange_strong(failed, next))
+    return;
+
+  std::cerr << "seqr client failing over to "
+    << endpoints_[next].name << std::endl;
+
+  ResetConnections();
+}
+
+void SeqrClient::ResetConnections()
+{
+  for (auto conn : conns_)
+    conn->Reset();
+}
+
+/*
+ * The first endpoint is the preferred sequencer. Once it accepts a
+ * connection again every connection is moved back to it.
+ */
+void SeqrClient::StartProbe()
+{
+  std::lock_guard<std::mutex> l(timers_lock_);
+  if (shutdown_)
+    return;
+
+  probe_timer_.expires_from_now(
+      boost::posix_time::milliseconds(SEQR_PROBE_INTERVAL_MS));
+  probe_timer_.async_wait([this](const boost::system::error_code& err) {
+    if (err)
+      return;
+
+    size_t cur = endpoint_;
+    if (cur == 0) {
+      StartProbe();
+      return;
+    }
+
+    auto socket = std::make_shared<
+      boost::asio::generic::stream_protocol::socket>(io_service_);
+    socket->async_connect(endpoints_[0].ep,
+        [this, socket, cur](const boost::system::error_code& err) {
+      boost::system::error_code ec;
+      socket->close(ec);
+
+      size_t expected = cur;
+      if (!err && endpoint_.compare_exchange_strong(expected, 0)) {
+        std::cerr << "seqr client switching back to "
+          << endpoints_[0].name << std::endl;
+        ResetConnections();
+      }
+
+      StartProbe();
+    });
+  });
+}
+
+void SeqrClient::PrepareRequest(zlog_proto::MSeqRequest& req)
+{
+  req.set_req_id(next_req_id_++);
+  req.set_features(use_shm_ ? SEQR_FEATURES & ~SEQR_FEATURE_BINARY_FRAME :
+      SEQR_FEATURES);
+  assert(req.IsInitialized());
+}
+
+/*
+ * Over shared memory the request is handed to the poller thread, so the
+ * caller doesn't spin waiting for the reply. Otherwise it is framed on
+ * the calling thread and handed to the next connection in the pool that is
+ * up. If none are, it waits on the next connection for its reconnect
+ * attempt.
+ */
+void SeqrClient::Call(zlog_proto::MSeqRequest& req, reply_cb_t callback)
+{
+  assert(connected_);
+
+  PrepareRequest(req);
+  uint64_t req_id = req.req_id();
+
+  if (use_shm_) {
+    ShmSubmit(req, callback);
+    return;
+  }
 
   // serialize header and protobuf message
   uint32_t msg_size = req.ByteSize();
   uint32_t be_msg_size = htonl(msg_size);
-  uint32_t total_msg_size = msg_size + sizeof(be_msg_size);
-  assert(total_msg_size <= sizeof(buffer));
 
-  // add header
-  memcpy(buffer, &be_msg_size, sizeof(be_msg_size));
+  auto msg = std::make_shared<std::string>();
+  msg->resize(sizeof(be_msg_size) + msg_size);
+  memcpy(&(*msg)[0], &be_msg_size, sizeof(be_msg_size));
+  bool ok = req.SerializeToArray(&(*msg)[sizeof(be_msg_size)], msg_size);
+  assert(ok);
+  (void)ok;
 
-  // add protobuf msg
-  assert(req.IsInitialized());
-  assert(req.SerializeToArray(buffer + sizeof(be_msg_size), msg_size));
+  PickConnection()->Send(req_id, msg, callback);
+}
+
+SeqrClient::Connection *SeqrClient::PickConnection()
+{
+  size_t start = next_conn_++;
+  Connection *conn = conns_[start % conns_.size()];
+  for (size_t i = 0; i < conns_.size(); i++) {
+    Connection *candidate = conns_[(start + i) % conns_.size()];
+    if (candidate->Connected()) {
+      conn = candidate;
+      break;
+    }
+  }
+  return conn;
+}
+
+/*
+ * Only used over sockets: handles are never learned over shared memory.
+ */
+void SeqrClient::CallFrame(SeqrFrameRequest& req, frame_cb_t callback)
+{
+  assert(connected_);
+  assert(!use_shm_);
+
+  req.req_id = next_req_id_++;
+
+  uint32_t be_msg_size = htonl(SEQR_FRAME_FLAG | sizeof(SeqrFrameRequest));
+
+  SeqrFrameRequest frame;
+  frame.op = htole32(req.op);
+  frame.count = htole32(req.count);
+  frame.req_id = htole64(req.req_id);
+  frame.handle = htole64(req.handle);
+  frame.epoch = htole64(req.epoch);
+
+  auto msg = std::make_shared<std::string>();
+  msg->reserve(sizeof(be_msg_size) + sizeof(frame));
+  msg->append((const char*)&be_msg_size, sizeof(be_msg_size));
+  msg->append((const char*)&frame, sizeof(frame));
+
+  PickConnection()->SendFrame(req.req_id, msg, callback);
+}
 
-  // send
-  boost::asio::write(socket_, boost::asio::buffer(buffer, total_msg_size));
+int SeqrClient::SendRecvFrame(SeqrFrameRequest& req, SeqrFrameReply& reply)
+{
+  // the reply is delivered on an io_service thread
+  assert(!seqr_io_thread);
+
+  std::mutex lock;
+  std::condition_variable cond;
+  bool done = false;
+  int ret = 0;
+
+  CallFrame(req, [&](int err, const SeqrFrameReply& r) {
+    std::lock_guard<std::mutex> l(lock);
+    ret = err;
+    if (!err)
+      reply = r;
+    done = true;
+    cond.notify_one();
+  });
+
+  std::unique_lock<std::mutex> l(lock);
+  cond.wait(l, [&]{ return done; });
+
+  return ret;
+}
+
+bool SeqrClient::LookupHandle(const std::string& pool,
+    const std::string& name, uint64_t *handle)
+{
+  std::lock_guard<std::mutex> l(handles_lock_);
+  auto it = handles_.find(std::make_pair(pool, name));
+  if (it == handles_.end())
+    return false;
+  *handle = it->second;
+  return true;
+}
+
+void SeqrClient::UpdateHandle(const std::string& pool,
+    const std::string& name, const zlog_proto::MSeqReply& reply)
+{
+  if (reply.features() & SEQR_FEATURE_BINARY_FRAME)
+    binary_frames_ = true;
+
+  if (!reply.has_log_handle())
+    return;
+
+  std::lock_guard<std::mutex> l(handles_lock_);
+  handles_[std::make_pair(pool, name)] = reply.log_handle();
+}
+
+/*
+ * Another thread may already have replaced the rejected handle.
+ */
+void SeqrClient::ForgetHandle(const std::string& pool,
+    const std::string& name, uint64_t handle)
+{
+  std::lock_guard<std::mutex> l(handles_lock_);
+  auto it = handles_.find(std::make_pair(pool, name));
+  if (it != handles_.end() && it->second == handle)
+    handles_.erase(it);
+}
+
+bool SeqrClient::UseFrames(const std::string& pool,
+    const std::string& name, uint64_t *handle)
+{
+  return !use_shm_ && binary_frames_ && LookupHandle(pool, name, handle);
+}
+
+int SeqrClient::FrameResult(const std::string& pool,
+    const std::string& name, uint64_t handle, const SeqrFrameReply& reply,
+    size_t count)
+{
+  switch (reply.status) {
+    case SEQR_FRAME_OK:
+      if (reply.count != count)
+        break;
+      return 0;
+    case SEQR_FRAME_INIT_LOG:
+      return -EAGAIN;
+    case SEQR_FRAME_STALE_EPOCH:
+      return -ERANGE;
+    case SEQR_FRAME_BAD_HANDLE:
+      ForgetHandle(pool, name, handle);
+      return -ENOENT;
+    case SEQR_FRAME_INVALID:
+      return -EINVAL;
+  }
+
+  std::cerr << "seqr client received malformed reply" << std::endl;
+  return -EIO;
+}
+
+int SeqrClient::CheckTailFrame(uint64_t epoch, const std::string& pool,
+    const std::string& name, bool next, size_t count, uint64_t *position)
+{
+  uint64_t handle;
+  if (!UseFrames(pool, name, &handle))
+    return -ENOENT;
+
+  SeqrFrameRequest req;
+  req.op = next ? SEQR_FRAME_OP_NEXT : SEQR_FRAME_OP_READ;
+  req.count = count;
+  req.handle = handle;
+  req.epoch = epoch;
+
+  SeqrFrameReply reply;
+  int ret = SendRecvFrame(req, reply);
+  if (ret)
+    return ret;
+
+  ret = FrameResult(pool, name, handle, reply, count);
+  if (ret)
+    return ret;
+
+  *position = reply.position;
+
+  return 0;
+}
+
+void SeqrClient::SetLog(zlog_proto::MSeqRequest& req,
+    const std::string& pool, const std::string& name)
+{
+  uint64_t handle;
+  if (LookupHandle(pool, name, &handle)) {
+    req.clear_pool();
+    req.clear_name();
+    req.set_log_handle(handle);
+  } else {
+    req.clear_log_handle();
+    req.set_pool(pool);
+    req.set_name(name);
+  }
+}
+
+int SeqrClient::SendRecvLog(zlog_proto::MSeqRequest& req,
+    const std::string& pool, const std::string& name,
+    zlog_proto::MSeqReply& reply)
+{
+  for (;;) {
+    SetLog(req, pool, name);
+
+    int ret = SendRecv(req, reply);
+    if (ret)
+      return ret;
+
+    if (reply.status() == zlog_proto::MSeqReply::BAD_HANDLE &&
+        req.has_log_handle()) {
+      ForgetHandle(pool, name, req.log_handle());
+      continue;
+    }
+
+    UpdateHandle(pool, name, reply);
+
+    return 0;
+  }
+}
+
+/*
+ * A ring that timed out may belong to a sequencer that was restarted, and
+ * one that went away may have been replaced, so both are opened again. The
+ * caller retries the request.
+ */
+static int parse_shm_reply(const std::string& in,
+    zlog_proto::MSeqReply& reply)
+{
+  if (!reply.ParseFromString(in) || !reply.IsInitialized()) {
+    std::cerr << "seqr client received invalid reply" << std::endl;
+    return -EIO;
+  }
+  return 0;
+}
+
+int SeqrClient::ShmCall(const zlog_proto::MSeqRequest& req,
+    zlog_proto::MSeqReply& reply)
+{
+  std::string out;
+  bool ok = req.SerializeToString(&out);
+  assert(ok);
+  (void)ok;
+
+  std::shared_ptr<ShmRing> ring = std::atomic_load(&shm_);
+
+  std::string in;
+  int ret = ring->Call(out, in);
+  if (ret == -ETIMEDOUT || ret == -ESTALE) {
+    ReopenShm(ring);
+    return -EAGAIN;
+  }
+
+  if (ret == 0)
+    ret = parse_shm_reply(in, reply);
+
+  return ret;
+}
+
+void SeqrClient::ShmSubmit(const zlog_proto::MSeqRequest& req,
+    reply_cb_t callback)
+{
+  ShmRequest r;
+  bool ok = req.SerializeToString(&r.msg);
+  assert(ok);
+  (void)ok;
+  r.callback = callback;
+  r.slot = 0;
+  r.start = std::chrono::steady_clock::now();
+
+  {
+    std::lock_guard<std::mutex> l(shm_queue_lock_);
+    if (!shutdown_) {
+      shm_queue_.push_back(r);
+      shm_cond_.notify_one();
+      return;
+    }
+  }
+
+  ShmReply(r, -ESHUTDOWN, zlog_proto::MSeqReply());
+}
+
+void SeqrClient::ShmReply(const ShmRequest& r, int ret,
+    const zlog_proto::MSeqReply& reply)
+{
+  reply_cb_t callback = r.callback;
+  io_service_.post([callback, ret, reply] {
+    callback(ret, reply);
+  });
+}
+
+/*
+ * Requests are posted to the ring in the order they were made, as slots
+ * free up. A request that waits too long for a slot, or for its reply,
+ * fails with -EAGAIN like a synchronous one. The thread only spins while
+ * requests are outstanding.
+ */
+void SeqrClient::ShmPoll()
+{
+  const auto timeout = std::chrono::microseconds(SEQR_SHM_TIMEOUT_US);
+  std::deque<ShmRequest> waiting;
+  std::list<ShmRequest> inflight;
+
+  for (uint64_t spins = 1;; spins++) {
+    bool shutdown;
+    {
+      std::unique_lock<std::mutex> l(shm_queue_lock_);
+      if (waiting.empty() && inflight.empty())
+        shm_cond_.wait(l, [this] {
+          return shutdown_ || !shm_queue_.empty();
+        });
+      for (auto& r : shm_queue_)
+        waiting.push_back(r);
+      shm_queue_.clear();
+      shutdown = shutdown_;
+    }
+
+    if (shutdown) {
+      for (auto& r : inflight) {
+        std::string unused;
+        if (!r.ring->Cancel(r.slot))
+          r.ring->Complete(r.slot, unused);
+        ShmReply(r, -ESHUTDOWN, zlog_proto::MSeqReply());
+      }
+      for (auto& r : waiting)
+        ShmReply(r, -ESHUTDOWN, zlog_proto::MSeqReply());
+      return;
+    }
+
+    bool progress = false;
+    auto now = std::chrono::steady_clock::now();
+
+    while (!waiting.empty()) {
+      ShmRequest& r = waiting.front();
+      std::shared_ptr<ShmRing> ring = std::atomic_load(&shm_);
+      int ret = ring->Submit(r.msg, &r.slot);
+      if (ret == -EBUSY && now - r.start <= timeout)
+        break;
+      if (ret == 0) {
+        r.ring = ring;
+        r.start = now;
+        inflight.push_back(r);
+      } else {
+        if (ret == -EBUSY || ret == -ESTALE) {
+          ReopenShm(ring);
+          ret = -EAGAIN;
+        }
+        ShmReply(r, ret, zlog_proto::MSeqReply());
+      }
+      waiting.pop_front();
+      progress = true;
+    }
+
+    for (auto it = inflight.begin(); it != inflight.end();) {
+      std::string in;
+      int ret = it->ring->Complete(it->slot, in);
+      if (ret == -EINPROGRESS) {
+        if ((spins % 128) != 0 ||
+            (!it->ring->Stale() && now - it->start <= timeout) ||
+            !it->ring->Cancel(it->slot)) {
+          it++;
+          continue;
+        }
+        ReopenShm(it->ring);
+        ShmReply(*it, -EAGAIN, zlog_proto::MSeqReply());
+      } else {
+        zlog_proto::MSeqReply reply;
+        ret = parse_shm_reply(in, reply);
+        ShmReply(*it, ret, reply);
+      }
+      it = inflight.erase(it);
+      progress = true;
+    }
+
+    if (!progress)
+      std::this_thread::yield();
+  }
+}
+
+/*
+ * Requests keep using the old ring until a new one opens. A ring with the
+ * same generation is the one already mapped.
+ */
+void SeqrClient::ReopenShm(std::shared_ptr<ShmRing> failed)
+{
+  std::lock_guard<std::mutex> l(shm_lock_);
+
+  if (std::atomic_load(&shm_) != failed)
+    return;
+
+  auto now = std::chrono::steady_clock::now();
+  if (now - shm_reopened_ <
+      std::chrono::milliseconds(SEQR_SHM_REOPEN_MS))
+    return;
+  shm_reopened_ = now;
+
+  std::shared_ptr<ShmRing> ring(ShmRing::Open(shm_name_));
+  if (!ring || ring->Generation() == failed->Generation())
+    return;
+
+  std::cerr << "seqr client reopened shm ring " << shm_name_ << std::endl;
+  std::atomic_store(&shm_, ring);
+}
+
+int SeqrClient::SendRecv(zlog_proto::MSeqRequest& req,
+    zlog_proto::MSeqReply& reply)
+{
+  if (use_shm_) {
+    assert(connected_);
+    PrepareRequest(req);
+    return ShmCall(req, reply);
+  }
+
+  // the reply is delivered on an io_service thread
+  assert(!seqr_io_thread);
+
+  std::mutex lock;
+  std::condition_variable cond;
+  bool done = false;
+  int ret = 0;
+
+  Call(req, [&](int err, const zlog_proto::MSeqReply& r) {
+    std::lock_guard<std::mutex> l(lock);
+    ret = err;
+    if (!err)
+      reply.CopyFrom(r);
+    done = true;
+    cond.notify_one();
+  });
+
+  std::unique_lock<std::mutex> l(lock);
+  cond.wait(l, [&]{ return done; });
+
+  return ret;
+}
 
-  // get reply
-  boost::asio::read(socket_, boost::asio::buffer(&be_msg_size, sizeof(be_msg_size)));
-  msg_size = ntohl(be_msg_size);
-  assert(msg_size < sizeof(buffer));
-  boost::asio::read(socket_, boost::asio::buffer(buffer, msg_size));
+/*
+ * Registration doesn't depend on the epoch.
+ */
+int SeqrClient::RegisterLog(const std::string& pool, const std::string& name,
+    uint64_t *handle)
+{
+  zlog_proto::MSeqRequest req;
+  req.set_epoch(0);
+  req.set_pool(pool);
+  req.set_name(name);
+  req.set_next(false);
+  req.set_count(1);
+  req.set_register_log(true);
+
+  zlog_proto::MSeqReply reply;
+  int ret = SendRecv(req, reply);
+  if (ret)
+    return ret;
+
+  if (reply.status() == zlog_proto::MSeqReply::INIT_LOG)
+    return -EAGAIN;
+  else if (reply.status() == zlog_proto::MSeqReply::INVALID)
+    return -EINVAL;
+  else if (reply.status() != zlog_proto::MSeqReply::OK) {
+    std::cerr << "seqr client received malformed reply" << std::endl;
+    return -EIO;
+  } else if (!reply.has_log_handle())
+    return -ENOSPC;
+
+  UpdateHandle(pool, name, reply);
+
+  *handle = reply.log_handle();
+
+  return 0;
+}
+
+int SeqrClient::CheckTail(uint64_t epoch, const std::string& pool,
+    const std::string& name, uint64_t *position, bool next) {
+  int ret = CheckTailFrame(epoch, pool, name, next, 1, position);
+  if (ret != -ENOENT)
+    return ret;
+
+  // fill in msg
+  zlog_proto::MSeqRequest req;
+  req.set_epoch(epoch);
+  req.set_next(next);
+  req.set_count(1);
 
-  // deserialize
   zlog_proto::MSeqReply reply;
-  assert(reply.ParseFromArray(buffer, msg_size));
-  assert(reply.IsInitialized());
+  ret = SendRecvLog(req, pool, name, reply);
+  if (ret)
+    return ret;
 
   if (reply.status() == zlog_proto::MSeqReply::INIT_LOG)
     return -EAGAIN;
   else if (reply.status() == zlog_proto::MSeqReply::STALE_EPOCH)
     return -ERANGE;
-  else {
-    assert(reply.status() == zlog_proto::MSeqReply::OK);
-    assert(reply.position_size() == 1);
-    *position = reply.position(0);
+  else if (reply.status() == zlog_proto::MSeqReply::INVALID)
+    return -EINVAL;
+  else if (reply.status() != zlog_proto::MSeqReply::OK ||
+      reply.position_size() != 1) {
+    std::cerr << "seqr client received malformed reply" << std::endl;
+    return -EIO;
   }
 
+  *position = reply.position(0);
+
   return 0;
 }
 
 int SeqrClient::CheckTail(uint64_t epoch, const std::string& pool,
     const std::string& name, std::vector<uint64_t>& positions, size_t count)
 {
-  if (count <= 0 || count > 100)
+  uint64_t start;
+  int ret = CheckTailRange(epoch, pool, name, count, &start);
+  if (ret)
+    return ret;
+
+  std::vector<uint64_t> result;
+  result.reserve(count);
+  for (size_t i = 0; i < count; i++)
+    result.push_back(start + i);
+  positions.swap(result);
+
+  return 0;
+}
+
+int SeqrClient::CheckTailRange(uint64_t epoch, const std::string& pool,
+    const std::string& name, size_t count, uint64_t *start)
+{
+  if (count <= 0 || count > SEQR_MAX_BATCH)
     return -EINVAL;
 
+  int ret = CheckTailFrame(epoch, pool, name, true, count, start);
+  if (ret != -ENOENT)
+    return ret;
+
   // fill in msg
   zlog_proto::MSeqRequest req;
   req.set_epoch(epoch);
-  req.set_name(name);
-  req.set_pool(pool);
   req.set_next(true);
   req.set_count(count);
 
-  // serialize header and protobuf message
-  uint32_t msg_size = req.ByteSize();
-  uint32_t be_msg_size = htonl(msg_size);
-  uint32_t total_msg_size = msg_size + sizeof(be_msg_size);
-  assert(total_msg_size <= sizeof(buffer));
-
-  // add header
-  memcpy(buffer, &be_msg_size, sizeof(be_msg_size));
-
-  // add protobuf msg
-  assert(req.IsInitialized());
-  assert(req.SerializeToArray(buffer + sizeof(be_msg_size), msg_size));
-
-  // send
-  boost::asio::write(socket_, boost::asio::buffer(buffer, total_msg_size));
-
-  // get reply
-  boost::asio::read(socket_, boost::asio::buffer(&be_msg_size, sizeof(be_msg_size)));
-  msg_size = ntohl(be_msg_size);
-  assert(msg_size < sizeof(buffer));
-  boost::asio::read(socket_, boost::asio::buffer(buffer, msg_size));
-
-  // deserialize
   zlog_proto::MSeqReply reply;
-  assert(reply.ParseFromArray(buffer, msg_size));
-  assert(reply.IsInitialized());
+  ret = SendRecvLog(req, pool, name, reply);
+  if (ret)
+    return ret;
 
   if (reply.status() == zlog_proto::MSeqReply::INIT_LOG)
     return -EAGAIN;
   else if (reply.status() == zlog_proto::MSeqReply::STALE_EPOCH)
     return -ERANGE;
-  else {
-    assert(reply.status() == zlog_proto::MSeqReply::OK);
-    std::vector<uint64_t> result(reply.position().begin(),
-        reply.position().end());
-    positions.swap(result);
+  else if (reply.status() == zlog_proto::MSeqReply::INVALID)
+    return -EINVAL;
+
+  return RangeResult(reply, count, start);
+}
+
+/*
+ * A sequencer that doesn't support range replies answers with a list of
+ * positions, which must still form a range.
+ */
+int SeqrClient::RangeResult(const zlog_proto::MSeqReply& reply,
+    size_t count, uint64_t *start)
+{
+  bool ok = reply.status() == zlog_proto::MSeqReply::OK;
+  if (ok && reply.has_start()) {
+    ok = reply.count() == count && reply.position_size() == 0;
+    if (ok)
+      *start = reply.start();
+  } else if (ok) {
+    ok = reply.position_size() == (int)count;
+    for (size_t i = 1; ok && i < count; i++)
+      ok = reply.position(i) == reply.position(0) + i;
+    if (ok)
+      *start = reply.position(0);
+  }
+
+  if (!ok) {
+    std::cerr << "seqr client received malformed reply" << std::endl;
+    return -EIO;
   }
 
   return 0;
@@ -130,8 +1316,6 @@ int SeqrClient::CheckTail(uint64_t epoch, const std::string& pool,
   // fill in msg
   zlog_proto::MSeqRequest req;
   req.set_epoch(epoch);
-  req.set_name(name);
-  req.set_pool(pool);
   req.set_next(next);
   req.set_count(1);
   for (std::set<uint64_t>::const_iterator it = stream_ids.begin();
@@ -140,59 +1324,164 @@ int SeqrClient::CheckTail(uint64_t epoch, const std::string& pool,
     req.add_stream_ids(pos);
   }
 
-  // serialize header and protobuf message
-  uint32_t msg_size = req.ByteSize();
-  uint32_t be_msg_size = htonl(msg_size);
-  uint32_t total_msg_size = msg_size + sizeof(be_msg_size);
-  assert(total_msg_size <= sizeof(buffer));
-
-  // add header
-  memcpy(buffer, &be_msg_size, sizeof(be_msg_size));
-
-  // add protobuf msg
-  assert(req.IsInitialized());
-  assert(req.SerializeToArray(buffer + sizeof(be_msg_size), msg_size));
-
-  // send
-  boost::asio::write(socket_, boost::asio::buffer(buffer, total_msg_size));
-
-  // get reply
-  boost::asio::read(socket_, boost::asio::buffer(&be_msg_size, sizeof(be_msg_size)));
-  msg_size = ntohl(be_msg_size);
-  assert(msg_size < sizeof(buffer));
-  boost::asio::read(socket_, boost::asio::buffer(buffer, msg_size));
-
-  // deserialize
   zlog_proto::MSeqReply reply;
-  assert(reply.ParseFromArray(buffer, msg_size));
-  assert(reply.IsInitialized());
+  int ret = SendRecvLog(req, pool, name, reply);
+  if (ret)
+    return ret;
 
   if (reply.status() == zlog_proto::MSeqReply::INIT_LOG)
     return -EAGAIN;
   else if (reply.status() == zlog_proto::MSeqReply::STALE_EPOCH)
     return -ERANGE;
-  else {
-    assert(reply.status() == zlog_proto::MSeqReply::OK);
-    assert(reply.stream_backpointers_size() == stream_ids.size());
-    assert(reply.position_size() == 1);
+  else if (reply.status() == zlog_proto::MSeqReply::INVALID)
+    return -EINVAL;
+  else if (reply.status() != zlog_proto::MSeqReply::OK ||
+      reply.stream_backpointers_size() != (int)stream_ids.size() ||
+      reply.position_size() != 1) {
+    std::cerr << "seqr client received malformed reply" << std::endl;
+    return -EIO;
+  }
 
-    std::map<uint64_t, std::vector<uint64_t>> result;
-    for (size_t index = 0; index < reply.stream_backpointers_size(); index++) {
-      const zlog_proto::StreamBackPointer ptrs = reply.stream_backpointers(index);
-      assert(stream_ids.find(ptrs.id()) != stream_ids.end());
-      std::vector<uint64_t> backpointers(ptrs.backpointer().begin(),
-          ptrs.backpointer().end());
-      assert(result.find(ptrs.id()) == result.end());
-      result[ptrs.id()] = backpointers;
+  std::map<uint64_t, std::vector<uint64_t>> result;
+  for (int index = 0; index < reply.stream_backpointers_size(); index++) {
+    const zlog_proto::StreamBackPointer& ptrs = reply.stream_backpointers(index);
+    if (stream_ids.find(ptrs.id()) == stream_ids.end() ||
+        result.find(ptrs.id()) != result.end()) {
+      std::cerr << "seqr client received malformed reply" << std::endl;
+      return -EIO;
     }
+    std::vector<uint64_t> backpointers(ptrs.backpointer().begin(),
+        ptrs.backpointer().end());
+    result[ptrs.id()] = backpointers;
+  }
 
-    stream_backpointers.swap(result);
+  stream_backpointers.swap(result);
 
-    if (pposition)
-      *pposition = reply.position(0);
-  }
+  if (pposition)
+    *pposition = reply.position(0);
 
   return 0;
 }
 
+void SeqrClient::AsyncCheckTail(uint64_t epoch, const std::string& pool,
+    const std::string& name, bool next,
+    std::function<void(int, uint64_t)> callback)
+{
+  AsyncCheckTailCount(epoch, pool, name, next, 1, callback);
+}
+
+void SeqrClient::AsyncCheckTailRange(uint64_t epoch, const std::string& pool,
+    const std::string& name, size_t count,
+    std::function<void(int, uint64_t)> callback)
+{
+  if (count <= 0 || count > SEQR_MAX_BATCH) {
+    callback(-EINVAL, 0);
+    return;
+  }
+
+  AsyncCheckTailCount(epoch, pool, name, true, count, callback);
+}
+
+void SeqrClient::AsyncCheckTailCount(uint64_t epoch, const std::string& pool,
+    const std::string& name, bool next, size_t count,
+    std::function<void(int, uint64_t)> callback)
+{
+  auto retry = [=] {
+    std::unique_lock<std::mutex> l(timers_lock_);
+    if (shutdown_) {
+      l.unlock();
+      callback(-ESHUTDOWN, 0);
+      return;
+    }
+    auto timer = std::make_shared<boost::asio::deadline_timer>(
+        io_service_, boost::posix_time::seconds(1));
+    retry_timers_.insert(timer);
+    timer->async_wait([=](const boost::system::error_code& err) {
+      {
+        std::lock_guard<std::mutex> l(timers_lock_);
+        retry_timers_.erase(timer);
+      }
+      if (err || shutdown_) {
+        callback(-ESHUTDOWN, 0);
+        return;
+      }
+      AsyncCheckTailCount(epoch, pool, name, next, count, callback);
+    });
+  };
+
+  uint64_t handle;
+  if (UseFrames(pool, name, &handle)) {
+    SeqrFrameRequest freq;
+    freq.op = next ? SEQR_FRAME_OP_NEXT : SEQR_FRAME_OP_READ;
+    freq.count = count;
+    freq.handle = handle;
+    freq.epoch = epoch;
+    CallFrame(freq, [=](int ret, const SeqrFrameReply& reply) {
+      if (ret == 0)
+        ret = FrameResult(pool, name, handle, reply, count);
+      if (ret == -EAGAIN)
+        retry();
+      else if (ret == -ENOENT)
+        AsyncCheckTailCount(epoch, pool, name, next, count, callback);
+      else
+        callback(ret, ret ? 0 : reply.position);
+    });
+    return;
+  }
+
+  zlog_proto::MSeqRequest req;
+  req.set_epoch(epoch);
+  req.set_next(next);
+  req.set_count(count);
+  SetLog(req, pool, name);
+
+  const bool by_handle = req.has_log_handle();
+  const uint64_t req_handle = req.log_handle();
+
+  Call(req, [=](int ret, const zlog_proto::MSeqReply& reply) {
+    if (ret == 0 && by_handle &&
+        reply.status() == zlog_proto::MSeqReply::BAD_HANDLE) {
+      ForgetHandle(pool, name, req_handle);
+      AsyncCheckTailCount(epoch, pool, name, next, count, callback);
+      return;
+    }
+
+    /*
+     * The sequencer is initializing the log, or the connection to it is
+     * being re-established. Try again soon without blocking.
+     */
+    if (ret == -EAGAIN ||
+        (ret == 0 && reply.status() == zlog_proto::MSeqReply::INIT_LOG)) {
+      retry();
+      return;
+    }
+
+    if (ret) {
+      callback(ret, 0);
+      return;
+    }
+
+    if (reply.status() == zlog_proto::MSeqReply::STALE_EPOCH) {
+      callback(-ERANGE, 0);
+      return;
+    }
+
+    if (reply.status() == zlog_proto::MSeqReply::INVALID) {
+      callback(-EINVAL, 0);
+      return;
+    }
+
+    uint64_t start;
+    ret = RangeResult(reply, count, &start);
+    if (ret) {
+      callback(ret, 0);
+      return;
+    }
+
+    UpdateHandle(pool, name, reply);
+
+    callback(0, start);
+  });
+}
+
 }
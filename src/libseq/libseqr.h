@@ -1,16 +1,119 @@
 #ifndef LIBSEQR_H
 #define LIBSEQR_H
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <string>
+#include <thread>
+#include <vector>
 #include <boost/asio.hpp>
+#include "seqr_frame.h"
+
+namespace zlog_proto {
+  class MSeqRequest;
+  class MSeqReply;
+}
+
+/*
+ * Default number of sequencer connections per client
+ */
+#define SEQR_DEFAULT_CONNECTIONS 4
+
+/*
+ * Bounds on the delay between attempts to reconnect to the sequencer
+ */
+#define SEQR_RECONNECT_MIN_MS 10
+#define SEQR_RECONNECT_MAX_MS 1000
+
+/*
+ * How often a client that failed over probes the first sequencer endpoint
+ */
+#define SEQR_PROBE_INTERVAL_MS 5000
+
+/*
+ * Minimum time between attempts to reopen a shared memory ring that timed
+ * out or went away
+ */
+#define SEQR_SHM_REOPEN_MS 1000
+
+/*
+ * Maximum number of positions reserved by one batched request. A client
+ * that doesn't ask for SEQR_FEATURE_RANGE_REPLY gets every position back
+ * in a list and is held to SEQR_MAX_LIST_BATCH instead. The sequencer
+ * rejects anything larger, so callers must split batches with these.
+ */
+#define SEQR_MAX_BATCH 65536
+#define SEQR_MAX_LIST_BATCH 100
 
 namespace zlog {
 
+class ShmRing;
+
+/*
+ * Sequencer client. Every request carries a request id that the sequencer
+ * echoes in its reply, so many requests can be in flight on a connection at
+ * once and replies are matched to requests in whatever order they arrive.
+ *
+ * The client is thread-safe. It keeps a small pool of connections, each
+ * served by its own io_service thread, and spreads requests across them, so
+ * one client can be shared by every thread and log handle in a process.
+ *
+ * A connection that fails is re-established in the background, with
+ * backoff. All connections use the same sequencer endpoint: when an attempt
+ * to reach it fails the client moves on to the next candidate, and the
+ * connections still on the old one are reset. While it isn't using the
+ * first endpoint the client periodically probes it, and switches back once
+ * it accepts connections. Requests that were waiting on a failed connection, or that
+ * are made while no connection is up, fail with -EAGAIN: the same result as
+ * a sequencer that is still initializing the log, so callers retry them.
+ * A reply that breaks the protocol fails the connection's requests with
+ * -EIO instead, and a request the sequencer rejects fails with -EINVAL.
+ * Asynchronous requests still outstanding when the client is destroyed
+ * fail with -ESHUTDOWN.
+ *
+ * Endpoints take one of the forms
+ *
+ *   host:port   - TCP
+ *   unix:path   - Unix domain socket, for a sequencer on the same host
+ *   shm:name    - shared memory ring, for a sequencer on the same host
+ *
+ * If a shared memory endpoint is listed and its ring exists at Connect,
+ * requests are made through the ring, spinning for the reply, and the
+ * socket endpoints aren't used. Synchronous requests spin on the calling
+ * thread. Asynchronous ones are all served by one poller thread, which
+ * keeps as many in flight as the ring has slots and sleeps while there are
+ * none, and their callbacks run on the io_service thread. When the ring
+ * times out or the sequencer goes away the request fails with -EAGAIN and
+ * the ring is opened again.
+ *
+ * The first request for a log names it by pool and name, and registers it
+ * with the sequencer in return for a handle. Later requests carry only the
+ * handle. Over sockets, requests for the tail of a log without streams then
+ * switch to compact binary frames (see seqr_frame.h).
+ */
 class SeqrClient {
  public:
-  SeqrClient(const char *host, const char *port) :
-    socket_(io_service_), host_(host), port_(port)
-  {}
+  SeqrClient(const char *host, const char *port,
+      size_t connections = SEQR_DEFAULT_CONNECTIONS);
+
+  /*
+   * Candidate sequencer endpoints, in order of preference.
+   */
+  SeqrClient(const std::vector<std::string>& endpoints,
+      size_t connections = SEQR_DEFAULT_CONNECTIONS);
 
+  virtual ~SeqrClient();
+
+  /*
+   * Connect the pool, throwing if no endpoint can be reached. Calling
+   * Connect again once connected has no effect.
+   */
   virtual void Connect();
 
   virtual int CheckTail(uint64_t epoch, const std::string& pool,
@@ -19,17 +122,238 @@ class SeqrClient {
   virtual int CheckTail(uint64_t epoch, const std::string& pool,
       const std::string& name, std::vector<uint64_t>& positions, size_t count);
 
+  /*
+   * Reserve count consecutive positions, up to SEQR_MAX_BATCH, starting at
+   * *start.
+   */
+  virtual int CheckTailRange(uint64_t epoch, const std::string& pool,
+      const std::string& name, size_t count, uint64_t *start);
+
   virtual int CheckTail(uint64_t epoch, const std::string& pool,
       const std::string& name, const std::set<uint64_t>& stream_ids,
       std::map<uint64_t, std::vector<uint64_t>>& stream_backpointers,
       uint64_t *position, bool next);
 
+  /*
+   * Register a log with the sequencer ahead of the first request for it.
+   * Returns -EAGAIN while the sequencer initializes the log, and -ENOSPC if
+   * the sequencer has no room for more handles; requests for the log then
+   * name it by pool and name.
+   */
+  virtual int RegisterLog(const std::string& pool, const std::string& name,
+      uint64_t *handle);
+
+  /*
+   * Asynchronous version of CheckTail. The callback is invoked on one of the
+   * client's io_service threads, so it must not block. Replies asking the
+   * client to try again while the sequencer initializes the log are retried
+   * internally after a short delay.
+   */
+  virtual void AsyncCheckTail(uint64_t epoch, const std::string& pool,
+      const std::string& name, bool next,
+      std::function<void(int, uint64_t)> callback);
+
+  /*
+   * Asynchronous version of CheckTailRange. The callback receives the first
+   * of the count positions.
+   */
+  virtual void AsyncCheckTailRange(uint64_t epoch, const std::string& pool,
+      const std::string& name, size_t count,
+      std::function<void(int, uint64_t)> callback);
+
  private:
+  class Connection;
+
+  struct Endpoint {
+    std::string name;
+    boost::asio::generic::stream_protocol::endpoint ep;
+  };
+
+  typedef std::function<void(int, const zlog_proto::MSeqReply&)> reply_cb_t;
+  typedef std::function<void(int, const SeqrFrameReply&)> frame_cb_t;
+
+  /*
+   * Send a request without waiting for the reply. The callback receives the
+   * reply, or -EAGAIN (-EIO on a protocol error) if the connection fails
+   * first.
+   */
+  void Call(zlog_proto::MSeqRequest& req, reply_cb_t callback);
+
+  /*
+   * Send a request and wait for the reply.
+   */
+  int SendRecv(zlog_proto::MSeqRequest& req, zlog_proto::MSeqReply& reply);
+
+  /*
+   * Fill in the request id and the features asked for.
+   */
+  void PrepareRequest(zlog_proto::MSeqRequest& req);
+
+  /*
+   * Make a prepared request over the shared memory ring, in the calling
+   * thread. A ring that failed is replaced with a fresh mapping, at most
+   * once every SEQR_SHM_REOPEN_MS.
+   */
+  int ShmCall(const zlog_proto::MSeqRequest& req,
+      zlog_proto::MSeqReply& reply);
+  void ReopenShm(std::shared_ptr<ShmRing> failed);
+
+  /*
+   * Asynchronous requests over the ring: ShmSubmit queues a prepared
+   * request for the poller thread, which runs ShmPoll.
+   */
+  struct ShmRequest {
+    std::string msg;
+    reply_cb_t callback;
+    std::shared_ptr<ShmRing> ring;
+    uint32_t slot;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  void ShmSubmit(const zlog_proto::MSeqRequest& req, reply_cb_t callback);
+  void ShmPoll();
+  void ShmReply(const ShmRequest& r, int ret,
+      const zlog_proto::MSeqReply& reply);
+
+  /*
+   * Binary frame versions of Call and SendRecv. Fields are in host order;
+   * the request id is filled in.
+   */
+  void CallFrame(SeqrFrameRequest& req, frame_cb_t callback);
+  int SendRecvFrame(SeqrFrameRequest& req, SeqrFrameReply& reply);
+
+  Connection *PickConnection();
+
+  /*
+   * Move every connection off an endpoint that couldn't be reached. Does
+   * nothing if another connection already moved the client on.
+   */
+  void Failover(size_t failed);
+  void ResetConnections();
+  void StartProbe();
+
+  /*
+   * Sequencer handles for logs, learned from protobuf replies. A handle the
+   * sequencer rejects is forgotten and the log is named by pool and name
+   * again.
+   */
+  bool LookupHandle(const std::string& pool, const std::string& name,
+      uint64_t *handle);
+  void UpdateHandle(const std::string& pool, const std::string& name,
+      const zlog_proto::MSeqReply& reply);
+  void ForgetHandle(const std::string& pool, const std::string& name,
+      uint64_t handle);
+
+  /*
+   * Whether a request for the log can be sent as a binary frame, and with
+   * which handle.
+   */
+  bool UseFrames(const std::string& pool, const std::string& name,
+      uint64_t *handle);
+
+  /*
+   * Name the log in a protobuf request by handle if there is one.
+   */
+  void SetLog(zlog_proto::MSeqRequest& req, const std::string& pool,
+      const std::string& name);
+
+  /*
+   * SendRecv for a request about a log, retrying by name if the handle is
+   * rejected.
+   */
+  int SendRecvLog(zlog_proto::MSeqRequest& req, const std::string& pool,
+      const std::string& name, zlog_proto::MSeqReply& reply);
+
+  /*
+   * Map a frame reply to a CheckTail result. Returns -ENOENT if the handle
+   * was rejected.
+   */
+  int FrameResult(const std::string& pool, const std::string& name,
+      uint64_t handle, const SeqrFrameReply& reply, size_t count);
+
+  /*
+   * Request count positions over the fast path. Returns -ENOENT if there is
+   * no usable handle for the log.
+   */
+  int CheckTailFrame(uint64_t epoch, const std::string& pool,
+      const std::string& name, bool next, size_t count, uint64_t *position);
+
+  /*
+   * Find the first of the count consecutive positions in an OK reply.
+   * Returns -EIO if the reply doesn't hold such a range.
+   */
+  static int RangeResult(const zlog_proto::MSeqReply& reply, size_t count,
+      uint64_t *start);
+
+  /*
+   * AsyncCheckTail for count positions
+   */
+  void AsyncCheckTailCount(uint64_t epoch, const std::string& pool,
+      const std::string& name, bool next, size_t count,
+      std::function<void(int, uint64_t)> callback);
+
   boost::asio::io_service io_service_;
-  boost::asio::ip::tcp::socket socket_;
-  std::string host_;
-  std::string port_;
-  char buffer[1024];
+  std::vector<std::string> endpoint_names_;
+  std::vector<Endpoint> endpoints_;
+
+  /*
+   * shm_name_, use_shm_:
+   *   - the shared memory ring, if requests go through one
+   * shm_:
+   *   - current mapping of the ring, replaced with atomic_store
+   * shm_lock_, shm_reopened_:
+   *   - serialize and rate-limit reopening the ring
+   */
+  std::string shm_name_;
+  bool use_shm_;
+  std::shared_ptr<ShmRing> shm_;
+  std::mutex shm_lock_;
+  std::chrono::steady_clock::time_point shm_reopened_;
+
+  /*
+   * shm_queue_lock_, shm_cond_, shm_queue_:
+   *   - asynchronous requests waiting for the poller
+   * shm_thread_:
+   *   - the poller
+   */
+  std::mutex shm_queue_lock_;
+  std::condition_variable shm_cond_;
+  std::deque<ShmRequest> shm_queue_;
+  std::thread shm_thread_;
+
+  /*
+   * endpoint_:
+   *   - index of the sequencer endpoint the connections use
+   * probe_timer_:
+   *   - schedules probes of the first endpoint after a failover
+   */
+  std::atomic<size_t> endpoint_;
+  boost::asio::deadline_timer probe_timer_;
+
+  /*
+   * shutdown_:
+   *   - set once the client is being destroyed
+   * timers_lock_, retry_timers_:
+   *   - asynchronous requests waiting to be retried, cancelled on shutdown
+   *     together with probe_timer_
+   */
+  std::atomic<bool> shutdown_;
+  std::mutex timers_lock_;
+  std::set<std::shared_ptr<boost::asio::deadline_timer>> retry_timers_;
+
+  std::mutex lock_;
+  bool connected_;
+  size_t num_conns_;
+  std::vector<Connection*> conns_;
+  std::unique_ptr<boost::asio::io_service::work> work_;
+  std::vector<std::thread> threads_;
+
+  std::mutex handles_lock_;
+  std::map<std::pair<std::string, std::string>, uint64_t> handles_;
+  std::atomic<bool> binary_frames_;
+
+  std::atomic<uint64_t> next_req_id_;
+  std::atomic<size_t> next_conn_;
 };
 
 }
@@ -0,0 +1,72 @@
+#ifndef LIBSEQR_SEQR_FRAME_H
+#define LIBSEQR_SEQR_FRAME_H
+#include <stdint.h>
+
+/*
+ * Fixed-layout binary frames for the sequencer fast path: requests for the
+ * log tail that don't involve streams. Everything else uses protobuf.
+ *
+ * Every message on a sequencer connection starts with a 32-bit big-endian
+ * length. A binary frame sets the high bit of the length, which a protobuf
+ * message never does. The fields of a frame are little-endian.
+ *
+ * A client only sends binary frames after the sequencer has advertised
+ * SEQR_FEATURE_BINARY_FRAME in a protobuf reply, and only for logs it has
+ * a handle for.
+ */
+#define SEQR_FRAME_FLAG 0x80000000U
+
+/*
+ * Features a client asks for in the features field of a protobuf request.
+ * The sequencer echoes the ones it supports in its reply.
+ *
+ * BINARY_FRAME: binary frames may be sent on the connection.
+ *
+ * RANGE_REPLY: a batch is answered with a (start, count) range instead of
+ * a list of every position.
+ *
+ * LOG_HANDLE: a successful request that names a log by pool and name also
+ * registers it, and the reply carries the log handle.
+ */
+#define SEQR_FEATURE_BINARY_FRAME 0x1
+#define SEQR_FEATURE_RANGE_REPLY 0x2
+#define SEQR_FEATURE_LOG_HANDLE 0x4
+#define SEQR_FEATURES (SEQR_FEATURE_BINARY_FRAME | SEQR_FEATURE_RANGE_REPLY | \
+    SEQR_FEATURE_LOG_HANDLE)
+
+enum SeqrFrameOp {
+  SEQR_FRAME_OP_READ = 1,
+  SEQR_FRAME_OP_NEXT = 2,
+};
+
+enum SeqrFrameStatus {
+  SEQR_FRAME_OK = 0,
+  SEQR_FRAME_INIT_LOG = 1,
+  SEQR_FRAME_STALE_EPOCH = 2,
+  SEQR_FRAME_BAD_HANDLE = 3,
+  SEQR_FRAME_INVALID = 4,
+};
+
+/*
+ * Positions handed out for a request are contiguous, so a reply only
+ * carries the first one. The fields are laid out without padding.
+ */
+struct SeqrFrameRequest {
+  uint32_t op;
+  uint32_t count;
+  uint64_t req_id;
+  uint64_t handle;
+  uint64_t epoch;
+};
+
+struct SeqrFrameReply {
+  uint32_t status;
+  uint32_t count;
+  uint64_t req_id;
+  uint64_t position;
+};
+
+static_assert(sizeof(SeqrFrameRequest) == 32, "frame layout");
+static_assert(sizeof(SeqrFrameReply) == 24, "frame layout");
+
+#endif
@@ -0,0 +1,347 @@
+#include "shm_ring.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace zlog {
+
+static std::string shm_path(const std::string& name)
+{
+  if (!name.empty() && name[0] == '/')
+    return name;
+  return "/" + name;
+}
+
+/*
+ * Clients still attached to the segment see the cleared magic.
+ */
+ShmRing::~ShmRing()
+{
+  if (owner_) {
+    region_->magic.store(0, std::memory_order_release);
+    shm_unlink(shm_path(name_).c_str());
+  }
+  munmap(region_, sizeof(*region_));
+}
+
+/*
+ * A segment left behind by a previous server is replaced. The mode is set
+ * explicitly so that it doesn't depend on the umask.
+ */
+ShmRing *ShmRing::Create(const std::string& name, mode_t mode)
+{
+  std::string path = shm_path(name);
+  shm_unlink(path.c_str());
+
+  int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+  if (fd < 0) {
+    std::cerr << "failed to create shm segment " << path
+      << ": " << strerror(errno) << std::endl;
+    return NULL;
+  }
+
+  if (fchmod(fd, mode)) {
+    std::cerr << "failed to set mode of shm segment " << path
+      << ": " << strerror(errno) << std::endl;
+    close(fd);
+    shm_unlink(path.c_str());
+    return NULL;
+  }
+
+  if (ftruncate(fd, sizeof(Region))) {
+    std::cerr << "failed to size shm segment " << path
+      << ": " << strerror(errno) << std::endl;
+    close(fd);
+    shm_unlink(path.c_str());
+    return NULL;
+  }
+
+  void *addr = mmap(NULL, sizeof(Region), PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << "failed to map shm segment " << path
+      << ": " << strerror(errno) << std::endl;
+    shm_unlink(path.c_str());
+    return NULL;
+  }
+
+  // new segments are zero filled, so every slot starts out free
+  Region *region = (Region*)addr;
+  region->nslots = SEQR_SHM_SLOTS;
+  region->generation = std::random_device()();
+  region->magic.store(SEQR_SHM_MAGIC, std::memory_order_release);
+
+  return new ShmRing(name, region, true);
+}
+
+ShmRing *ShmRing::Open(const std::string& name)
+{
+  std::string path = shm_path(name);
+
+  int fd = shm_open(path.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    std::cerr << "failed to open shm segment " << path
+      << ": " << strerror(errno) << std::endl;
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size != (off_t)sizeof(Region)) {
+    std::cerr << "shm segment " << path << " has the wrong size" << std::endl;
+    close(fd);
+    return NULL;
+  }
+
+  void *addr = mmap(NULL, sizeof(Region), PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << "failed to map shm segment " << path
+      << ": " << strerror(errno) << std::endl;
+    return NULL;
+  }
+
+  Region *region = (Region*)addr;
+  if (region->magic.load(std::memory_order_acquire) != SEQR_SHM_MAGIC ||
+      region->nslots != SEQR_SHM_SLOTS) {
+    std::cerr << "shm segment " << path << " is not a sequencer ring"
+      << std::endl;
+    munmap(addr, sizeof(Region));
+    return NULL;
+  }
+
+  return new ShmRing(name, region, false);
+}
+
+bool ShmRing::Stale() const
+{
+  return region_->magic.load(std::memory_order_acquire) != SEQR_SHM_MAGIC ||
+    region_->generation != generation_;
+}
+
+/*
+ * The owner is cleared before the slot is, so a slot is never reaped on
+ * behalf of a previous owner.
+ */
+void ShmRing::FreeSlot(Slot *slot)
+{
+  slot->owner.store(0, std::memory_order_relaxed);
+  slot->state.store(SLOT_FREE, std::memory_order_release);
+}
+
+/*
+ * One pass over the slots, starting at the given one. Returns NULL if none
+ * is free.
+ */
+ShmRing::Slot *ShmRing::TryClaimSlot(size_t start)
+{
+  for (size_t i = 0; i < SEQR_SHM_SLOTS; i++) {
+    Slot *slot = &region_->slots[(start + i) % SEQR_SHM_SLOTS];
+    uint32_t expected = SLOT_FREE;
+    if (slot->state.load(std::memory_order_relaxed) == SLOT_FREE &&
+        slot->state.compare_exchange_strong(expected, SLOT_BUSY,
+          std::memory_order_acquire)) {
+      slot->owner.store(getpid(), std::memory_order_relaxed);
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Threads start probing at different slots to keep them from contending
+ * on the same slot. Returns NULL if no slot frees up in time.
+ */
+ShmRing::Slot *ShmRing::ClaimSlot()
+{
+  size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+  auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::microseconds(SEQR_SHM_TIMEOUT_US);
+  for (;;) {
+    Slot *slot = TryClaimSlot(start);
+    if (slot)
+      return slot;
+    if (Stale() || std::chrono::steady_clock::now() > deadline)
+      return NULL;
+    std::this_thread::yield();
+  }
+}
+
+void ShmRing::PostRequest(Slot *slot, const std::string& request)
+{
+  memcpy(slot->data, request.data(), request.size());
+  slot->size = request.size();
+  slot->state.store(SLOT_REQUEST, std::memory_order_release);
+}
+
+int ShmRing::Call(const std::string& request, std::string& reply)
+{
+  if (request.size() > SEQR_SHM_MSG_SIZE)
+    return -EINVAL;
+
+  if (Stale())
+    return -ESTALE;
+
+  Slot *slot = ClaimSlot();
+  if (!slot)
+    return Stale() ? -ESTALE : -ETIMEDOUT;
+
+  PostRequest(slot, request);
+  uint32_t index = slot - region_->slots;
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t spins = 1;; spins++) {
+    int ret = Complete(index, reply);
+    if (ret != -EINPROGRESS)
+      return ret;
+
+    if ((spins % 128) == 0) {
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      bool stale = Stale();
+      if ((stale || elapsed >
+            std::chrono::microseconds(SEQR_SHM_TIMEOUT_US)) &&
+          Cancel(index))
+        return stale ? -ESTALE : -ETIMEDOUT;
+    }
+    std::this_thread::yield();
+  }
+}
+
+/*
+ * Slots are claimed round robin so that requests from one thread spread
+ * over the ring.
+ */
+int ShmRing::Submit(const std::string& request, uint32_t *index)
+{
+  if (request.size() > SEQR_SHM_MSG_SIZE)
+    return -EINVAL;
+
+  if (Stale())
+    return -ESTALE;
+
+  Slot *slot = TryClaimSlot(next_slot_);
+  if (!slot)
+    return -EBUSY;
+
+  PostRequest(slot, request);
+  *index = slot - region_->slots;
+  next_slot_ = *index + 1;
+
+  return 0;
+}
+
+int ShmRing::Complete(uint32_t index, std::string& reply)
+{
+  Slot *slot = &region_->slots[index];
+  if (slot->state.load(std::memory_order_acquire) != SLOT_REPLY)
+    return -EINPROGRESS;
+
+  reply.assign(slot->data, slot->size);
+  FreeSlot(slot);
+
+  return 0;
+}
+
+/*
+ * A request that the server hasn't picked up is taken back. One the server
+ * is still serving is abandoned to it.
+ */
+bool ShmRing::Cancel(uint32_t index)
+{
+  Slot *slot = &region_->slots[index];
+  for (;;) {
+    uint32_t state = slot->state.load(std::memory_order_acquire);
+    uint32_t expected = state;
+    if (state == SLOT_REPLY)
+      return false;
+    if (state == SLOT_REQUEST &&
+        slot->state.compare_exchange_strong(expected, SLOT_BUSY)) {
+      FreeSlot(slot);
+      return true;
+    }
+    if (state == SLOT_SERVING &&
+        slot->state.compare_exchange_strong(expected, SLOT_ABANDONED))
+      return true;
+  }
+}
+
+/*
+ * A request the client abandoned while it was served is dropped.
+ */
+size_t ShmRing::Poll(
+    std::function<bool(const char*, size_t, std::string&)> handler)
+{
+  size_t handled = 0;
+  std::string reply;
+
+  for (size_t i = 0; i < SEQR_SHM_SLOTS; i++) {
+    Slot& slot = region_->slots[i];
+    if (slot.state.load(std::memory_order_acquire) != SLOT_REQUEST)
+      continue;
+
+    uint32_t expected = SLOT_REQUEST;
+    if (!slot.state.compare_exchange_strong(expected, SLOT_SERVING,
+          std::memory_order_acquire))
+      continue;
+
+    reply.clear();
+    bool ok = slot.size <= SEQR_SHM_MSG_SIZE &&
+      handler(slot.data, slot.size, reply);
+    if (ok && reply.size() <= SEQR_SHM_MSG_SIZE) {
+      memcpy(slot.data, reply.data(), reply.size());
+      slot.size = reply.size();
+    } else
+      slot.size = 0;
+
+    expected = SLOT_SERVING;
+    if (!slot.state.compare_exchange_strong(expected, SLOT_REPLY,
+          std::memory_order_release))
+      FreeSlot(&slot);
+    handled++;
+  }
+
+  return handled;
+}
+
+/*
+ * A client that exits between claiming a slot and taking its reply leaves
+ * the slot BUSY or REPLY. Nothing else changes the state of such a slot,
+ * so it is freed if the owner is gone.
+ */
+size_t ShmRing::Reap()
+{
+  size_t reaped = 0;
+
+  for (size_t i = 0; i < SEQR_SHM_SLOTS; i++) {
+    Slot& slot = region_->slots[i];
+    uint32_t state = slot.state.load(std::memory_order_acquire);
+    if (state != SLOT_BUSY && state != SLOT_REPLY)
+      continue;
+
+    pid_t owner = slot.owner.load(std::memory_order_relaxed);
+    if (owner <= 0 || kill(owner, 0) == 0 || errno != ESRCH)
+      continue;
+
+    if (slot.owner.compare_exchange_strong(owner, 0) &&
+        slot.state.compare_exchange_strong(state, SLOT_FREE,
+          std::memory_order_release)) {
+      std::cerr << "freed shm slot " << i << " of exited client "
+        << owner << std::endl;
+      reaped++;
+    }
+  }
+
+  return reaped;
+}
+
+}
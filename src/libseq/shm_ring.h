@@ -0,0 +1,149 @@
+#ifndef LIBSEQR_SHM_RING_H
+#define LIBSEQR_SHM_RING_H
+#include <atomic>
+#include <functional>
+#include <string>
+#include <sys/types.h>
+
+/*
+ * Shared memory ring layout. Each slot carries one request and then its
+ * reply. The sizes are part of the layout shared by client and server.
+ */
+#define SEQR_SHM_MAGIC 0x7a6c6f67
+#define SEQR_SHM_SLOTS 64
+#define SEQR_SHM_MSG_SIZE 1024
+
+/*
+ * How long a client spins for a free slot, or for the reply to a request,
+ * before giving up.
+ */
+#define SEQR_SHM_TIMEOUT_US 1000000
+
+/*
+ * Default permissions of the segment. Any process that can map it can
+ * take positions from the sequencer.
+ */
+#define SEQR_SHM_MODE 0600
+
+/*
+ * How often the server reclaims slots held by clients that have exited
+ */
+#define SEQR_SHM_REAP_MS 1000
+
+namespace zlog {
+
+/*
+ * A ring of request/reply slots in a POSIX shared memory segment, used by
+ * clients on the same host as the sequencer. A client claims a free slot,
+ * writes its request and spin-polls until the server has written the reply
+ * into the same slot. The server polls the slots for requests.
+ *
+ * Slot states:
+ *
+ *   FREE -> (client) BUSY -> REQUEST -> (server) SERVING -> REPLY -> FREE
+ *
+ * A client that times out takes a REQUEST slot back, or marks a SERVING
+ * slot ABANDONED, which the server frees once it's done with it. The
+ * server frees BUSY and REPLY slots whose owner has exited.
+ *
+ * Each segment carries a random generation. A server clears the magic when
+ * it shuts down, so clients notice a ring that is gone or replaced and can
+ * open it again.
+ */
+class ShmRing {
+ public:
+  enum SlotState {
+    SLOT_FREE = 0,
+    SLOT_BUSY,
+    SLOT_REQUEST,
+    SLOT_SERVING,
+    SLOT_REPLY,
+    SLOT_ABANDONED,
+  };
+
+  struct Slot {
+    std::atomic<uint32_t> state;
+    std::atomic<pid_t> owner;
+    uint32_t size;
+    char data[SEQR_SHM_MSG_SIZE];
+  } __attribute__((aligned(64)));
+
+  struct Region {
+    std::atomic<uint32_t> magic;
+    uint32_t nslots;
+    uint32_t generation;
+    Slot slots[SEQR_SHM_SLOTS];
+  };
+
+  ~ShmRing();
+
+  /*
+   * Create (server) or attach to (client) the named segment. Return NULL
+   * on failure.
+   */
+  static ShmRing *Create(const std::string& name,
+      mode_t mode = SEQR_SHM_MODE);
+  static ShmRing *Open(const std::string& name);
+
+  /*
+   * Client: send a request and wait for the reply. Returns -ETIMEDOUT if
+   * no slot frees up or the reply doesn't arrive in time, and -ESTALE if
+   * the server shut down or replaced the ring.
+   */
+  int Call(const std::string& request, std::string& reply);
+
+  /*
+   * Client: split-phase version of Call, for one thread that keeps many
+   * requests in flight. Submit posts a request in a free slot without
+   * waiting for one, and returns -EBUSY if there is none. Complete returns
+   * -EINPROGRESS until the reply has arrived, and then takes it and frees
+   * the slot. Cancel gives up on a request and returns true, or returns
+   * false if its reply has already arrived and must be taken instead.
+   */
+  int Submit(const std::string& request, uint32_t *index);
+  int Complete(uint32_t index, std::string& reply);
+  bool Cancel(uint32_t index);
+
+  /*
+   * Whether the server shut down or replaced the ring.
+   */
+  bool Stale() const;
+
+  /*
+   * Server: handle every pending request. The handler fills in the reply
+   * and returns false if the request is malformed, in which case the reply
+   * is left empty. Returns the number of requests handled.
+   */
+  size_t Poll(std::function<bool(const char*, size_t, std::string&)> handler);
+
+  /*
+   * Server: free the slots held by clients that have exited. Returns the
+   * number of slots freed.
+   */
+  size_t Reap();
+
+  uint32_t Generation() const {
+    return generation_;
+  }
+
+ private:
+  ShmRing(const std::string& name, Region *region, bool owner) :
+    name_(name), region_(region), generation_(region->generation),
+    owner_(owner), next_slot_(0)
+  {}
+
+  Slot *TryClaimSlot(size_t start);
+  Slot *ClaimSlot();
+  static void PostRequest(Slot *slot, const std::string& request);
+  static void FreeSlot(Slot *slot);
+
+  std::string name_;
+  Region *region_;
+  uint32_t generation_;
+  bool owner_;
+  uint32_t next_slot_;
+};
+
+}
+
+#endif
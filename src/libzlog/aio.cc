@@ -1,7 +1,12 @@
 #include "log_impl.h"
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
+#include <iostream>
+#include <map>
 #include <mutex>
+#include <vector>
 #include <rados/librados.hpp>
 #include <rados/cls_zlog_client.h>
 
@@ -9,7 +14,28 @@ namespace zlog {
 
 enum AioType {
   ZLOG_AIO_APPEND,
+  ZLOG_AIO_APPEND_BATCH,
   ZLOG_AIO_READ,
+  ZLOG_AIO_OPEN,
+};
+
+class AioCompletionImpl;
+
+/*
+ * State for a single entry of an AioAppendBatch. Each entry has its own
+ * rados completion so that entries can be written and retried independently.
+ */
+struct AioBatchEntry {
+  AioCompletionImpl *impl;
+  librados::AioCompletion *c;
+  bool has_position;
+  uint64_t position;
+  ceph::bufferlist bl;
+
+  // projection, target object and start time of the current write attempt
+  std::shared_ptr<const Projection> proj;
+  const std::string *oid;
+  std::chrono::steady_clock::time_point start;
 };
 
 class AioCompletionImpl {
@@ -47,6 +73,22 @@ class AioCompletionImpl {
   ceph::bufferlist bl;
   AioType type;
 
+  /*
+   * AioAppend, AioRead
+   *
+   * proj:
+   *  - projection of the current attempt
+   *
+   * AioAppend
+   *
+   * oid, start:
+   *  - target object and start time of the current write attempt (for the
+   *    stripe width controller)
+   */
+  std::shared_ptr<const Projection> proj;
+  const std::string *oid;
+  std::chrono::steady_clock::time_point start;
+
   /*
    * AioAppend
    *
@@ -63,6 +105,33 @@ class AioCompletionImpl {
    */
   ceph::bufferlist *pbl;
 
+  /*
+   * AioAppendBatch
+   *
+   * batch:
+   *  - data and current position attempt for each entry
+   * pending:
+   *  - number of entries not yet finished
+   * pbatch_positions:
+   *  - final append positions
+   */
+  std::vector<AioBatchEntry> batch;
+  size_t pending;
+  std::vector<uint64_t> *pbatch_positions;
+
+  /*
+   * AioOpen
+   *
+   * rv, epoch:
+   *  - projection read result (bl holds the projection)
+   * plog:
+   *  - where to put the new handle
+   */
+  int rv;
+  uint64_t epoch;
+  ceph::bufferlist unused;
+  Log **plog;
+
   AioCompletionImpl() :
     ref(1), complete(false), released(false), retval(0)
   {}
@@ -104,10 +173,80 @@ class AioCompletionImpl {
     this->callback = callback;
   }
 
+  /*
+   * Complete the aio and drop the reference held by the in-flight
+   * operation. Must be called without the lock held.
+   */
+  void Complete(int ret) {
+    lock.lock();
+    retval = ret;
+    complete = true;
+    lock.unlock();
+    if (has_callback)
+      callback();
+    cond.notify_all();
+    lock.lock();
+    put_unlock();
+  }
+
+  /*
+   * AioAppend state machine:
+   *
+   *   AppendStart -> (sequencer) -> AppendWrite -> (rados) -> aio_safe_cb_append
+   *     -> AppendDone
+   *   AppendStart -> (append coalescer) -> AppendDone
+   *
+   * A stale epoch waits for the new projection to be announced, refreshes
+   * it asynchronously and restarts, and a read-only position restarts with
+   * a new position. None of the steps block, so they are safe to run from
+   * sequencer and rados callbacks.
+   */
+  void AppendStart();
+  void AppendWrite(uint64_t position);
+  void AppendDone(int ret, uint64_t epoch);
+
+  /*
+   * AioRead: submit (or resubmit) the read.
+   */
+  void ReadSubmit();
+
+  /*
+   * AioAppendBatch: positions are reserved in ranges, then each entry runs
+   * its own append state machine.
+   */
+  void BatchReserve(size_t next);
+  void BatchEntryStart(AioBatchEntry *entry);
+  void BatchEntryWrite(AioBatchEntry *entry, uint64_t position);
+  void BatchEntryWriteDone(AioBatchEntry *entry, int ret, uint64_t epoch);
+  void BatchEntryDone(AioBatchEntry *entry, int ret);
+
   static void aio_safe_cb_read(librados::completion_t cb, void *arg);
   static void aio_safe_cb_append(librados::completion_t cb, void *arg);
+  static void aio_safe_cb_append_batch(librados::completion_t cb, void *arg);
+  static void aio_safe_cb_open(librados::completion_t cb, void *arg);
 };
 
+void AioCompletionImpl::ReadSubmit()
+{
+  std::lock_guard<std::mutex> l(lock);
+
+  c = librados::Rados::aio_create_completion(this, NULL, aio_safe_cb_read);
+  assert(c);
+
+  librados::ObjectReadOperation op;
+  proj = log->GetProjection();
+  zlog::cls_zlog_read(op, proj->epoch, position);
+
+  const std::string& oid = proj->mapper.FindObject(position);
+  int ret = ioctx->aio_operate(oid, c, &op, &bl);
+  /*
+   * Currently aio_operate never fails. If in the future that changes then we
+   * need to make sure that references to impl and the rados completion are
+   * cleaned up correctly.
+   */
+  assert(ret == 0);
+}
+
 /*
  *
  */
@@ -115,7 +254,6 @@ void AioCompletionImpl::aio_safe_cb_read(librados::completion_t cb, void *arg)
 {
   AioCompletionImpl *impl = (AioCompletionImpl*)arg;
   librados::AioCompletion *rc = impl->c;
-  bool finish = false;
 
   impl->lock.lock();
 
@@ -126,69 +264,93 @@ void AioCompletionImpl::aio_safe_cb_read(librados::completion_t cb, void *arg)
 
   assert(impl->type == ZLOG_AIO_READ);
 
+  uint64_t epoch = impl->proj->epoch;
+  impl->proj.reset();
+
+  if (ret == zlog::CLS_ZLOG_OK) {
+    impl->log->CachePut(impl->position, impl->bl);
+    if (impl->pbl && impl->bl.length() > 0)
+      *impl->pbl = impl->bl;
+  }
+
+  impl->lock.unlock();
+
   if (ret == zlog::CLS_ZLOG_OK) {
     /*
      * Read was successful. We're done.
      */
-    if (impl->pbl && impl->bl.length() > 0) {
-      *impl->pbl = impl->bl;
-    }
-    ret = 0;
-    finish = true;
+    impl->Complete(0);
   } else if (ret == zlog::CLS_ZLOG_STALE_EPOCH) {
     /*
      * We'll need to try again with a new epoch.
      */
-    ret = impl->log->RefreshProjection();
-    if (ret)
-      finish = true;
+    impl->log->AioRefreshProjection(epoch, [impl](int ret) {
+      if (ret)
+        impl->Complete(ret);
+      else
+        impl->ReadSubmit();
+    });
   } else if (ret < 0) {
     /*
      * Encountered a RADOS error.
      */
-    finish = true;
+    impl->Complete(ret);
   } else if (ret == zlog::CLS_ZLOG_NOT_WRITTEN) {
-    ret = -ENODEV;
-    finish = true;
+    impl->Complete(-ENODEV);
   } else if (ret == zlog::CLS_ZLOG_INVALIDATED) {
-    ret = -EFAULT;
-    finish = true;
+    impl->Complete(-EFAULT);
   } else {
     assert(0);
   }
+}
 
-  /*
-   * Try append again with a new position. This can happen if above there is a
-   * stale epoch that we refresh, or if the position was marked read-only.
-   */
-  if (!finish) {
-    impl->c = librados::Rados::aio_create_completion(impl, NULL, aio_safe_cb_read);
-    assert(impl->c);
-    // don't need impl->get(): reuse reference
-
-    // build and submit new op
-    std::string oid = impl->log->mapper_.FindObject(impl->position);
-    librados::ObjectReadOperation op;
-    zlog::cls_zlog_read(op, impl->log->epoch_, impl->position);
-    ret = impl->ioctx->aio_operate(oid, impl->c, &op, &impl->bl);
-    if (ret)
-      finish = true;
-  }
-
-  // complete aio if append success, or any error
-  if (finish) {
-    impl->retval = ret;
-    impl->complete = true;
-    impl->lock.unlock();
-    if (impl->has_callback)
-      impl->callback();
-    impl->cond.notify_all();
-    impl->lock.lock();
-    impl->put_unlock();
+/*
+ * With append coalescing the coalescer reserves the position and writes the
+ * entry along with others that map to the same object.
+ */
+void AioCompletionImpl::AppendStart()
+{
+  if (log->coalescer_) {
+    log->coalescer_->Add(bl,
+        [this](int ret, uint64_t epoch, uint64_t position) {
+      lock.lock();
+      this->position = position;
+      lock.unlock();
+      AppendDone(ret, epoch);
+    });
     return;
   }
 
-  impl->lock.unlock();
+  log->AioNextPosition([this](int ret, uint64_t position) {
+    if (ret)
+      Complete(ret);
+    else
+      AppendWrite(position);
+  });
+}
+
+void AioCompletionImpl::AppendWrite(uint64_t position)
+{
+  std::lock_guard<std::mutex> l(lock);
+
+  this->position = position;
+
+  c = librados::Rados::aio_create_completion(this, NULL, aio_safe_cb_append);
+  assert(c);
+
+  librados::ObjectWriteOperation op;
+  proj = log->GetProjection();
+  zlog::cls_zlog_write(op, proj->epoch, position, bl);
+
+  oid = &proj->mapper.FindObject(position);
+  start = log->ObjectOpStart(*oid);
+  int ret = ioctx->aio_operate(*oid, c, &op);
+  /*
+   * Currently aio_operate never fails. If in the future that changes then we
+   * need to make sure that references to impl and the rados completion are
+   * cleaned up correctly.
+   */
+  assert(ret == 0);
 }
 
 /*
@@ -198,7 +360,6 @@ void AioCompletionImpl::aio_safe_cb_append(librados::completion_t cb, void *arg)
 {
   AioCompletionImpl *impl = (AioCompletionImpl*)arg;
   librados::AioCompletion *rc = impl->c;
-  bool finish = false;
 
   impl->lock.lock();
 
@@ -209,74 +370,510 @@ void AioCompletionImpl::aio_safe_cb_append(librados::completion_t cb, void *arg)
 
   assert(impl->type == ZLOG_AIO_APPEND);
 
+  impl->log->ObjectOpFinish(*impl->oid, impl->start);
+  uint64_t epoch = impl->proj->epoch;
+  impl->proj.reset();
+
+  impl->lock.unlock();
+
+  impl->AppendDone(ret, epoch);
+}
+
+void AioCompletionImpl::AppendDone(int ret, uint64_t epoch)
+{
   if (ret == zlog::CLS_ZLOG_OK) {
+    lock.lock();
+    log->CacheAppend(position, bl);
+    if (pposition)
+      *pposition = position;
+    lock.unlock();
+
     /*
      * Append was successful. We're done.
      */
-    if (impl->pposition) {
-      *impl->pposition = impl->position;
-    }
-    ret = 0;
-    finish = true;
+    Complete(0);
   } else if (ret == zlog::CLS_ZLOG_STALE_EPOCH) {
     /*
-     * We'll need to try again with a new epoch.
+     * We'll need to try again with a new epoch. The position is kept unless
+     * it was invalidated by the cut.
      */
-    ret = impl->log->RefreshProjection();
-    if (ret)
-      finish = true;
+    uint64_t position = this->position;
+    log->AioRefreshProjection(epoch, [this, position](int ret) {
+      if (ret)
+        Complete(ret);
+      else if (log->PositionSealed(position))
+        AppendStart();
+      else
+        AppendWrite(position);
+    });
   } else if (ret < 0) {
     /*
      * Encountered a RADOS error.
      */
-    finish = true;
+    Complete(ret);
   } else {
+    /*
+     * Try again with a new position.
+     */
     assert(ret == zlog::CLS_ZLOG_READ_ONLY);
+    AppendStart();
   }
+}
 
-  /*
-   * Try append again with a new position. This can happen if above there is a
-   * stale epoch that we refresh, or if the position was marked read-only.
-   */
-  if (!finish) {
-    // if we are appending, get a new position
-    uint64_t position;
-    ret = impl->log->CheckTail(&position, true);
+void AioCompletionImpl::BatchEntryStart(AioBatchEntry *entry)
+{
+  if (log->coalescer_) {
+    log->coalescer_->Add(entry->bl,
+        [this, entry](int ret, uint64_t epoch, uint64_t position) {
+      lock.lock();
+      entry->position = position;
+      lock.unlock();
+      BatchEntryWriteDone(entry, ret, epoch);
+    });
+    return;
+  }
+
+  log->AioNextPosition([this, entry](int ret, uint64_t position) {
     if (ret)
-      finish = true;
+      BatchEntryDone(entry, ret);
     else
-      impl->position = position;
-
-    // we are still good. build a new aio
-    if (!finish) {
-      impl->c = librados::Rados::aio_create_completion(impl, NULL, aio_safe_cb_append);
-      assert(impl->c);
-      // don't need impl->get(): reuse reference
-
-      // build and submit new op
-      std::string oid = impl->log->mapper_.FindObject(impl->position);
-      librados::ObjectWriteOperation op;
-      zlog::cls_zlog_write(op, impl->log->epoch_, impl->position, impl->bl);
-      ret = impl->ioctx->aio_operate(oid, impl->c, &op);
+      BatchEntryWrite(entry, position);
+  });
+}
+
+void AioCompletionImpl::BatchEntryWrite(AioBatchEntry *entry,
+    uint64_t position)
+{
+  std::lock_guard<std::mutex> l(lock);
+
+  entry->has_position = true;
+  entry->position = position;
+
+  entry->c = librados::Rados::aio_create_completion(entry, NULL,
+      aio_safe_cb_append_batch);
+  assert(entry->c);
+
+  librados::ObjectWriteOperation op;
+  entry->proj = log->GetProjection();
+  zlog::cls_zlog_write(op, entry->proj->epoch, position, entry->bl);
+
+  entry->oid = &entry->proj->mapper.FindObject(position);
+  entry->start = log->ObjectOpStart(*entry->oid);
+  int ret = ioctx->aio_operate(*entry->oid, entry->c, &op);
+  assert(ret == 0);
+}
+
+/*
+ * Positions are reserved for up to CHECK_TAIL_BATCH_MAX entries at a time,
+ * and each entry is written as soon as its position arrives. The next range
+ * is requested before the current one is written, since the batch may
+ * complete once the last entries are written. If a reservation fails the
+ * entries still without a position fail with it.
+ */
+void AioCompletionImpl::BatchReserve(size_t next)
+{
+  const size_t total = batch.size();
+  const size_t count = std::min(total - next, (size_t)CHECK_TAIL_BATCH_MAX);
+
+  log->AioNextRange(count, [this, next, count, total](int ret,
+        uint64_t start) {
+    if (ret) {
+      for (size_t i = next; i < total; i++)
+        BatchEntryDone(&batch[i], ret);
+      return;
+    }
+
+    if (next + count < total)
+      BatchReserve(next + count);
+
+    for (size_t i = 0; i < count; i++)
+      BatchEntryWrite(&batch[next + i], start + i);
+  });
+}
+
+/*
+ * The batch as a whole completes once every entry has either been written or
+ * has failed, and reports the first error encountered by any entry. A failed
+ * entry's position is filled so that it doesn't stay a hole.
+ */
+void AioCompletionImpl::BatchEntryDone(AioBatchEntry *entry, int ret)
+{
+  if (ret && entry->has_position)
+    log->AioFill(entry->position);
+
+  lock.lock();
+
+  if (ret && !retval)
+    retval = ret;
+
+  // drop this entry's reference if other entries are still in flight
+  assert(pending > 0);
+  if (--pending > 0) {
+    put_unlock();
+    return;
+  }
+
+  if (retval == 0 && pbatch_positions) {
+    std::vector<uint64_t> positions;
+    for (const auto& e : batch)
+      positions.push_back(e.position);
+    pbatch_positions->swap(positions);
+  }
+
+  ret = retval;
+
+  lock.unlock();
+
+  Complete(ret);
+}
+
+/*
+ * Completion for a single entry of a batch append. Failed entries are
+ * retried individually and don't affect the other entries in the batch.
+ */
+void AioCompletionImpl::aio_safe_cb_append_batch(librados::completion_t cb, void *arg)
+{
+  AioBatchEntry *entry = (AioBatchEntry*)arg;
+  AioCompletionImpl *impl = entry->impl;
+
+  impl->lock.lock();
+
+  librados::AioCompletion *rc = entry->c;
+  int ret = rc->get_return_value();
+
+  // done with the rados completion
+  rc->release();
+
+  assert(impl->type == ZLOG_AIO_APPEND_BATCH);
+
+  impl->log->ObjectOpFinish(*entry->oid, entry->start);
+  uint64_t epoch = entry->proj->epoch;
+  entry->proj.reset();
+
+  impl->lock.unlock();
+
+  impl->BatchEntryWriteDone(entry, ret, epoch);
+}
+
+void AioCompletionImpl::BatchEntryWriteDone(AioBatchEntry *entry, int ret,
+    uint64_t epoch)
+{
+  if (ret == zlog::CLS_ZLOG_OK) {
+    log->CacheAppend(entry->position, entry->bl);
+    BatchEntryDone(entry, 0);
+  } else if (ret == zlog::CLS_ZLOG_STALE_EPOCH) {
+    log->AioRefreshProjection(epoch, [this, entry](int ret) {
       if (ret)
-        finish = true;
+        BatchEntryDone(entry, ret);
+      else if (log->PositionSealed(entry->position))
+        BatchEntryStart(entry);
+      else
+        BatchEntryWrite(entry, entry->position);
+    });
+  } else if (ret < 0) {
+    BatchEntryDone(entry, ret);
+  } else {
+    assert(ret == zlog::CLS_ZLOG_READ_ONLY);
+    BatchEntryStart(entry);
+  }
+}
+
+/*
+ * State for an asynchronous projection refresh.
+ */
+struct AioProjectionState {
+  LogImpl *log;
+  librados::AioCompletion *c;
+  int rv;
+  uint64_t epoch;
+  ceph::bufferlist bl;
+  ceph::bufferlist unused;
+  std::function<void(int)> callback;
+
+  // incremental refresh
+  std::shared_ptr<const Projection> cur;
+  std::map<std::string, ceph::bufferlist> deltas;
+};
+
+static void aio_refresh_projection_cb(librados::completion_t cb, void *arg);
+
+/*
+ * Read the full projection.
+ */
+static void aio_refresh_projection_full(AioProjectionState *state)
+{
+  state->cur.reset();
+
+  state->c = librados::Rados::aio_create_completion(state, NULL,
+      aio_refresh_projection_cb);
+  assert(state->c);
+
+  librados::ObjectReadOperation op;
+  cls_zlog_get_latest_projection(op, &state->rv, &state->epoch, &state->bl);
+
+  int ret = state->log->ioctx_->aio_operate(state->log->metalog_oid_,
+      state->c, &op, &state->unused);
+  assert(ret == 0);
+}
+
+static void aio_refresh_projection_cb(librados::completion_t cb, void *arg)
+{
+  AioProjectionState *state = (AioProjectionState*)arg;
+
+  int ret = state->c->get_return_value();
+  state->c->release();
+
+  if (ret == 0 && state->rv)
+    ret = state->rv;
+
+  if (state->cur) {
+    if (ret == 0)
+      ret = state->log->ApplyProjectionDeltas(state->cur, state->deltas);
+    if (ret) {
+      // fall back to reading the full projection
+      aio_refresh_projection_full(state);
+      return;
     }
+  } else if (ret)
+    std::cerr << "failed to get projection ret " << ret << std::endl;
+  else
+    ret = state->log->ApplyProjection(state->epoch, state->bl);
+
+  state->log->FinishRefresh(ret);
+  state->callback(ret);
+
+  delete state;
+}
+
+void LogImpl::AioRefreshProjectionOnce(uint64_t epoch,
+    std::function<void(int)> callback)
+{
+  uint64_t first;
+  {
+    std::lock_guard<std::mutex> l(shared_->lock);
+    first = shared_->refresh_started + 1;
   }
+  AioRefreshProjectionOnce(epoch, first, callback);
+}
 
-  // complete aio if append success, or any error
-  if (finish) {
-    impl->retval = ret;
-    impl->complete = true;
-    impl->lock.unlock();
-    if (impl->has_callback)
-      impl->callback();
-    impl->cond.notify_all();
-    impl->lock.lock();
-    impl->put_unlock();
+/*
+ * See RefreshProjection(epoch). A refresh that started before the caller's
+ * first attempt is waited out by queueing a retry behind it.
+ */
+void LogImpl::AioRefreshProjectionOnce(uint64_t epoch, uint64_t first,
+    std::function<void(int)> callback)
+{
+  bool current;
+  {
+    std::lock_guard<std::mutex> l(shared_->lock);
+    std::shared_ptr<const Projection> cur = GetProjection();
+    current = cur && cur->epoch > epoch;
+    if (!current && shared_->refreshing) {
+      if (shared_->refresh_started >= first)
+        shared_->waiters.push_back(callback);
+      else
+        shared_->waiters.push_back([this, epoch, first, callback](int ret) {
+          AioRefreshProjectionOnce(epoch, first, callback);
+        });
+      return;
+    }
+    if (!current) {
+      shared_->refreshing = true;
+      shared_->refresh_started++;
+    }
+  }
+
+  if (current) {
+    callback(0);
     return;
   }
 
-  impl->lock.unlock();
+  AioProjectionState *state = new AioProjectionState;
+  state->log = this;
+  state->callback = callback;
+  state->cur = GetProjection();
+
+  if (!state->cur) {
+    aio_refresh_projection_full(state);
+    return;
+  }
+
+  state->c = librados::Rados::aio_create_completion(state, NULL,
+      aio_refresh_projection_cb);
+  assert(state->c);
+
+  librados::ObjectReadOperation op;
+  op.omap_get_vals(LogImpl::projection_delta_key(state->cur->epoch),
+      PROJECTION_DELTA_PREFIX, PROJECTION_DELTA_MAX, &state->deltas,
+      &state->rv);
+
+  int ret = ioctx_->aio_operate(metalog_oid_, state->c, &op, &state->unused);
+  assert(ret == 0);
+}
+
+void LogImpl::AioRefreshProjection(uint64_t epoch,
+    std::function<void(int)> callback)
+{
+  AioRefreshProjection(epoch, AIO_RETRY_MIN_MS, callback);
+}
+
+/*
+ * The objects are sealed before the new projection is installed, so an
+ * operation that hit a stale epoch may read the projection before the cut
+ * is finished. Rather than spinning, wait for the cut to be announced and
+ * back off while the projection read isn't newer than the stale epoch.
+ */
+void LogImpl::AioRefreshProjection(uint64_t epoch, int backoff_ms,
+    std::function<void(int)> callback)
+{
+  AioWaitForProjection(epoch, backoff_ms,
+      [this, epoch, backoff_ms, callback]() {
+    AioRefreshProjectionOnce(epoch,
+        [this, epoch, backoff_ms, callback](int ret) {
+      if (ret)
+        callback(ret);
+      else if (GetProjection()->epoch > epoch)
+        callback(0);
+      else
+        AioRefreshProjection(epoch,
+            std::min(backoff_ms * 2, AIO_RETRY_MAX_MS), callback);
+    });
+  });
+}
+
+void LogImpl::AioNextRange(size_t count,
+    std::function<void(int, uint64_t)> callback)
+{
+  uint64_t epoch = GetProjection()->epoch;
+  seqr->AsyncCheckTailRange(epoch, pool_, name_, count,
+      [this, count, epoch, callback](int ret, uint64_t start) {
+    if (ret == -ERANGE) {
+      AioRefreshProjection(epoch, [this, count, callback](int ret) {
+        if (ret)
+          callback(ret, 0);
+        else
+          AioNextRange(count, callback);
+      });
+      return;
+    }
+    callback(ret, start);
+  });
+}
+
+/*
+ * State for a background fill.
+ */
+struct AioFillState {
+  LogImpl *log;
+  librados::AioCompletion *c;
+  uint64_t epoch;
+  uint64_t position;
+};
+
+static void aio_safe_cb_fill(librados::completion_t cb, void *arg)
+{
+  AioFillState *state = (AioFillState*)arg;
+
+  int ret = state->c->get_return_value();
+  state->c->release();
+
+  LogImpl *log = state->log;
+  uint64_t position = state->position;
+
+  if (ret == zlog::CLS_ZLOG_STALE_EPOCH) {
+    log->AioRefreshProjection(state->epoch, [log, position](int ret) {
+      if (ret)
+        std::cerr << "fill: failed to refresh projection ret "
+          << ret << std::endl;
+      else
+        log->AioFill(position);
+    });
+  } else if (ret < 0)
+    std::cerr << "fill: failed ret " << ret << std::endl;
+
+  delete state;
+}
+
+/*
+ * A position that was written in the meantime stays as it is.
+ */
+void LogImpl::AioFill(uint64_t position)
+{
+  AioFillState *state = new AioFillState;
+  state->log = this;
+  state->position = position;
+
+  std::shared_ptr<const Projection> proj = GetProjection();
+  state->epoch = proj->epoch;
+
+  librados::ObjectWriteOperation op;
+  zlog::cls_zlog_fill(op, proj->epoch, position);
+
+  state->c = librados::Rados::aio_create_completion(state, NULL,
+      aio_safe_cb_fill);
+  assert(state->c);
+
+  int ret = ioctx_->aio_operate(proj->mapper.FindObject(position),
+      state->c, &op);
+  assert(ret == 0);
+}
+
+void LogImpl::AioNextPosition(std::function<void(int, uint64_t)> callback)
+{
+  uint64_t position;
+  if (reservations_ && reservations_->Get(&position)) {
+    callback(0, position);
+    return;
+  }
+
+  uint64_t epoch = GetProjection()->epoch;
+  seqr->AsyncCheckTail(epoch, pool_, name_, true,
+      [this, epoch, callback](int ret, uint64_t position) {
+    if (ret == -ERANGE) {
+      AioRefreshProjection(epoch, [this, callback](int ret) {
+        if (ret)
+          callback(ret, 0);
+        else
+          AioNextPosition(callback);
+      });
+      return;
+    }
+    callback(ret, position);
+  });
+}
+
+/*
+ * The new handle is owned by the aio until the open succeeds, after which it
+ * belongs to the caller.
+ */
+void AioCompletionImpl::aio_safe_cb_open(librados::completion_t cb, void *arg)
+{
+  AioCompletionImpl *impl = (AioCompletionImpl*)arg;
+  librados::AioCompletion *rc = impl->c;
+
+  int ret = rc->get_return_value();
+  rc->release();
+
+  assert(impl->type == ZLOG_AIO_OPEN);
+
+  if (ret == 0 && impl->rv)
+    ret = impl->rv;
+
+  if (ret == 0)
+    ret = impl->log->ApplyProjection(impl->epoch, impl->bl);
+  else if (ret != -ENOENT)
+    std::cerr << "Failed to open log meta object " << impl->log->metalog_oid_
+      << " ret " << ret << std::endl;
+
+  if (ret) {
+    delete impl->log;
+  } else {
+    impl->log->InitHandle();
+    *impl->plog = impl->log;
+  }
+  impl->log = NULL;
+
+  impl->Complete(ret);
 }
 
 AioCompletion::~AioCompletion() {}
@@ -330,47 +927,62 @@ zlog::AioCompletion *Log::aio_create_completion()
 }
 
 /*
- * The retry for AioAppend is coordinated through the aio_safe_cb callback
- * which will dispatch a new rados operation.
+ * The AioAppend state machine (see AppendStart) takes care of getting a
+ * position, and retrying after stale epochs or read-only positions, without
+ * blocking the caller or any callback thread.
  */
 int LogImpl::AioAppend(AioCompletion *c, ceph::bufferlist& data,
     uint64_t *pposition)
 {
-  // initial position guess
-  uint64_t position;
-  int ret = CheckTail(&position, true);
-  if (ret)
-    return ret;
-
   AioCompletionImplWrapper *wrapper =
     reinterpret_cast<AioCompletionImplWrapper*>(c);
   AioCompletionImpl *impl = wrapper->impl_;
 
   impl->log = this;
   impl->bl = data;
-  impl->position = position;
   impl->pposition = pposition;
   impl->ioctx = ioctx_;
   impl->type = ZLOG_AIO_APPEND;
 
-  impl->get(); // rados aio now has a reference
-  impl->c = librados::Rados::aio_create_completion(impl, NULL,
-      AioCompletionImpl::aio_safe_cb_append);
-  assert(impl->c);
+  impl->get(); // the append state machine now has a reference
+  impl->AppendStart();
 
-  librados::ObjectWriteOperation op;
-  zlog::cls_zlog_write(op, epoch_, position, data);
+  return 0;
+}
 
-  std::string oid = mapper_.FindObject(position);
-  ret = ioctx_->aio_operate(oid, impl->c, &op);
-  /*
-   * Currently aio_operate never fails. If in the future that changes then we
-   * need to make sure that references to impl and the rados completion are
-   * cleaned up correctly.
-   */
-  assert(ret == 0);
+/*
+ * Positions for the batch are reserved asynchronously in ranges (see
+ * BatchReserve) and every entry is written concurrently. Retries are handled
+ * per-entry.
+ */
+int LogImpl::AioAppendBatch(AioCompletion *c,
+    std::vector<ceph::bufferlist>& data, std::vector<uint64_t> *pposition)
+{
+  if (data.empty())
+    return -EINVAL;
+
+  AioCompletionImplWrapper *wrapper =
+    reinterpret_cast<AioCompletionImplWrapper*>(c);
+  AioCompletionImpl *impl = wrapper->impl_;
 
-  return ret;
+  impl->log = this;
+  impl->pbatch_positions = pposition;
+  impl->ioctx = ioctx_;
+  impl->type = ZLOG_AIO_APPEND_BATCH;
+  impl->pending = data.size();
+  impl->batch.resize(data.size());
+
+  for (size_t i = 0; i < data.size(); i++) {
+    AioBatchEntry& entry = impl->batch[i];
+    entry.impl = impl;
+    entry.has_position = false;
+    entry.bl = data[i];
+    impl->get(); // each entry has a reference
+  }
+
+  impl->BatchReserve(0);
+
+  return 0;
 }
 
 int LogImpl::AioRead(uint64_t position, AioCompletion *c,
@@ -387,23 +999,47 @@ int LogImpl::AioRead(uint64_t position, AioCompletion *c,
   impl->type = ZLOG_AIO_READ;
 
   impl->get(); // rados aio now has a reference
+
+  /*
+   * A cached entry completes the read immediately, in the calling thread.
+   */
+  ceph::bufferlist bl;
+  if (CacheGet(position, bl)) {
+    if (pbl && bl.length() > 0)
+      *pbl = bl;
+    impl->Complete(0);
+    return 0;
+  }
+
+  impl->ReadSubmit();
+
+  return 0;
+}
+
+void LogImpl::AioOpenProjection(AioCompletion *c, Log **logptr)
+{
+  AioCompletionImplWrapper *wrapper =
+    reinterpret_cast<AioCompletionImplWrapper*>(c);
+  AioCompletionImpl *impl = wrapper->impl_;
+
+  impl->log = this;
+  impl->plog = logptr;
+  impl->ioctx = ioctx_;
+  impl->type = ZLOG_AIO_OPEN;
+
+  impl->get(); // rados aio now has a reference
+
+  // see Log::Open
   impl->c = librados::Rados::aio_create_completion(impl, NULL,
-      AioCompletionImpl::aio_safe_cb_read);
+      AioCompletionImpl::aio_safe_cb_open);
   assert(impl->c);
 
   librados::ObjectReadOperation op;
-  zlog::cls_zlog_read(op, epoch_, position);
+  op.assert_exists();
+  cls_zlog_get_latest_projection(op, &impl->rv, &impl->epoch, &impl->bl);
 
-  std::string oid = mapper_.FindObject(position);
-  int ret = ioctx_->aio_operate(oid, impl->c, &op, &impl->bl);
-  /*
-   * Currently aio_operate never fails. If in the future that changes then we
-   * need to make sure that references to impl and the rados completion are
-   * cleaned up correctly.
-   */
+  int ret = ioctx_->aio_operate(metalog_oid_, impl->c, &op, &impl->unused);
   assert(ret == 0);
-
-  return ret;
 }
 
 }
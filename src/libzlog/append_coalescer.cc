@@ -0,0 +1,151 @@
+#include "append_coalescer.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include <rados/cls_zlog_client.h>
+
+#include "log_impl.h"
+
+namespace zlog {
+
+/*
+ * The write of one entry of a window.
+ */
+struct CoalescedWrite {
+  LogImpl *log;
+  librados::AioCompletion *c;
+  uint64_t epoch;
+  std::string oid;
+  std::chrono::steady_clock::time_point start;
+  uint64_t position;
+  AppendCoalescer::Callback callback;
+};
+
+AppendCoalescer::AppendCoalescer(LogImpl *log, size_t max_entries,
+    uint64_t window_us) :
+  log_(log), max_entries_(max_entries), window_(window_us), stop_(false)
+{
+  assert(max_entries_ > 0);
+  thread_ = std::thread(&AppendCoalescer::Run, this);
+}
+
+AppendCoalescer::~AppendCoalescer()
+{
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+}
+
+void AppendCoalescer::Add(const ceph::bufferlist& data, Callback callback)
+{
+  Entry entry;
+  entry.data = data;
+  entry.callback = callback;
+
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    if (pending_.empty())
+      window_start_ = std::chrono::steady_clock::now();
+    pending_.push_back(entry);
+  }
+  cond_.notify_one();
+}
+
+void AppendCoalescer::Run()
+{
+  std::unique_lock<std::mutex> l(lock_);
+
+  for (;;) {
+    cond_.wait(l, [&]{ return stop_ || !pending_.empty(); });
+
+    if (pending_.empty()) {
+      assert(stop_);
+      break;
+    }
+
+    // let the window fill up. pending requests are flushed on shutdown.
+    cond_.wait_until(l, window_start_ + window_, [&]{
+      return stop_ || pending_.size() >= max_entries_;
+    });
+
+    size_t count = std::min(pending_.size(), max_entries_);
+    std::vector<Entry> batch(pending_.begin(), pending_.begin() + count);
+    pending_.erase(pending_.begin(), pending_.begin() + count);
+    if (!pending_.empty())
+      window_start_ = std::chrono::steady_clock::now();
+
+    l.unlock();
+    Flush(batch);
+    l.lock();
+  }
+}
+
+void AppendCoalescer::Flush(std::vector<Entry>& batch)
+{
+  std::vector<uint64_t> positions;
+  while (positions.size() < batch.size()) {
+    size_t count = std::min(batch.size() - positions.size(),
+        (size_t)CHECK_TAIL_BATCH_MAX);
+    std::vector<uint64_t> result;
+    int ret = log_->CheckTail(result, count);
+    if (ret) {
+      for (size_t i = positions.size(); i < batch.size(); i++)
+        batch[i].callback(ret, 0, 0);
+      batch.resize(positions.size());
+      break;
+    }
+    positions.insert(positions.end(), result.begin(), result.end());
+  }
+
+  /*
+   * The writes for an object are issued back to back, in position order,
+   * so they reach the object in the order the positions were handed out.
+   */
+  std::shared_ptr<const Projection> proj = log_->GetProjection();
+  std::map<std::string, std::vector<size_t>> objects;
+  for (size_t i = 0; i < batch.size(); i++)
+    objects[proj->mapper.FindObject(positions[i])].push_back(i);
+
+  for (const auto& object : objects) {
+    for (const size_t i : object.second) {
+      CoalescedWrite *write = new CoalescedWrite;
+      write->log = log_;
+      write->epoch = proj->epoch;
+      write->oid = object.first;
+      write->position = positions[i];
+      write->callback = batch[i].callback;
+
+      librados::ObjectWriteOperation op;
+      cls_zlog_write(op, write->epoch, write->position, batch[i].data);
+
+      write->c = librados::Rados::aio_create_completion(write, NULL,
+          aio_safe_cb_write);
+      assert(write->c);
+
+      write->start = log_->ObjectOpStart(write->oid);
+      int ret = log_->ioctx_->aio_operate(write->oid, write->c, &op);
+      assert(ret == 0);
+    }
+  }
+}
+
+void AppendCoalescer::aio_safe_cb_write(librados::completion_t cb, void *arg)
+{
+  CoalescedWrite *write = (CoalescedWrite*)arg;
+
+  int ret = write->c->get_return_value();
+  write->c->release();
+
+  write->log->ObjectOpFinish(write->oid, write->start);
+
+  write->callback(ret, write->epoch, write->position);
+
+  delete write;
+}
+
+}
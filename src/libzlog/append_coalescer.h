@@ -0,0 +1,67 @@
+#ifndef ZLOG_APPEND_COALESCER_H_
+#define ZLOG_APPEND_COALESCER_H_
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <rados/librados.hpp>
+
+namespace zlog {
+
+class LogImpl;
+
+/*
+ * Gathers concurrent asynchronous appends over a short window (bounded by
+ * time and by number of entries) and serves the whole window with a single
+ * batched sequencer request. The entries in a window are then grouped by
+ * the stripe object that they map to, and the writes for each object are
+ * issued back to back, one cls_zlog write per entry, so that each entry
+ * gets its own status and is retried individually.
+ */
+class AppendCoalescer {
+ public:
+  /*
+   * Called with the result of the write (a cls_zlog status, or a negative
+   * error if the write or the position request failed), the epoch the
+   * write was tagged with, and the position.
+   */
+  typedef std::function<void(int, uint64_t, uint64_t)> Callback;
+
+  AppendCoalescer(LogImpl *log, size_t max_entries, uint64_t window_us);
+  ~AppendCoalescer();
+
+  /*
+   * Queue an entry to be appended. The callback runs on a rados callback
+   * thread, or on the coalescer thread if positions couldn't be reserved,
+   * and must not block.
+   */
+  void Add(const ceph::bufferlist& data, Callback callback);
+
+ private:
+  struct Entry {
+    ceph::bufferlist data;
+    Callback callback;
+  };
+
+  void Run();
+  void Flush(std::vector<Entry>& batch);
+
+  static void aio_safe_cb_write(librados::completion_t cb, void *arg);
+
+  LogImpl *log_;
+  const size_t max_entries_;
+  const std::chrono::microseconds window_;
+
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::vector<Entry> pending_;
+  std::chrono::steady_clock::time_point window_start_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}
+
+#endif
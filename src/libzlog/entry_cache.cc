@@ -0,0 +1,72 @@
+#include "entry_cache.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace zlog {
+
+EntryCache::EntryCache(size_t capacity, size_t num_shards) :
+  shards_(num_shards), hits_(0), misses_(0)
+{
+  assert(num_shards > 0);
+  shard_capacity_ = std::max((size_t)1, capacity / num_shards);
+}
+
+bool EntryCache::Get(uint64_t position, ceph::bufferlist& bl)
+{
+  Shard& shard = ShardFor(position);
+  std::lock_guard<std::mutex> l(shard.lock);
+
+  auto it = shard.entries.find(position);
+  if (it == shard.entries.end()) {
+    misses_++;
+    return false;
+  }
+
+  // move to the front of the lru list
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_it);
+
+  bl = it->second.bl;
+  hits_++;
+
+  return true;
+}
+
+void EntryCache::Put(uint64_t position, const ceph::bufferlist& bl)
+{
+  Shard& shard = ShardFor(position);
+  std::lock_guard<std::mutex> l(shard.lock);
+
+  auto it = shard.entries.find(position);
+  if (it != shard.entries.end()) {
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_it);
+    return;
+  }
+
+  if (shard.entries.size() >= shard_capacity_) {
+    uint64_t victim = shard.lru.back();
+    shard.lru.pop_back();
+    shard.entries.erase(victim);
+  }
+
+  shard.lru.push_front(position);
+
+  Shard::Entry& entry = shard.entries[position];
+  entry.bl = bl;
+  entry.lru_it = shard.lru.begin();
+}
+
+void EntryCache::Erase(uint64_t position)
+{
+  Shard& shard = ShardFor(position);
+  std::lock_guard<std::mutex> l(shard.lock);
+
+  auto it = shard.entries.find(position);
+  if (it == shard.entries.end())
+    return;
+
+  shard.lru.erase(it->second.lru_it);
+  shard.entries.erase(it);
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef ZLOG_ENTRY_CACHE_H_
+#define ZLOG_ENTRY_CACHE_H_
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <rados/librados.hpp>
+
+namespace zlog {
+
+/*
+ * A bounded cache of log entries keyed by position. Entries are write-once
+ * so a cached entry stays valid until the position is trimmed. Cached
+ * bufferlists share their buffers with the bufferlists handed out by Get.
+ *
+ * The cache is split into shards by position, each with its own lock and
+ * LRU list, so that concurrent readers of neighbouring positions don't
+ * contend on a single lock.
+ */
+class EntryCache {
+ public:
+  EntryCache(size_t capacity, size_t num_shards = 16);
+
+  /*
+   * Returns true and sets bl if the entry is cached.
+   */
+  bool Get(uint64_t position, ceph::bufferlist& bl);
+
+  void Put(uint64_t position, const ceph::bufferlist& bl);
+  void Erase(uint64_t position);
+
+  uint64_t Hits() const {
+    return hits_;
+  }
+
+  uint64_t Misses() const {
+    return misses_;
+  }
+
+ private:
+  struct Shard {
+    typedef std::list<uint64_t> lru_t;
+
+    struct Entry {
+      ceph::bufferlist bl;
+      lru_t::iterator lru_it;
+    };
+
+    std::mutex lock;
+    lru_t lru;
+    std::unordered_map<uint64_t, Entry> entries;
+  };
+
+  Shard& ShardFor(uint64_t position) {
+    return shards_[position % shards_.size()];
+  }
+
+  size_t shard_capacity_;
+  std::vector<Shard> shards_;
+
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+};
+
+}
+
+#endif
@@ -1,8 +1,15 @@
 #include "log_impl.h"
 
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -34,8 +41,114 @@ std::string LogImpl::metalog_oid_from_name(const std::string& name)
   return ss.str();
 }
 
+Log::~Log() {}
+
+LogImpl::~LogImpl()
+{
+  {
+    std::lock_guard<std::mutex> l(notify_lock_);
+    waiters_stop_ = true;
+  }
+  notify_cond_.notify_all();
+  if (waiters_thread_.joinable())
+    waiters_thread_.join();
+
+  if (watch_c_) {
+    watch_c_->wait_for_complete();
+    if (watch_c_->get_return_value() == 0)
+      ioctx_->unwatch2(watch_handle_);
+    watch_c_->release();
+  }
+
+  delete controller_;
+
+  // flushes any pending coalesced appends
+  delete coalescer_;
+
+  // fills any unused reserved positions
+  delete reservations_;
+
+  delete cache_;
+}
+
+/*
+ * Check that a set of log handle options is usable.
+ */
+static int validate_options(const Options& options, SeqrClient *seqr)
+{
+  if (options.reservation_size > 0) {
+    if (!seqr) {
+      std::cerr << "Reservations require a sequencer" << std::endl;
+      return -EINVAL;
+    }
+    if (options.reservation_low_water >= options.reservation_size) {
+      std::cerr << "Invalid reservation low-water mark ("
+        << options.reservation_low_water << " >= "
+        << options.reservation_size << ")" << std::endl;
+      return -EINVAL;
+    }
+  }
+  if (options.append_window_entries > 0 && !seqr) {
+    std::cerr << "Append coalescing requires a sequencer" << std::endl;
+    return -EINVAL;
+  }
+  if (options.stripe_width_min > 0) {
+    if (options.stripe_width_min > options.stripe_width_max) {
+      std::cerr << "Invalid stripe width range ("
+        << options.stripe_width_min << " > "
+        << options.stripe_width_max << ")" << std::endl;
+      return -EINVAL;
+    }
+    if (options.stripe_latency_low_us >= options.stripe_latency_high_us) {
+      std::cerr << "Invalid stripe latency thresholds ("
+        << options.stripe_latency_low_us << " >= "
+        << options.stripe_latency_high_us << ")" << std::endl;
+      return -EINVAL;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Create the log metadata/head object and create the first projection. The
+ * initial projection number is epoch = 0. Note that we don't initially seal
+ * the objects that the log will be striped across. The semantics of
+ * cls_zlog are such that unitialized objects behave exactly as if they had
+ * been sealed with epoch = -1.
+ *
+ * The exclusive create and the projection write are a single compound op,
+ * so -EEXIST means the log already exists and nothing was written. On
+ * success the handle starts out with the projection in @hist, so creating a
+ * log takes a single round trip.
+ */
+static int create_metalog(librados::IoCtx& ioctx, const std::string& name,
+    const Options& options, StripeHistory *hist)
+{
+  const int stripe_size = DEFAULT_STRIPE_SIZE;
+
+  if (options.stripe_block_size > 0)
+    hist->AddStripe(0, 0, stripe_size, StripeHistory::MAPPING_BLOCK,
+        options.stripe_block_size);
+  else
+    hist->AddStripe(0, 0, stripe_size);
+  ceph::bufferlist bl = hist->Serialize();
+
+  librados::ObjectWriteOperation op;
+  op.create(true); // exclusive create
+  cls_zlog_set_projection(op, 0, bl);
+
+  std::string metalog_oid = LogImpl::metalog_oid_from_name(name);
+  return ioctx.operate(metalog_oid, &op);
+}
+
 int Log::Create(librados::IoCtx& ioctx, const std::string& name,
     SeqrClient *seqr, Log **logptr)
+{
+  return Create(ioctx, name, seqr, Options(), logptr);
+}
+
+int Log::Create(librados::IoCtx& ioctx, const std::string& name,
+    SeqrClient *seqr, const Options& options, Log **logptr)
 {
   const int stripe_size = DEFAULT_STRIPE_SIZE;
 
@@ -49,48 +162,28 @@ int Log::Create(librados::IoCtx& ioctx, const std::string& name,
     return -EINVAL;
   }
 
-  // Setup the first projection
-  StripeHistory hist;
-  hist.AddStripe(0, 0, stripe_size);
-  ceph::bufferlist bl = hist.Serialize();
-
-  /*
-   * Create the log metadata/head object and create the first projection. The
-   * initial projection number is epoch = 0. Note that we don't initially seal
-   * the objects that the log will be striped across. The semantics of
-   * cls_zlog are such that unitialized objects behave exactly as if they had
-   * been sealed with epoch = -1.
-   *
-   * The projection will be initialized for this log object during
-   * RefreshProjection in the same way that it is done during Open().
-   */
-  librados::ObjectWriteOperation op;
-  op.create(true); // exclusive create
-  cls_zlog_set_projection(op, 0, bl);
+  int ret = validate_options(options, seqr);
+  if (ret)
+    return ret;
 
-  std::string metalog_oid = LogImpl::metalog_oid_from_name(name);
-  int ret = ioctx.operate(metalog_oid, &op);
+  StripeHistory hist;
+  ret = create_metalog(ioctx, name, options, &hist);
   if (ret) {
     std::cerr << "Failed to create log " << name << " ret "
       << ret << " (" << strerror(-ret) << ")" << std::endl;
     return ret;
   }
 
-  LogImpl *impl = new LogImpl;
+  LogImpl *impl = LogImpl::NewHandle(ioctx, name, seqr, options);
 
-  impl->ioctx_ = &ioctx;
-  impl->pool_ = ioctx.get_pool_name();
-  impl->name_ = name;
-  impl->metalog_oid_ = metalog_oid;
-  impl->seqr = seqr;
-  impl->mapper_.SetName(name);
-
-  ret = impl->RefreshProjection();
+  ret = impl->PublishProjection(0, hist);
   if (ret) {
     delete impl;
     return ret;
   }
 
+  impl->InitHandle();
+
   *logptr = impl;
 
   return 0;
@@ -98,45 +191,162 @@ int Log::Create(librados::IoCtx& ioctx, const std::string& name,
 
 int Log::Open(librados::IoCtx& ioctx, const std::string& name,
     SeqrClient *seqr, Log **logptr)
+{
+  return Open(ioctx, name, seqr, Options(), logptr);
+}
+
+int Log::Open(librados::IoCtx& ioctx, const std::string& name,
+    SeqrClient *seqr, const Options& options, Log **logptr)
 {
   if (name.length() == 0) {
     std::cerr << "Invalid log name (empty string)" << std::endl;
     return -EINVAL;
   }
 
+  int ret = validate_options(options, seqr);
+  if (ret)
+    return ret;
+
+  LogImpl *impl = LogImpl::NewHandle(ioctx, name, seqr, options);
+
   /*
-   * Check that the log metadata/head object exists. The projection and other
-   * state is read during RefreshProjection.
+   * Another handle in this process may already have the projection, but the
+   * log may have been deleted since, so the metalog is always read. The
+   * projection read with it refreshes the shared projection for free.
    */
-  std::string metalog_oid = LogImpl::metalog_oid_from_name(name);
-  int ret = ioctx.stat(metalog_oid, NULL, NULL);
+  ret = impl->OpenProjection();
   if (ret) {
-    std::cerr << "Failed to open log meta object " << metalog_oid << " ret " <<
-      ret << std::endl;
+    delete impl;
     return ret;
   }
 
-  LogImpl *impl = new LogImpl;
+  impl->InitHandle();
 
-  impl->ioctx_ = &ioctx;
-  impl->pool_ = ioctx.get_pool_name();
-  impl->name_ = name;
-  impl->metalog_oid_ = metalog_oid;
-  impl->seqr = seqr;
-  impl->mapper_.SetName(name);
+  *logptr = impl;
+
+  return 0;
+}
+
+int Log::AioOpen(librados::IoCtx& ioctx, const std::string& name,
+    SeqrClient *seqr, AioCompletion *c, Log **logptr)
+{
+  return AioOpen(ioctx, name, seqr, Options(), c, logptr);
+}
+
+/*
+ * Invalid arguments are reported synchronously. Everything else, including
+ * a log that doesn't exist, is reported through the completion.
+ */
+int Log::AioOpen(librados::IoCtx& ioctx, const std::string& name,
+    SeqrClient *seqr, const Options& options, AioCompletion *c,
+    Log **logptr)
+{
+  if (name.length() == 0) {
+    std::cerr << "Invalid log name (empty string)" << std::endl;
+    return -EINVAL;
+  }
+
+  int ret = validate_options(options, seqr);
+  if (ret)
+    return ret;
+
+  LogImpl *impl = LogImpl::NewHandle(ioctx, name, seqr, options);
+  impl->AioOpenProjection(c, logptr);
+
+  return 0;
+}
+
+/*
+ * Creating first makes a missing log a single round trip. If the exclusive
+ * create fails with -EEXIST the log exists and nothing was written, so the
+ * handle opens it with a single read of the head, which also covers a
+ * concurrent creator without any retries.
+ */
+int Log::OpenOrCreate(librados::IoCtx& ioctx, const std::string& name,
+    SeqrClient *seqr, const Options& options, Log **logptr)
+{
+  if (name.length() == 0) {
+    std::cerr << "Invalid log name (empty string)" << std::endl;
+    return -EINVAL;
+  }
+
+  int ret = validate_options(options, seqr);
+  if (ret)
+    return ret;
+
+  StripeHistory hist;
+  ret = create_metalog(ioctx, name, options, &hist);
+  if (ret && ret != -EEXIST) {
+    std::cerr << "Failed to create log " << name << " ret "
+      << ret << " (" << strerror(-ret) << ")" << std::endl;
+    return ret;
+  }
+
+  LogImpl *impl = LogImpl::NewHandle(ioctx, name, seqr, options);
+
+  if (ret == 0)
+    ret = impl->PublishProjection(0, hist);
+  else
+    ret = impl->OpenProjection();
 
-  ret = impl->RefreshProjection();
   if (ret) {
     delete impl;
     return ret;
   }
 
+  impl->InitHandle();
+
   *logptr = impl;
 
   return 0;
 }
 
+LogImpl *LogImpl::NewHandle(librados::IoCtx& ioctx, const std::string& name,
+    SeqrClient *seqr, const Options& options)
+{
+  LogImpl *impl = new LogImpl;
+
+  impl->ioctx_ = &ioctx;
+  impl->pool_ = ioctx.get_pool_name();
+  impl->name_ = name;
+  impl->metalog_oid_ = metalog_oid_from_name(name);
+  impl->seqr = seqr;
+  impl->options_ = options;
+  impl->shared_ = GetSharedProjection(impl->pool_, name);
+
+  return impl;
+}
+
+void LogImpl::InitHandle()
+{
+  {
+    std::lock_guard<std::mutex> l(notify_lock_);
+    notified_epoch_ = std::max(notified_epoch_, GetProjection()->epoch);
+  }
+
+  WatchProjection();
+
+  if (options_.reservation_size > 0)
+    reservations_ = new ReservationPool(this,
+        options_.reservation_size, options_.reservation_low_water);
+
+  if (options_.append_window_entries > 0)
+    coalescer_ = new AppendCoalescer(this,
+        options_.append_window_entries, options_.append_window_us);
+
+  if (options_.entry_cache_size > 0)
+    cache_ = new EntryCache(options_.entry_cache_size);
+
+  if (options_.stripe_width_min > 0)
+    controller_ = new StripeWidthController(this, options_);
+}
+
 int LogImpl::SetStripeWidth(int width)
+{
+  return SetStripe(width, -1);
+}
+
+int LogImpl::SetStripe(int width, int block_size)
 {
   /*
    * Get the current projection. We'll add the new striping width when we
@@ -166,7 +376,7 @@ int LogImpl::SetStripeWidth(int width)
   assert(!hist.Empty());
 
   std::vector<std::string> objects;
-  mapper_.LatestObjectSet(objects, hist);
+  GetProjection()->mapper.LatestObjectSet(objects, hist);
 
   uint64_t max_position;
   ret = Seal(objects, epoch, &max_position);
@@ -176,14 +386,29 @@ int LogImpl::SetStripeWidth(int width)
   }
 
   uint64_t next_epoch = epoch + 1;
-  hist.AddStripe(max_position, next_epoch, width);
+  const StripeHistory::Stripe& latest = hist.LatestStripe();
+  StripeHistory::Mapping mapping = latest.mapping;
+  uint32_t stripe_block_size = latest.block_size;
+  if (block_size >= 0) {
+    mapping = block_size > 0 ? StripeHistory::MAPPING_BLOCK :
+      StripeHistory::MAPPING_ROUND_ROBIN;
+    stripe_block_size = block_size;
+  }
+
+  hist.AddStripe(max_position, next_epoch, width, mapping, stripe_block_size);
+  hist.SetMaxPosition(max_position);
   ceph::bufferlist out_bl = hist.Serialize();
 
+  StripeHistory delta;
+  delta.AddStripe(max_position, next_epoch, width, mapping, stripe_block_size);
+  delta.SetMaxPosition(max_position);
+
   /*
    * Propose the updated projection for the next epoch.
    */
   librados::ObjectWriteOperation set_op;
   cls_zlog_set_projection(set_op, next_epoch, out_bl);
+  SetProjectionDelta(set_op, next_epoch, delta);
   ret = ioctx_->operate(metalog_oid_, &set_op);
   if (ret) {
     std::cerr << "failed to set new epoch " << next_epoch
@@ -191,6 +416,8 @@ int LogImpl::SetStripeWidth(int width)
     return ret;
   }
 
+  NotifyProjection(next_epoch);
+
   return 0;
 }
 
@@ -224,7 +451,7 @@ int LogImpl::CreateCut(uint64_t *pepoch, uint64_t *maxpos)
   assert(!hist.Empty());
 
   std::vector<std::string> objects;
-  mapper_.LatestObjectSet(objects, hist);
+  GetProjection()->mapper.LatestObjectSet(objects, hist);
 
   uint64_t max_position;
   ret = Seal(objects, epoch, &max_position);
@@ -234,11 +461,19 @@ int LogImpl::CreateCut(uint64_t *pepoch, uint64_t *maxpos)
   }
 
   /*
-   * Propose the next epoch / projection.
+   * Propose the next epoch / projection. The projection is unchanged except
+   * for recording the max position sealed by this cut.
    */
+  hist.SetMaxPosition(max_position);
+  ceph::bufferlist out_bl = hist.Serialize();
+
+  StripeHistory delta;
+  delta.SetMaxPosition(max_position);
+
   uint64_t next_epoch = epoch + 1;
   librados::ObjectWriteOperation set_op;
-  cls_zlog_set_projection(set_op, next_epoch, bl);
+  cls_zlog_set_projection(set_op, next_epoch, out_bl);
+  SetProjectionDelta(set_op, next_epoch, delta);
   ret = ioctx_->operate(metalog_oid_, &set_op);
   if (ret) {
     std::cerr << "failed to set new epoch " << next_epoch
@@ -246,76 +481,181 @@ int LogImpl::CreateCut(uint64_t *pepoch, uint64_t *maxpos)
     return ret;
   }
 
+  NotifyProjection(next_epoch);
+
   *pepoch = next_epoch;
   *maxpos = max_position;
 
   return 0;
 }
 
+/*
+ * Submit an operation for each object with at most max_inflight of them
+ * outstanding, and return the first error. No new operations are submitted
+ * after an error, but those in flight are waited for.
+ */
+static int aio_for_each_object(const std::vector<std::string>& objects,
+    size_t max_inflight,
+    std::function<void(size_t, librados::AioCompletion*)> submit,
+    std::function<int(size_t, int)> complete)
+{
+  std::deque<std::pair<size_t, librados::AioCompletion*>> inflight;
+  int error = 0;
+
+  auto reap = [&]() {
+    auto op = inflight.front();
+    inflight.pop_front();
+    op.second->wait_for_complete();
+    int ret = complete(op.first, op.second->get_return_value());
+    op.second->release();
+    if (ret && !error)
+      error = ret;
+  };
+
+  for (size_t i = 0; i < objects.size() && !error; i++) {
+    if (inflight.size() >= max_inflight)
+      reap();
+    librados::AioCompletion *c =
+      librados::Rados::aio_create_completion(NULL, NULL, NULL);
+    submit(i, c);
+    inflight.push_back(std::make_pair(i, c));
+  }
+
+  while (!inflight.empty())
+    reap();
+
+  return error;
+}
+
+/*
+ * Sealing is a write and finding the max position is a read, so they can't
+ * be combined into one op per object. Instead each pass is fanned out
+ * across the objects concurrently.
+ */
 int LogImpl::Seal(const std::vector<std::string>& objects,
     uint64_t epoch, uint64_t *next_pos)
 {
+  assert(!objects.empty());
+
   /*
    * Seal each object
    */
-  for (const auto& oid : objects) {
-    librados::ObjectWriteOperation seal_op;
-    cls_zlog_seal(seal_op, epoch);
-    int ret = ioctx_->operate(oid, &seal_op);
-    if (ret != zlog::CLS_ZLOG_OK) {
-      std::cerr << "failed to seal object" << std::endl;
+  int ret = aio_for_each_object(objects, SEAL_MAX_INFLIGHT,
+    [&](size_t i, librados::AioCompletion *c) {
+      librados::ObjectWriteOperation seal_op;
+      cls_zlog_seal(seal_op, epoch);
+      int ret = ioctx_->aio_operate(objects[i], c, &seal_op);
+      assert(ret == 0);
+    },
+    [&](size_t i, int ret) {
+      if (ret != zlog::CLS_ZLOG_OK)
+        std::cerr << "failed to seal object" << std::endl;
       return ret;
-    }
-  }
+    });
+  if (ret)
+    return ret;
 
   /*
    * Get next position from each object
+   *
+   * The max_position function should only be called on objects that have
+   * been sealed, thus here we return from any error includes -ENOENT. The
+   * epoch tag must also match the sealed epoch in the object otherwise
+   * we'll receive -EINVAL.
    */
-  uint64_t max_position;
-  bool first = true;
-  for (const auto& oid : objects) {
-    /*
-     * Prepare max_position operation
-     */
-    int op_ret;
-    uint64_t this_pos;
-    librados::ObjectReadOperation op;
-    cls_zlog_max_position(op, epoch, &this_pos, &op_ret);
-
-    /*
-     * The max_position function should only be called on objects that have
-     * been sealed, thus here we return from any error includes -ENOENT. The
-     * epoch tag must also match the sealed epoch in the object otherwise
-     * we'll receive -EINVAL.
-     */
-    ceph::bufferlist unused;
-    int ret = ioctx_->operate(oid, &op, &unused);
-    if (ret != zlog::CLS_ZLOG_OK) {
-      std::cerr << "failed to find max pos ret " << ret << std::endl;
-      return ret;
-    }
+  std::vector<uint64_t> positions(objects.size());
+  std::vector<int> op_rets(objects.size());
+  std::vector<ceph::bufferlist> unused(objects.size());
+
+  ret = aio_for_each_object(objects, SEAL_MAX_INFLIGHT,
+    [&](size_t i, librados::AioCompletion *c) {
+      librados::ObjectReadOperation op;
+      cls_zlog_max_position(op, epoch, &positions[i], &op_rets[i]);
+      int ret = ioctx_->aio_operate(objects[i], c, &op, &unused[i]);
+      assert(ret == 0);
+    },
+    [&](size_t i, int ret) {
+      if (ret != zlog::CLS_ZLOG_OK) {
+        std::cerr << "failed to find max pos ret " << ret << std::endl;
+        return ret;
+      }
+      if (op_rets[i] != zlog::CLS_ZLOG_OK) {
+        std::cerr << "failed to find max pos op_ret " << op_rets[i] << std::endl;
+        return op_rets[i];
+      }
+      return 0;
+    });
+  if (ret)
+    return ret;
 
-    if (op_ret != zlog::CLS_ZLOG_OK) {
-      std::cerr << "failed to find max pos op_ret " << ret << std::endl;
-      return ret;
-    }
+  *next_pos = *std::max_element(positions.begin(), positions.end());
 
-    if (first) {
-      max_position = this_pos;
-      first = false;
-      continue;
-    }
+  return 0;
+}
 
-    max_position = std::max(max_position, this_pos);
+int LogImpl::RefreshProjection()
+{
+  return RefreshProjection(GetProjection()->epoch);
+}
+
+/*
+ * A refresh that was already running when the caller found its epoch to be
+ * stale may have read the metalog before the new projection was installed,
+ * so it is waited out rather than joined. Only a refresh started after the
+ * call is joined (or run by the caller). Nothing is read when the shared
+ * projection is already newer than the stale epoch.
+ */
+int LogImpl::RefreshProjection(uint64_t epoch)
+{
+  {
+    std::unique_lock<std::mutex> l(shared_->lock);
+    const uint64_t first = shared_->refresh_started + 1;
+    for (;;) {
+      std::shared_ptr<const Projection> cur = GetProjection();
+      if (cur && cur->epoch > epoch)
+        return 0;
+      if (!shared_->refreshing)
+        break;
+      const uint64_t id = shared_->refresh_started;
+      shared_->cond.wait(l, [&]{ return shared_->refresh_gen >= id; });
+      if (id >= first)
+        return shared_->refresh_result;
+    }
+    shared_->refreshing = true;
+    shared_->refresh_started++;
   }
 
-  *next_pos = max_position;
+  int ret = ReadProjection();
+  FinishRefresh(ret);
 
-  return 0;
+  return ret;
 }
 
-int LogImpl::RefreshProjection()
+void LogImpl::FinishRefresh(int ret)
+{
+  std::vector<std::function<void(int)>> waiters;
+  {
+    std::lock_guard<std::mutex> l(shared_->lock);
+    shared_->refreshing = false;
+    shared_->refresh_gen++;
+    shared_->refresh_result = ret;
+    waiters.swap(shared_->waiters);
+  }
+  shared_->cond.notify_all();
+
+  for (const auto& waiter : waiters)
+    waiter(ret);
+}
+
+int LogImpl::ReadProjection()
 {
+  std::shared_ptr<const Projection> cur = GetProjection();
+  if (cur) {
+    int ret = ReadProjectionDeltas(cur);
+    if (ret != -ENOENT)
+      return ret;
+  }
+
   for (;;) {
     int rv;
     uint64_t epoch;
@@ -328,38 +668,315 @@ int LogImpl::RefreshProjection()
     if (ret || rv) {
       std::cerr << "failed to get projection ret "
         << ret << " rv " << rv << std::endl;
-      sleep(1);
+      WaitForProjection();
       continue;
     }
 
-    StripeHistory hist;
-    ret = hist.Deserialize(bl);
+    return ApplyProjection(epoch, bl);
+  }
+}
+
+/*
+ * The existence check and the projection read are a single compound op.
+ */
+int LogImpl::OpenProjection()
+{
+  int rv;
+  uint64_t epoch;
+  ceph::bufferlist bl;
+  librados::ObjectReadOperation op;
+  op.assert_exists();
+  cls_zlog_get_latest_projection(op, &rv, &epoch, &bl);
+
+  ceph::bufferlist unused;
+  int ret = ioctx_->operate(metalog_oid_, &op, &unused);
+  if (ret || rv) {
+    if (ret != -ENOENT)
+      std::cerr << "Failed to open log meta object " << metalog_oid_
+        << " ret " << ret << " rv " << rv << std::endl;
+    return ret ? ret : rv;
+  }
+
+  return ApplyProjection(epoch, bl);
+}
+
+int LogImpl::WatchProjection()
+{
+  watch_c_ = librados::Rados::aio_create_completion();
+  assert(watch_c_);
+
+  int ret = ioctx_->aio_watch(metalog_oid_, watch_c_, &watch_handle_,
+      &watcher_);
+  if (ret) {
+    std::cerr << "failed to watch projection ret " << ret << std::endl;
+    watch_c_->release();
+    watch_c_ = NULL;
+    return ret;
+  }
+  return 0;
+}
+
+/*
+ * A notification that times out (e.g. because a watcher went away without
+ * unwatching) isn't an error: clients that miss it fall back to polling.
+ */
+void LogImpl::NotifyProjection(uint64_t epoch)
+{
+  zlog_proto::MProjectionNotify msg;
+  msg.set_epoch(epoch);
+
+  ceph::bufferlist bl;
+  pack_msg<zlog_proto::MProjectionNotify>(bl, msg);
+
+  int ret = ioctx_->notify2(metalog_oid_, bl, 5000, NULL);
+  if (ret)
+    std::cerr << "failed to notify projection e" << epoch
+      << " ret " << ret << std::endl;
+}
+
+void LogImpl::WaitForProjection(uint64_t epoch)
+{
+  std::unique_lock<std::mutex> l(notify_lock_);
+  notify_cond_.wait_for(l, std::chrono::seconds(1), [&]{
+    return notified_epoch_ > epoch || GetProjection()->epoch > epoch;
+  });
+}
+
+void LogImpl::WaitForProjection()
+{
+  uint64_t epoch;
+  {
+    std::lock_guard<std::mutex> l(notify_lock_);
+    epoch = notified_epoch_;
+  }
+  WaitForProjection(epoch);
+}
+
+void LogImpl::AioWaitForProjection(uint64_t epoch, int timeout_ms,
+    std::function<void()> callback)
+{
+  {
+    std::lock_guard<std::mutex> l(notify_lock_);
+    if (notified_epoch_ <= epoch && GetProjection()->epoch <= epoch) {
+      ProjectionWaiter waiter;
+      waiter.epoch = epoch;
+      waiter.deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(timeout_ms);
+      waiter.callback = callback;
+      waiters_.push_back(waiter);
+      if (!waiters_thread_.joinable())
+        waiters_thread_ = std::thread(&LogImpl::RunProjectionWaiters, this);
+      notify_cond_.notify_all();
+      return;
+    }
+  }
+  callback();
+}
+
+/*
+ * Runs the asynchronous waiters whose projection has been announced or
+ * whose wait has timed out. Waiters left when the handle is destroyed are
+ * run rather than dropped so that their operations still complete.
+ */
+void LogImpl::RunProjectionWaiters()
+{
+  std::unique_lock<std::mutex> l(notify_lock_);
+
+  for (;;) {
+    auto now = std::chrono::steady_clock::now();
+    auto next = now + std::chrono::seconds(1);
+    std::vector<std::function<void()>> ready;
+    for (auto it = waiters_.begin(); it != waiters_.end();) {
+      if (waiters_stop_ || notified_epoch_ > it->epoch ||
+          GetProjection()->epoch > it->epoch || it->deadline <= now) {
+        ready.push_back(it->callback);
+        it = waiters_.erase(it);
+      } else {
+        next = std::min(next, it->deadline);
+        it++;
+      }
+    }
+
+    if (!ready.empty()) {
+      l.unlock();
+      for (const auto& callback : ready)
+        callback();
+      l.lock();
+      continue;
+    }
+
+    if (waiters_stop_)
+      break;
+
+    notify_cond_.wait_until(l, next);
+  }
+}
+
+void ProjectionWatcher::handle_notify(uint64_t notify_id, uint64_t cookie,
+    uint64_t notifier_id, ceph::bufferlist& bl)
+{
+  zlog_proto::MProjectionNotify msg;
+  if (unpack_msg<zlog_proto::MProjectionNotify>(msg, bl)) {
+    std::lock_guard<std::mutex> l(log_->notify_lock_);
+    log_->notified_epoch_ = std::max(log_->notified_epoch_, msg.epoch());
+  }
+  log_->notify_cond_.notify_all();
+
+  ceph::bufferlist reply;
+  log_->ioctx_->notify_ack(log_->metalog_oid_, notify_id, cookie, reply);
+}
+
+/*
+ * Waiters fall back to polling while the watch is broken.
+ */
+void ProjectionWatcher::handle_error(uint64_t cookie, int err)
+{
+  std::cerr << "projection watch error " << err << std::endl;
+  log_->notify_cond_.notify_all();
+}
+
+/*
+ * Each projection change also records what changed (new stripes and the max
+ * position of the cut) as an omap entry on the metalog object keyed by the
+ * new epoch. The entry is written in the same op that installs the
+ * projection so the two can't diverge. A client that already has a
+ * projection catches up by reading the entries after its own epoch rather
+ * than the full projection, whose size grows with every stripe change.
+ */
+std::string LogImpl::projection_delta_key(uint64_t epoch)
+{
+  std::stringstream key;
+  key << PROJECTION_DELTA_PREFIX << std::setw(20) << std::setfill('0')
+    << epoch;
+  return key.str();
+}
+
+void LogImpl::SetProjectionDelta(librados::ObjectWriteOperation& op,
+    uint64_t epoch, const StripeHistory& delta)
+{
+  std::map<std::string, ceph::bufferlist> vals;
+  vals[projection_delta_key(epoch)] = delta.Serialize();
+  op.omap_set(vals);
+
+  /*
+   * A client more than PROJECTION_DELTA_MAX epochs behind reads the full
+   * projection, so older deltas are never used. Each epoch drops the delta
+   * that falls out of the window.
+   */
+  if (epoch > PROJECTION_DELTA_MAX) {
+    std::set<std::string> keys;
+    keys.insert(projection_delta_key(epoch - PROJECTION_DELTA_MAX));
+    op.omap_rm_keys(keys);
+  }
+}
+
+int LogImpl::ReadProjectionDeltas(std::shared_ptr<const Projection> cur)
+{
+  int rv;
+  std::map<std::string, ceph::bufferlist> deltas;
+  librados::ObjectReadOperation op;
+  op.omap_get_vals(projection_delta_key(cur->epoch), PROJECTION_DELTA_PREFIX,
+      PROJECTION_DELTA_MAX, &deltas, &rv);
+
+  ceph::bufferlist unused;
+  int ret = ioctx_->operate(metalog_oid_, &op, &unused);
+  if (ret || rv)
+    return -ENOENT;
+
+  return ApplyProjectionDeltas(cur, deltas);
+}
+
+/*
+ * Returns -ENOENT when the deltas can't bring the projection up to date
+ * (none found, too many, or a gap left by a writer that didn't record a
+ * delta) and the full projection should be read instead.
+ */
+int LogImpl::ApplyProjectionDeltas(std::shared_ptr<const Projection> cur,
+    std::map<std::string, ceph::bufferlist>& deltas)
+{
+  if (deltas.empty() || deltas.size() >= PROJECTION_DELTA_MAX)
+    return -ENOENT;
+
+  StripeHistory hist = cur->mapper.History();
+  uint64_t epoch = cur->epoch;
+
+  for (auto& delta : deltas) {
+    if (delta.first != projection_delta_key(epoch + 1))
+      return -ENOENT;
+    StripeHistory change;
+    int ret = change.Deserialize(delta.second);
     if (ret)
-      return ret;
-    assert(!hist.Empty());
+      return -ENOENT;
+    ret = hist.ApplyDelta(change);
+    if (ret)
+      return -ENOENT;
+    epoch++;
+  }
+
+  return PublishProjection(epoch, hist);
+}
+
+int LogImpl::ApplyProjection(uint64_t epoch, ceph::bufferlist& bl)
+{
+  StripeHistory hist;
+  int ret = hist.Deserialize(bl);
+  if (ret)
+    return ret;
 
-    std::lock_guard<std::mutex> l(lock_);
+  return PublishProjection(epoch, hist);
+}
+
+int LogImpl::PublishProjection(uint64_t epoch, const StripeHistory& hist)
+{
+  assert(!hist.Empty());
 
-    epoch_ = epoch;
-    mapper_.SetHistory(hist);
+  std::shared_ptr<const Projection> proj =
+    std::make_shared<Projection>(epoch, name_, hist);
 
-    break;
+  /*
+   * An installed projection counts as announced, so waiting for the next
+   * announcement doesn't return on a notification for this epoch or an
+   * older one.
+   */
+  {
+    std::lock_guard<std::mutex> l(notify_lock_);
+    notified_epoch_ = std::max(notified_epoch_, epoch);
+  }
+
+  {
+    std::lock_guard<std::mutex> l(shared_->lock);
+    if (shared_->projection && epoch < shared_->projection->epoch)
+      return 0;
+    std::atomic_store(&shared_->projection, proj);
   }
 
+  // positions reserved in an old epoch are given up
+  if (reservations_)
+    reservations_->Notify();
+
   return 0;
 }
 
+bool LogImpl::PositionSealed(uint64_t position)
+{
+  return position <= GetProjection()->max_pos;
+}
+
 int LogImpl::CheckTail(uint64_t *pposition, bool increment)
 {
+  if (increment)
+    return combiner_.Next(pposition);
+
   for (;;) {
-    int ret = seqr->CheckTail(epoch_, pool_, name_, pposition, increment);
+    uint64_t epoch = GetProjection()->epoch;
+    int ret = seqr->CheckTail(epoch, pool_, name_, pposition, increment);
     if (ret == -EAGAIN) {
       //std::cerr << "check tail ret -EAGAIN" << std::endl;
-      sleep(1);
+      WaitForProjection();
       continue;
     } else if (ret == -ERANGE) {
       //std::cerr << "check tail ret -ERANGE" << std::endl;
-      ret = RefreshProjection();
+      ret = RefreshProjection(epoch);
       if (ret)
         return ret;
       continue;
@@ -376,25 +993,39 @@ int LogImpl::CheckTail(uint64_t *pposition)
 
 int LogImpl::CheckTail(std::vector<uint64_t>& positions, size_t count)
 {
-  if (count <= 0 || count > 100)
+  uint64_t start;
+  int ret = CheckTailRange(count, &start);
+  if (ret)
+    return ret;
+
+  std::vector<uint64_t> result;
+  result.reserve(count);
+  for (size_t i = 0; i < count; i++)
+    result.push_back(start + i);
+  positions.swap(result);
+
+  return 0;
+}
+
+int LogImpl::CheckTailRange(size_t count, uint64_t *pstart)
+{
+  if (count <= 0 || count > CHECK_TAIL_BATCH_MAX)
     return -EINVAL;
 
   for (;;) {
-    std::vector<uint64_t> result;
-    int ret = seqr->CheckTail(epoch_, pool_, name_, result, count);
+    uint64_t epoch = GetProjection()->epoch;
+    int ret = seqr->CheckTailRange(epoch, pool_, name_, count, pstart);
     if (ret == -EAGAIN) {
       //std::cerr << "check tail ret -EAGAIN" << std::endl;
-      sleep(1);
+      WaitForProjection();
       continue;
     } else if (ret == -ERANGE) {
       //std::cerr << "check tail ret -ERANGE" << std::endl;
-      ret = RefreshProjection();
+      ret = RefreshProjection(epoch);
       if (ret)
         return ret;
       continue;
     }
-    if (ret == 0)
-      positions.swap(result);
     return ret;
   }
   assert(0);
@@ -405,15 +1036,16 @@ int LogImpl::CheckTail(const std::set<uint64_t>& stream_ids,
     uint64_t *pposition, bool increment)
 {
   for (;;) {
-    int ret = seqr->CheckTail(epoch_, pool_, name_, stream_ids,
+    uint64_t epoch = GetProjection()->epoch;
+    int ret = seqr->CheckTail(epoch, pool_, name_, stream_ids,
         stream_backpointers, pposition, increment);
     if (ret == -EAGAIN) {
       //std::cerr << "check tail ret -EAGAIN" << std::endl;
-      sleep(1);
+      WaitForProjection();
       continue;
     } else if (ret == -ERANGE) {
       //std::cerr << "check tail ret -ERANGE" << std::endl;
-      ret = RefreshProjection();
+      ret = RefreshProjection(epoch);
       if (ret)
         return ret;
       continue;
@@ -423,17 +1055,22 @@ int LogImpl::CheckTail(const std::set<uint64_t>& stream_ids,
   assert(0);
 }
 
+int LogImpl::NextPosition(uint64_t *pposition)
+{
+  if (reservations_ && reservations_->Get(pposition))
+    return 0;
+  return CheckTail(pposition, true);
+}
+
 /*
  * TODO:
  *
  * 1. When a stale epoch is encountered the projection is refreshed and the
- * append is retried with a new tail position retrieved from the sequencer.
- * This means that a hole is created each time an append hits a stale epoch.
- * If there are a lot of clients, a large hole is created each time the
- * projection is refreshed. Is this necessary in all cases? When could a
- * client try again with the same position? We could also mitigate this affect
- * a bit by having the sequencer, upon startup, begin finding log tails
- * proactively instead of waiting for a client to perform a check tail.
+ * append is retried. The position is kept if it lies beyond the max position
+ * sealed by the cut, otherwise a new tail position is retrieved from the
+ * sequencer, leaving a hole. We could also mitigate this affect a bit by
+ * having the sequencer, upon startup, begin finding log tails proactively
+ * instead of waiting for a client to perform a check tail.
  *
  * 2. When a stale epoch return code occurs we continuously look for a new
  * projection and retry the append. to avoid just spinning and creating holes
@@ -442,48 +1079,82 @@ int LogImpl::CheckTail(const std::set<uint64_t>& stream_ids,
  */
 int LogImpl::Append(ceph::bufferlist& data, uint64_t *pposition)
 {
+  uint64_t position;
+  bool reuse_position = false;
+
   for (;;) {
-    uint64_t position;
-    int ret = CheckTail(&position, true);
-    if (ret)
-      return ret;
+    int ret;
+    if (!reuse_position) {
+      ret = NextPosition(&position);
+      if (ret)
+        return ret;
+    }
+
+    std::shared_ptr<const Projection> proj = GetProjection();
+    uint64_t epoch = proj->epoch;
 
     librados::ObjectWriteOperation op;
-    zlog::cls_zlog_write(op, epoch_, position, data);
+    zlog::cls_zlog_write(op, epoch, position, data);
 
-    std::string oid = mapper_.FindObject(position);
+    const std::string& oid = proj->mapper.FindObject(position);
+    auto start = ObjectOpStart(oid);
     ret = ioctx_->operate(oid, &op);
+    ObjectOpFinish(oid, start);
     if (ret < 0) {
       std::cerr << "append: failed ret " << ret << std::endl;
       return ret;
     }
 
     if (ret == zlog::CLS_ZLOG_OK) {
+      CacheAppend(position, data);
       if (pposition)
         *pposition = position;
       return 0;
     }
 
     if (ret == zlog::CLS_ZLOG_STALE_EPOCH) {
-      sleep(1); // avoid spinning in this loop
-      ret = RefreshProjection();
+      /*
+       * The objects are sealed before the new projection is installed, so
+       * wait for it to be announced rather than spinning.
+       */
+      WaitForProjection(epoch);
+      ret = RefreshProjection(epoch);
       if (ret)
         return ret;
+      reuse_position = !PositionSealed(position);
       continue;
     }
 
     assert(ret == zlog::CLS_ZLOG_READ_ONLY);
+    reuse_position = false;
   }
   assert(0);
 }
 
+int LogImpl::AppendBatch(std::vector<ceph::bufferlist>& data,
+    std::vector<uint64_t> *pposition)
+{
+  zlog::AioCompletion *c = Log::aio_create_completion();
+
+  int ret = AioAppendBatch(c, data, pposition);
+  if (ret == 0) {
+    c->WaitForComplete();
+    ret = c->ReturnValue();
+  }
+
+  delete c;
+
+  return ret;
+}
+
 int LogImpl::Fill(uint64_t epoch, uint64_t position)
 {
   for (;;) {
     librados::ObjectWriteOperation op;
     zlog::cls_zlog_fill(op, epoch, position);
 
-    std::string oid = mapper_.FindObject(position);
+    std::shared_ptr<const Projection> proj = GetProjection();
+    const std::string& oid = proj->mapper.FindObject(position);
     int ret = ioctx_->operate(oid, &op);
     if (ret < 0) {
       std::cerr << "fill: failed ret " << ret << std::endl;
@@ -509,9 +1180,10 @@ int LogImpl::Fill(uint64_t position)
 {
   for (;;) {
     librados::ObjectWriteOperation op;
-    zlog::cls_zlog_fill(op, epoch_, position);
+    std::shared_ptr<const Projection> proj = GetProjection();
+    zlog::cls_zlog_fill(op, proj->epoch, position);
 
-    std::string oid = mapper_.FindObject(position);
+    const std::string& oid = proj->mapper.FindObject(position);
     int ret = ioctx_->operate(oid, &op);
     if (ret < 0) {
       std::cerr << "fill: failed ret " << ret << std::endl;
@@ -522,7 +1194,7 @@ int LogImpl::Fill(uint64_t position)
       return 0;
 
     if (ret == zlog::CLS_ZLOG_STALE_EPOCH) {
-      ret = RefreshProjection();
+      ret = RefreshProjection(proj->epoch);
       if (ret)
         return ret;
       continue;
@@ -537,20 +1209,24 @@ int LogImpl::Trim(uint64_t position)
 {
   for (;;) {
     librados::ObjectWriteOperation op;
-    zlog::cls_zlog_trim(op, epoch_, position);
+    std::shared_ptr<const Projection> proj = GetProjection();
+    zlog::cls_zlog_trim(op, proj->epoch, position);
 
-    std::string oid = mapper_.FindObject(position);
+    const std::string& oid = proj->mapper.FindObject(position);
     int ret = ioctx_->operate(oid, &op);
     if (ret < 0) {
       std::cerr << "trim: failed ret " << ret << std::endl;
       return ret;
     }
 
-    if (ret == zlog::CLS_ZLOG_OK)
+    if (ret == zlog::CLS_ZLOG_OK) {
+      if (cache_)
+        cache_->Erase(position);
       return 0;
+    }
 
     if (ret == zlog::CLS_ZLOG_STALE_EPOCH) {
-      ret = RefreshProjection();
+      ret = RefreshProjection(proj->epoch);
       if (ret)
         return ret;
       continue;
@@ -560,22 +1236,69 @@ int LogImpl::Trim(uint64_t position)
   }
 }
 
+bool LogImpl::CacheGet(uint64_t position, ceph::bufferlist& bl)
+{
+  return cache_ && cache_->Get(position, bl);
+}
+
+void LogImpl::CachePut(uint64_t position, const ceph::bufferlist& bl)
+{
+  if (cache_)
+    cache_->Put(position, bl);
+}
+
+void LogImpl::CacheAppend(uint64_t position, const ceph::bufferlist& bl)
+{
+  if (cache_ && options_.entry_cache_write_through)
+    cache_->Put(position, bl);
+}
+
+void LogImpl::CacheStats(uint64_t *phits, uint64_t *pmisses)
+{
+  *phits = cache_ ? cache_->Hits() : 0;
+  *pmisses = cache_ ? cache_->Misses() : 0;
+}
+
+std::chrono::steady_clock::time_point LogImpl::ObjectOpStart(
+    const std::string& oid)
+{
+  if (!controller_)
+    return std::chrono::steady_clock::time_point();
+  controller_->OpStart(oid);
+  return std::chrono::steady_clock::now();
+}
+
+void LogImpl::ObjectOpFinish(const std::string& oid,
+    std::chrono::steady_clock::time_point start)
+{
+  if (!controller_)
+    return;
+  auto latency = std::chrono::steady_clock::now() - start;
+  controller_->OpFinish(oid,
+      std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+}
+
 int LogImpl::Read(uint64_t epoch, uint64_t position, ceph::bufferlist& bl)
 {
+  if (CacheGet(position, bl))
+    return 0;
+
   for (;;) {
     librados::ObjectReadOperation op;
     zlog::cls_zlog_read(op, epoch, position);
 
-    std::string oid = mapper_.FindObject(position);
+    std::shared_ptr<const Projection> proj = GetProjection();
+    const std::string& oid = proj->mapper.FindObject(position);
     int ret = ioctx_->operate(oid, &op, &bl);
     if (ret < 0) {
       std::cerr << "read failed ret " << ret << std::endl;
       return ret;
     }
 
-    if (ret == zlog::CLS_ZLOG_OK)
+    if (ret == zlog::CLS_ZLOG_OK) {
+      CachePut(position, bl);
       return 0;
-    else if (ret == zlog::CLS_ZLOG_NOT_WRITTEN)
+    } else if (ret == zlog::CLS_ZLOG_NOT_WRITTEN)
       return -ENODEV;
     else if (ret == zlog::CLS_ZLOG_INVALIDATED)
       return -EFAULT;
@@ -594,25 +1317,30 @@ int LogImpl::Read(uint64_t epoch, uint64_t position, ceph::bufferlist& bl)
 
 int LogImpl::Read(uint64_t position, ceph::bufferlist& bl)
 {
+  if (CacheGet(position, bl))
+    return 0;
+
   for (;;) {
     librados::ObjectReadOperation op;
-    zlog::cls_zlog_read(op, epoch_, position);
+    std::shared_ptr<const Projection> proj = GetProjection();
+    zlog::cls_zlog_read(op, proj->epoch, position);
 
-    std::string oid = mapper_.FindObject(position);
+    const std::string& oid = proj->mapper.FindObject(position);
     int ret = ioctx_->operate(oid, &op, &bl);
     if (ret < 0) {
       std::cerr << "read failed ret " << ret << std::endl;
       return ret;
     }
 
-    if (ret == zlog::CLS_ZLOG_OK)
+    if (ret == zlog::CLS_ZLOG_OK) {
+      CachePut(position, bl);
       return 0;
-    else if (ret == zlog::CLS_ZLOG_NOT_WRITTEN)
+    } else if (ret == zlog::CLS_ZLOG_NOT_WRITTEN)
       return -ENODEV;
     else if (ret == zlog::CLS_ZLOG_INVALIDATED)
       return -EFAULT;
     else if (ret == zlog::CLS_ZLOG_STALE_EPOCH) {
-      ret = RefreshProjection();
+      ret = RefreshProjection(proj->epoch);
       if (ret)
         return ret;
       continue;
@@ -624,6 +1352,104 @@ int LogImpl::Read(uint64_t position, ceph::bufferlist& bl)
   assert(0);
 }
 
+/*
+ * Each position is read with its own cls_zlog read, with at most
+ * READ_MANY_WINDOW reads outstanding. The reads are ordered by the stripe
+ * object that they map to, so those for one object are issued back to
+ * back. Reads that hit a stale epoch are retried with the refreshed
+ * projection.
+ */
+int LogImpl::ReadMany(const std::vector<uint64_t>& positions,
+    std::vector<ceph::bufferlist>& bls, std::vector<int>& results)
+{
+  std::vector<ceph::bufferlist> out_bls(positions.size());
+  std::vector<int> out_results(positions.size(), 0);
+
+  std::vector<size_t> todo;
+  for (size_t i = 0; i < positions.size(); i++) {
+    if (!CacheGet(positions[i], out_bls[i]))
+      todo.push_back(i);
+  }
+
+  while (!todo.empty()) {
+    std::shared_ptr<const Projection> proj = GetProjection();
+
+    std::map<std::string, std::vector<size_t>> groups;
+    for (const auto i : todo)
+      groups[proj->mapper.FindObject(positions[i])].push_back(i);
+
+    std::vector<std::string> oids;
+    std::vector<size_t> reads;
+    for (const auto& group : groups) {
+      for (const auto i : group.second) {
+        oids.push_back(group.first);
+        reads.push_back(i);
+      }
+    }
+
+    std::vector<int> rvals(positions.size(), 0);
+
+    aio_for_each_object(oids, READ_MANY_WINDOW,
+      [&](size_t k, librados::AioCompletion *c) {
+        const size_t i = reads[k];
+        librados::ObjectReadOperation op;
+        cls_zlog_read(op, proj->epoch, positions[i]);
+        int ret = ioctx_->aio_operate(oids[k], c, &op, &out_bls[i]);
+        assert(ret == 0);
+      },
+      [&](size_t k, int ret) {
+        rvals[reads[k]] = ret;
+        return 0;
+      });
+
+    std::vector<size_t> stale;
+    for (const auto i : todo) {
+      int ret = rvals[i];
+      if (ret == zlog::CLS_ZLOG_OK) {
+        CachePut(positions[i], out_bls[i]);
+        out_results[i] = 0;
+      } else if (ret == zlog::CLS_ZLOG_NOT_WRITTEN)
+        out_results[i] = -ENODEV;
+      else if (ret == zlog::CLS_ZLOG_INVALIDATED)
+        out_results[i] = -EFAULT;
+      else if (ret == zlog::CLS_ZLOG_STALE_EPOCH) {
+        out_bls[i].clear();
+        stale.push_back(i);
+      } else if (ret < 0) {
+        std::cerr << "read failed ret " << ret << std::endl;
+        out_results[i] = ret;
+      } else {
+        std::cerr << "unknown reply";
+        assert(0);
+      }
+    }
+
+    if (!stale.empty()) {
+      int ret = RefreshProjection(proj->epoch);
+      if (ret) {
+        for (const auto i : stale)
+          out_results[i] = ret;
+        stale.clear();
+      }
+    }
+
+    todo.swap(stale);
+  }
+
+  int ret = 0;
+  for (const auto result : out_results) {
+    if (result && result != -ENODEV && result != -EFAULT) {
+      ret = result;
+      break;
+    }
+  }
+
+  bls.swap(out_bls);
+  results.swap(out_results);
+
+  return ret;
+}
+
 extern "C" int zlog_destroy(zlog_log_t log)
 {
   zlog_log_ctx *ctx = (zlog_log_ctx*)log;
@@ -1,16 +1,84 @@
 #ifndef LIBZLOG_INTERNAL_HPP
 #define LIBZLOG_INTERNAL_HPP
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <rados/librados.h>
+#include <rados/librados.hpp>
 #include "include/zlog/log.h"
 #include "libseq/libseqr.h"
+#include "append_coalescer.h"
+#include "entry_cache.h"
 #include "log_mapper.h"
+#include "projection.h"
+#include "reservation_pool.h"
+#include "stripe_controller.h"
+#include "tail_combiner.h"
+
+/*
+ * Maximum number of positions that can be reserved from the sequencer in a
+ * single batched tail request. Every batch is requested as a range, so this
+ * is the sequencer's range limit and not SEQR_MAX_LIST_BATCH.
+ */
+#define CHECK_TAIL_BATCH_MAX SEQR_MAX_BATCH
+
+/*
+ * Maximum number of reads ReadMany keeps outstanding
+ */
+#define READ_MANY_WINDOW 128
+#define SEAL_MAX_INFLIGHT 32
+#define PROJECTION_DELTA_PREFIX "zlog.projection_delta."
+#define PROJECTION_DELTA_MAX 64
+
+/*
+ * Bounds on how long an asynchronous operation that hit a stale epoch waits
+ * for the new projection to be announced before reading it anyway. The wait
+ * doubles each time the projection read turns out to be no newer.
+ */
+#define AIO_RETRY_MIN_MS 10
+#define AIO_RETRY_MAX_MS 1000
 
 namespace zlog {
 
+class LogImpl;
+
+/*
+ * Watches the metalog object for notifications that a new projection has
+ * been installed.
+ */
+class ProjectionWatcher : public librados::WatchCtx2 {
+ public:
+  explicit ProjectionWatcher(LogImpl *log) :
+    log_(log)
+  {}
+
+  void handle_notify(uint64_t notify_id, uint64_t cookie,
+      uint64_t notifier_id, ceph::bufferlist& bl);
+  void handle_error(uint64_t cookie, int err);
+
+ private:
+  LogImpl *log_;
+};
+
 class LogImpl : public Log {
  public:
-  LogImpl() {}
+  LogImpl() :
+    reservations_(NULL),
+    coalescer_(NULL),
+    cache_(NULL),
+    controller_(NULL),
+    watcher_(this),
+    watch_c_(NULL),
+    notified_epoch_(0),
+    waiters_stop_(false),
+    combiner_(this)
+  {}
+
+  ~LogImpl();
 
   /*
    * Create cut.
@@ -18,12 +86,20 @@ class LogImpl : public Log {
   int CreateCut(uint64_t *pepoch, uint64_t *maxpos);
 
   /*
-   * Set log stripe width
+   * Set log stripe width, keeping the current mapping.
    */
   int SetStripeWidth(int width);
 
   /*
-   * Find and optionally increment the current tail position.
+   * Set log stripe width and mapping. A block size of zero selects round
+   * robin mapping, otherwise block striping with the given block size is
+   * used. A negative block size keeps the current mapping.
+   */
+  int SetStripe(int width, int block_size);
+
+  /*
+   * Find and optionally increment the current tail position. Concurrent
+   * increments through the same handle are combined into batch requests.
    */
   int CheckTail(uint64_t *pposition, bool increment);
   int CheckTail(uint64_t *pposition);
@@ -33,13 +109,60 @@ class LogImpl : public Log {
    */
   int CheckTail(std::vector<uint64_t>& positions, size_t count);
 
+  /*
+   * Reserve a batch of count consecutive positions starting at *pstart.
+   */
+  int CheckTailRange(size_t count, uint64_t *pstart);
+
+  /*
+   * Return a new position for an append. The position is taken from the
+   * local reservation pool when it is enabled, and otherwise from the
+   * sequencer.
+   */
+  int NextPosition(uint64_t *pposition);
+
+  /*
+   * Asynchronous version of NextPosition. The callback may run in the
+   * calling thread (reservation pool hit), on the sequencer client thread,
+   * or on a rados callback thread, and must not block. Appends that go
+   * through the append coalescer don't use it.
+   */
+  void AioNextPosition(std::function<void(int, uint64_t)> callback);
+
+  /*
+   * Asynchronously reserve count consecutive positions, up to
+   * CHECK_TAIL_BATCH_MAX, from the sequencer. The callback receives the
+   * first one and must not block.
+   */
+  void AioNextRange(size_t count, std::function<void(int, uint64_t)> callback);
+
+  /*
+   * Fill a position in the background, e.g. one that was reserved but
+   * couldn't be written. Failures are only logged.
+   */
+  void AioFill(uint64_t position);
+
   /*
    * Append data to the log and return its position.
    */
   int Append(ceph::bufferlist& data, uint64_t *pposition = NULL);
 
+  /*
+   * Append a batch of entries to the log and return their positions. All of
+   * the positions are reserved together and the entries are written
+   * concurrently.
+   */
+  int AppendBatch(std::vector<ceph::bufferlist>& data,
+      std::vector<uint64_t> *pposition = NULL);
+
   int OpenStream(uint64_t stream_id, zlog::Stream **streamptr);
 
+  /*
+   * Read a range of positions with a window of reads in flight.
+   */
+  int Scan(uint64_t start, uint64_t end, zlog::Scanner **scannerptr,
+      size_t window = 64);
+
   /*
    * Append data to multiple streams and return its position.
    */
@@ -52,6 +175,14 @@ class LogImpl : public Log {
   int AioAppend(zlog::AioCompletion *c, ceph::bufferlist& data,
       uint64_t *pposition = NULL);
 
+  /*
+   * Append a batch of entries asynchronously to the log and return their
+   * positions.
+   */
+  int AioAppendBatch(zlog::AioCompletion *c,
+      std::vector<ceph::bufferlist>& data,
+      std::vector<uint64_t> *pposition = NULL);
+
   /*
    * Read data asynchronously from the log.
    */
@@ -68,6 +199,13 @@ class LogImpl : public Log {
    */
   int Read(uint64_t position, ceph::bufferlist& bl);
 
+  /*
+   * Read a set of positions. The status of each position is returned in
+   * results (0, -ENODEV or -EFAULT, as for Read).
+   */
+  int ReadMany(const std::vector<uint64_t>& positions,
+      std::vector<ceph::bufferlist>& bls, std::vector<int>& results);
+
   /*
    *
    */
@@ -80,16 +218,137 @@ class LogImpl : public Log {
   int StreamMembership(uint64_t epoch, std::set<uint64_t>& stream_ids, uint64_t position);
   int Fill(uint64_t epoch, uint64_t position);
 
+  void CacheStats(uint64_t *phits, uint64_t *pmisses);
+
+  /*
+   * Entry cache helpers. They are no-ops when the cache is disabled, and
+   * CacheAppend only caches when write-through is enabled.
+   */
+  bool CacheGet(uint64_t position, ceph::bufferlist& bl);
+  void CachePut(uint64_t position, const ceph::bufferlist& bl);
+  void CacheAppend(uint64_t position, const ceph::bufferlist& bl);
+
+  /*
+   * Stripe width controller instrumentation for a write to a stripe object.
+   * No-ops when the controller is disabled.
+   */
+  std::chrono::steady_clock::time_point ObjectOpStart(const std::string& oid);
+  void ObjectOpFinish(const std::string& oid,
+      std::chrono::steady_clock::time_point start);
+
   // Seal an epoch across a set of objects and return the next position.
   int Seal(const std::vector<std::string>& objects,
       uint64_t epoch, uint64_t *next_pos);
 
   static std::string metalog_oid_from_name(const std::string& name);
 
+  /*
+   * Allocate a handle for a log. The caller installs the first projection
+   * and then calls InitHandle to start the optional components.
+   */
+  static LogImpl *NewHandle(librados::IoCtx& ioctx, const std::string& name,
+      SeqrClient *seqr, const Options& options);
+  void InitHandle();
+
+  /*
+   * Read the projection of an existing log in a single round trip. Unlike
+   * RefreshProjection this fails with -ENOENT if the log doesn't exist.
+   */
+  int OpenProjection();
+  void AioOpenProjection(AioCompletion *c, Log **logptr);
+
   LogImpl(const LogImpl& rhs);
   LogImpl& operator=(const LogImpl& rhs);
 
+  /*
+   * Refresh the projection after an operation found that epoch to be stale.
+   * Returns immediately if the projection is already newer, and otherwise
+   * shares a refresh with other handles on the same log, as long as that
+   * refresh started after the call. Without an epoch the projection is
+   * refreshed even if it is current.
+   */
+  int RefreshProjection(uint64_t epoch);
   int RefreshProjection();
+  int ReadProjection();
+  void FinishRefresh(int ret);
+
+  /*
+   * Register a watch on the metalog object. Without a watch, waiting for a
+   * new projection falls back to polling. The watch is registered in the
+   * background so that opening a log doesn't wait for it.
+   */
+  int WatchProjection();
+
+  /*
+   * Tell watchers that a new projection has been installed.
+   */
+  void NotifyProjection(uint64_t epoch);
+
+  /*
+   * Wait until a projection newer than the given epoch has been announced
+   * (or, without an epoch, until the next announcement). Waits for at most
+   * one second if no notification arrives.
+   */
+  void WaitForProjection(uint64_t epoch);
+  void WaitForProjection();
+
+  /*
+   * Asynchronous version of WaitForProjection(epoch) that waits for at most
+   * timeout_ms. The callback runs in the calling thread if a newer
+   * projection is already known, and otherwise on the watch or the
+   * projection waiter thread. It must not block.
+   */
+  void AioWaitForProjection(uint64_t epoch, int timeout_ms,
+      std::function<void()> callback);
+  void RunProjectionWaiters();
+
+  /*
+   * Asynchronous version of RefreshProjection(epoch). The callback runs in
+   * the calling thread if the projection is already newer, and otherwise
+   * on a rados callback thread.
+   */
+  void AioRefreshProjectionOnce(uint64_t epoch,
+      std::function<void(int)> callback);
+  void AioRefreshProjectionOnce(uint64_t epoch, uint64_t first,
+      std::function<void(int)> callback);
+
+  /*
+   * Refresh the projection without blocking until it is newer than epoch,
+   * which an operation found to be stale. Each attempt first waits for a new
+   * projection to be announced, backing off between AIO_RETRY_MIN_MS and
+   * AIO_RETRY_MAX_MS, so that retries don't spin while a cut is in progress.
+   */
+  void AioRefreshProjection(uint64_t epoch, std::function<void(int)> callback);
+  void AioRefreshProjection(uint64_t epoch, int backoff_ms,
+      std::function<void(int)> callback);
+
+  /*
+   * Install a projection read from the metalog. Older projections than the
+   * current one are ignored.
+   */
+  int ApplyProjection(uint64_t epoch, ceph::bufferlist& bl);
+  int PublishProjection(uint64_t epoch, const StripeHistory& hist);
+
+  /*
+   * Incremental projection updates
+   */
+  static std::string projection_delta_key(uint64_t epoch);
+  void SetProjectionDelta(librados::ObjectWriteOperation& op,
+      uint64_t epoch, const StripeHistory& delta);
+  int ReadProjectionDeltas(std::shared_ptr<const Projection> cur);
+  int ApplyProjectionDeltas(std::shared_ptr<const Projection> cur,
+      std::map<std::string, ceph::bufferlist>& deltas);
+
+  /*
+   * True if the position was invalidated by the most recent cut. A write
+   * that failed with a stale epoch may be retried at the same position in
+   * the new epoch unless the position was sealed.
+   */
+  bool PositionSealed(uint64_t position);
+
+  std::shared_ptr<const Projection> GetProjection() const {
+    return std::atomic_load(&shared_->projection);
+  }
 
   int Read(uint64_t epoch, uint64_t position, ceph::bufferlist& bl);
 
@@ -115,13 +374,60 @@ class LogImpl : public Log {
   std::string name_;
   std::string metalog_oid_;
   SeqrClient *seqr;
+  Options options_;
 
   /*
-   *
+   * Local pool of reserved positions (optional)
+   */
+  ReservationPool *reservations_;
+
+  /*
+   * Asynchronous append coalescing (optional)
+   */
+  AppendCoalescer *coalescer_;
+
+  /*
+   * Cache of entries read or written by this handle (optional)
+   */
+  EntryCache *cache_;
+
+  /*
+   * Adaptive stripe width (optional)
+   */
+  StripeWidthController *controller_;
+
+  /*
+   * Projection change notifications
+   */
+  ProjectionWatcher watcher_;
+  uint64_t watch_handle_;
+  librados::AioCompletion *watch_c_;
+  std::mutex notify_lock_;
+  std::condition_variable notify_cond_;
+  uint64_t notified_epoch_;
+
+  /*
+   * Asynchronous projection waiters, protected by notify_lock_. The thread
+   * that times them out is started by the first waiter.
+   */
+  struct ProjectionWaiter {
+    uint64_t epoch;
+    std::chrono::steady_clock::time_point deadline;
+    std::function<void()> callback;
+  };
+  std::list<ProjectionWaiter> waiters_;
+  bool waiters_stop_;
+  std::thread waiters_thread_;
+
+  /*
+   * Combines concurrent tail increments
+   */
+  TailCombiner combiner_;
+
+  /*
+   * Current projection, shared with other handles open on the same log.
    */
-  std::mutex lock_;
-  LogMapper mapper_;
-  uint64_t epoch_;
+  std::shared_ptr<SharedProjection> shared_;
 };
 
 struct zlog_log_ctx {
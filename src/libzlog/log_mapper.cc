@@ -1,18 +1,29 @@
 #include "log_mapper.h"
-#include <sstream>
 #include "stripe_history.h"
 
+LogMapper::LogMapper(const std::string& log_name,
+    const StripeHistory& history) :
+  log_name_(log_name),
+  history_(history),
+  latest_pos_(history.LatestPosition()),
+  latest_(history.LatestStripe())
+{
+  assert(!history_.Empty());
+
+  int max_width = history_.MaxWidth();
+  for (int slot = 0; slot < max_width; slot++)
+    oids_.push_back(SlotToOid(slot));
+}
+
 std::string LogMapper::SlotToOid(int slot) const
 {
-    std::stringstream oid;
-    oid << log_name_ << "." << slot;
-    return oid.str();
+  return log_name_ + "." + std::to_string(slot);
 }
 
 void LogMapper::LatestObjectSet(std::vector<std::string>& objects,
     const StripeHistory& history) const
 {
-  const StripeHistory::Stripe stripe = history.LatestStripe();
+  const StripeHistory::Stripe& stripe = history.LatestStripe();
   std::vector<std::string> result;
   for (int slot = 0; slot < stripe.width; slot++) {
     result.push_back(SlotToOid(slot));
@@ -20,10 +31,12 @@ void LogMapper::LatestObjectSet(std::vector<std::string>& objects,
   objects.swap(result);
 }
 
-std::string LogMapper::FindObject(uint64_t position) const
+const std::string& LogMapper::FindObject(uint64_t position) const
 {
   assert(!history_.Empty());
-  const StripeHistory::Stripe stripe = history_.FindStripe(position);
-  int slot = position % stripe.width;
-  return SlotToOid(slot);
+
+  if (position >= latest_pos_)
+    return oids_[latest_.Slot(position)];
+
+  return oids_[history_.FindStripe(position).Slot(position)];
 }
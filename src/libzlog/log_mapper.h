@@ -4,26 +4,44 @@
 #include <vector>
 #include <string>
 
+/*
+ * Maps log positions to stripe objects for one projection. A mapper is
+ * immutable once constructed, so it can be shared between threads without
+ * locking and the references returned by FindObject stay valid for as long
+ * as the mapper is held.
+ */
 class LogMapper {
  public:
-  std::string FindObject(uint64_t position) const;
+  LogMapper(const std::string& log_name, const StripeHistory& history);
+
+  /*
+   * The object names are computed when the mapper is constructed.
+   */
+  const std::string& FindObject(uint64_t position) const;
 
   void LatestObjectSet(std::vector<std::string>& objects,
       const StripeHistory& history) const;
 
-  void SetName(const std::string& log_name) {
-    log_name_ = log_name;
+  const StripeHistory& History() const {
+    return history_;
   }
 
-  void SetHistory(const StripeHistory& history) {
-    history_ = history;
+  int LatestWidth() const {
+    return latest_.width;
   }
 
  private:
   std::string SlotToOid(int slot) const;
 
-  std::string log_name_;
-  StripeHistory history_;
+  const std::string log_name_;
+  const StripeHistory history_;
+
+  // the latest stripe, which almost all operations target
+  const uint64_t latest_pos_;
+  const StripeHistory::Stripe latest_;
+
+  // object name for each slot
+  std::vector<std::string> oids_;
 };
 
 #endif
@@ -0,0 +1,34 @@
+#include "projection.h"
+#include <map>
+
+namespace zlog {
+
+static std::mutex registry_lock;
+static std::map<std::pair<std::string, std::string>,
+  std::weak_ptr<SharedProjection>> registry;
+
+std::shared_ptr<SharedProjection> GetSharedProjection(
+    const std::string& pool, const std::string& name)
+{
+  std::lock_guard<std::mutex> l(registry_lock);
+
+  auto key = std::make_pair(pool, name);
+  std::shared_ptr<SharedProjection> shared = registry[key].lock();
+  if (shared)
+    return shared;
+
+  // drop entries for logs that no longer have open handles
+  for (auto it = registry.begin(); it != registry.end();) {
+    if (it->second.expired())
+      it = registry.erase(it);
+    else
+      it++;
+  }
+
+  shared = std::make_shared<SharedProjection>();
+  registry[key] = shared;
+
+  return shared;
+}
+
+}
@@ -0,0 +1,71 @@
+#ifndef ZLOG_PROJECTION_H_
+#define ZLOG_PROJECTION_H_
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "log_mapper.h"
+#include "stripe_history.h"
+
+namespace zlog {
+
+/*
+ * An immutable snapshot of a log projection: the epoch, the max position
+ * sealed by the cut that installed it, and the mapping from positions to
+ * stripe objects. A new snapshot is built for each projection change and
+ * published atomically, so operations read a consistent view without
+ * taking a lock, and a snapshot stays valid for as long as it is held.
+ */
+struct Projection {
+  Projection(uint64_t epoch, const std::string& name,
+      const StripeHistory& history) :
+    epoch(epoch),
+    max_pos(history.MaxPosition()),
+    mapper(name, history)
+  {}
+
+  const uint64_t epoch;
+  const uint64_t max_pos;
+  const LogMapper mapper;
+};
+
+/*
+ * Projection state shared by all of the handles in a process that are open
+ * on the same log. A refresh by any handle is seen by all of them, and
+ * concurrent refreshes are collapsed into one read of the metalog: the
+ * first handle to refresh does the read while the others wait for its
+ * result (or, for asynchronous refreshes, queue a callback). Refreshes run
+ * one at a time, so the n-th refresh started is the n-th to finish.
+ */
+struct SharedProjection {
+  SharedProjection() :
+    refreshing(false),
+    refresh_started(0),
+    refresh_gen(0),
+    refresh_result(0)
+  {}
+
+  // current projection; accessed with std::atomic_load/store
+  std::shared_ptr<const Projection> projection;
+
+  std::mutex lock;
+  std::condition_variable cond;
+  bool refreshing;
+  uint64_t refresh_started; // refreshes started
+  uint64_t refresh_gen;     // refreshes finished
+  int refresh_result;
+  std::vector<std::function<void(int)>> waiters;
+};
+
+/*
+ * Return the shared projection state for a log, creating it on first use.
+ * The state is dropped when the last handle holding it is closed.
+ */
+std::shared_ptr<SharedProjection> GetSharedProjection(
+    const std::string& pool, const std::string& name);
+
+}
+
+#endif
@@ -0,0 +1,159 @@
+#include "reservation_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "log_impl.h"
+
+namespace zlog {
+
+ReservationPool::ReservationPool(LogImpl *log, size_t size,
+    size_t low_water) :
+  log_(log), size_(size), low_water_(low_water), epoch_(0), stop_(false)
+{
+  assert(size_ > 0);
+  assert(low_water_ < size_);
+  thread_ = std::thread(&ReservationPool::Run, this);
+}
+
+ReservationPool::~ReservationPool()
+{
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+
+  FillPositions(positions_);
+}
+
+bool ReservationPool::Stale() const
+{
+  return !positions_.empty() && epoch_ != log_->GetProjection()->epoch;
+}
+
+bool ReservationPool::Get(uint64_t *pposition)
+{
+  std::unique_lock<std::mutex> l(lock_);
+
+  if (positions_.empty() || Stale()) {
+    l.unlock();
+    cond_.notify_one();
+    return false;
+  }
+
+  *pposition = positions_.front();
+  positions_.pop_front();
+
+  if (positions_.size() < low_water_) {
+    l.unlock();
+    cond_.notify_one();
+  }
+
+  return true;
+}
+
+void ReservationPool::Notify()
+{
+  cond_.notify_one();
+}
+
+/*
+ * Fill positions that were reserved but never used. A position may have
+ * been written by another client in the meantime (e.g. after the sequencer
+ * was restarted) in which case the fill is a no-op.
+ */
+void ReservationPool::FillPositions(const std::deque<uint64_t>& positions)
+{
+  for (const auto position : positions) {
+    int ret = log_->Fill(position);
+    if (ret && ret != -EROFS)
+      std::cerr << "reservation: failed to fill position " << position
+        << " ret " << ret << std::endl;
+  }
+}
+
+/*
+ * Max positions only grow from one cut to the next, so checking against the
+ * latest cut covers any cuts in between.
+ */
+std::deque<uint64_t> ReservationPool::TakeSealed()
+{
+  std::shared_ptr<const Projection> proj = log_->GetProjection();
+
+  std::deque<uint64_t> sealed, unsealed;
+  for (const auto position : positions_) {
+    if (position <= proj->max_pos)
+      sealed.push_back(position);
+    else
+      unsealed.push_back(position);
+  }
+
+  positions_.swap(unsealed);
+  epoch_ = proj->epoch;
+
+  return sealed;
+}
+
+void ReservationPool::Run()
+{
+  std::unique_lock<std::mutex> l(lock_);
+
+  for (;;) {
+    cond_.wait(l, [&]{
+      return stop_ || positions_.size() < low_water_ ||
+        positions_.empty() || Stale();
+    });
+
+    if (stop_)
+      break;
+
+    /*
+     * Positions sealed by a new cut are given up. Fill them so that they
+     * don't become holes.
+     */
+    if (Stale()) {
+      std::deque<uint64_t> sealed = TakeSealed();
+      l.unlock();
+      FillPositions(sealed);
+      l.lock();
+      continue;
+    }
+
+    size_t count = std::min(size_ - positions_.size(),
+        (size_t)CHECK_TAIL_BATCH_MAX);
+
+    l.unlock();
+    std::vector<uint64_t> result;
+    int ret = log_->CheckTail(result, count);
+    uint64_t epoch = log_->GetProjection()->epoch;
+    l.lock();
+
+    if (ret) {
+      std::cerr << "reservation: failed to reserve positions ret "
+        << ret << std::endl;
+      cond_.wait_for(l, std::chrono::seconds(1), [&]{ return stop_; });
+      continue;
+    }
+
+    /*
+     * The batch is tagged with the epoch that was current when the
+     * sequencer replied. Anything left over from an older epoch is checked
+     * against the cut first.
+     */
+    if (!positions_.empty() && epoch != epoch_) {
+      std::deque<uint64_t> sealed = TakeSealed();
+      l.unlock();
+      FillPositions(sealed);
+      l.lock();
+    }
+
+    epoch_ = epoch;
+    positions_.insert(positions_.end(), result.begin(), result.end());
+  }
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef ZLOG_RESERVATION_POOL_H_
+#define ZLOG_RESERVATION_POOL_H_
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace zlog {
+
+class LogImpl;
+
+/*
+ * A local pool of log positions reserved from the sequencer. Positions are
+ * fetched in batches by a background thread whenever the pool drops below
+ * its low-water mark, and are handed out to appends without a round-trip to
+ * the sequencer.
+ *
+ * When the epoch changes the unused positions covered by the cut can no
+ * longer be written, so they are filled. Those after the cut are still
+ * writable and stay in the pool: the sequencer of the new epoch carries on
+ * from where it was and doesn't hand them out again. When the pool is
+ * destroyed any unused positions are filled so that readers don't stall on
+ * the holes.
+ */
+class ReservationPool {
+ public:
+  ReservationPool(LogImpl *log, size_t size, size_t low_water);
+  ~ReservationPool();
+
+  /*
+   * Take a reserved position. Returns false if the pool is empty or its
+   * positions haven't been checked against the latest cut yet, in which
+   * case the caller should ask the sequencer directly.
+   */
+  bool Get(uint64_t *pposition);
+
+  /*
+   * Wake up the refill thread (e.g. after an epoch change).
+   */
+  void Notify();
+
+ private:
+  void Run();
+  void FillPositions(const std::deque<uint64_t>& positions);
+
+  /*
+   * Move the pool to the current epoch, and return the positions that the
+   * cut sealed. Called with the lock held.
+   */
+  std::deque<uint64_t> TakeSealed();
+
+  bool Stale() const;
+
+  LogImpl *log_;
+  const size_t size_;
+  const size_t low_water_;
+
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::deque<uint64_t> positions_;
+  uint64_t epoch_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}
+
+#endif
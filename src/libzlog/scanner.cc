@@ -0,0 +1,103 @@
+#include <cerrno>
+#include <deque>
+#include "log_impl.h"
+#include "zlog/scanner.h"
+
+namespace zlog {
+
+Scanner::~Scanner() {}
+
+/*
+ * Keeps a window of asynchronous reads in flight ahead of the consumer.
+ * Consecutive positions map to different stripe objects, so the reads in a
+ * window are spread across the whole stripe and sequential consumption is
+ * no longer bound by the latency of one read at a time.
+ */
+class ScannerImpl : public Scanner {
+ public:
+  ScannerImpl(LogImpl *log, uint64_t start, uint64_t end, size_t window) :
+    log_(log), next_(start), end_(end), window_(window)
+  {
+    Issue();
+  }
+
+  ~ScannerImpl();
+
+  int Next(ceph::bufferlist& bl, uint64_t *pposition = NULL);
+
+ private:
+  struct Read {
+    uint64_t position;
+    AioCompletion *c;
+    ceph::bufferlist bl;
+  };
+
+  void Issue();
+
+  LogImpl *log_;
+  uint64_t next_;
+  const uint64_t end_;
+  const size_t window_;
+  std::deque<Read*> reads_;
+};
+
+ScannerImpl::~ScannerImpl()
+{
+  for (auto read : reads_) {
+    read->c->WaitForComplete();
+    delete read->c;
+    delete read;
+  }
+}
+
+void ScannerImpl::Issue()
+{
+  while (reads_.size() < window_ && next_ < end_) {
+    Read *read = new Read;
+    read->position = next_++;
+    read->c = Log::aio_create_completion();
+
+    int ret = log_->AioRead(read->position, read->c, &read->bl);
+    assert(ret == 0);
+
+    reads_.push_back(read);
+  }
+}
+
+int ScannerImpl::Next(ceph::bufferlist& bl, uint64_t *pposition)
+{
+  if (reads_.empty())
+    return -EBADF;
+
+  Read *read = reads_.front();
+  reads_.pop_front();
+
+  // keep the window full while we wait
+  Issue();
+
+  read->c->WaitForComplete();
+  int ret = read->c->ReturnValue();
+  if (ret == 0)
+    bl.claim_append(read->bl);
+
+  if (pposition)
+    *pposition = read->position;
+
+  delete read->c;
+  delete read;
+
+  return ret;
+}
+
+int LogImpl::Scan(uint64_t start, uint64_t end, Scanner **scannerptr,
+    size_t window)
+{
+  if (start > end || window == 0)
+    return -EINVAL;
+
+  *scannerptr = new ScannerImpl(this, start, end, window);
+
+  return 0;
+}
+
+}
@@ -50,9 +50,10 @@ int LogImpl::MultiAppend(ceph::bufferlist& data,
     bl.append(data.c_str(), data.length());
 
     librados::ObjectWriteOperation op;
-    zlog::cls_zlog_write(op, epoch_, position, bl);
+    std::shared_ptr<const Projection> proj = GetProjection();
+    zlog::cls_zlog_write(op, proj->epoch, position, bl);
 
-    std::string oid = mapper_.FindObject(position);
+    const std::string& oid = proj->mapper.FindObject(position);
     ret = ioctx_->operate(oid, &op);
     if (ret < 0) {
       std::cerr << "append: failed ret " << ret << std::endl;
@@ -60,13 +61,14 @@ int LogImpl::MultiAppend(ceph::bufferlist& data,
     }
 
     if (ret == zlog::CLS_ZLOG_OK) {
+      CacheAppend(position, bl);
       if (pposition)
         *pposition = position;
       return 0;
     }
 
     if (ret == zlog::CLS_ZLOG_STALE_EPOCH) {
-      ret = RefreshProjection();
+      ret = RefreshProjection(proj->epoch);
       if (ret)
         return ret;
       continue;
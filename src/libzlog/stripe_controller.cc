@@ -0,0 +1,151 @@
+#include "stripe_controller.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "log_impl.h"
+
+namespace zlog {
+
+StripeWidthController::StripeWidthController(LogImpl *log,
+    const Options& options) :
+  log_(log),
+  options_(options),
+  reconfig_interval_(options.stripe_reconfig_interval_sec),
+  last_change_(std::chrono::steady_clock::now()),
+  stop_(false)
+{
+  assert(options_.stripe_width_min > 0);
+  assert(options_.stripe_width_min <= options_.stripe_width_max);
+  thread_ = std::thread(&StripeWidthController::Run, this);
+}
+
+StripeWidthController::~StripeWidthController()
+{
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+}
+
+void StripeWidthController::OpStart(const std::string& oid)
+{
+  std::lock_guard<std::mutex> l(lock_);
+  ObjectStats& stats = stats_[oid];
+  stats.inflight++;
+  stats.max_inflight = std::max(stats.max_inflight, stats.inflight);
+}
+
+void StripeWidthController::OpFinish(const std::string& oid,
+    uint64_t latency_us)
+{
+  std::lock_guard<std::mutex> l(lock_);
+  ObjectStats& stats = stats_[oid];
+  assert(stats.inflight > 0);
+  stats.inflight--;
+  stats.ops++;
+  stats.latency_us += latency_us;
+}
+
+/*
+ * Sample and reset the statistics for the last period. Called with the lock
+ * held.
+ */
+StripeWidthController::Sample StripeWidthController::TakeSample()
+{
+  Sample sample;
+  uint64_t latency_us = 0;
+
+  for (auto& it : stats_) {
+    ObjectStats& stats = it.second;
+    sample.ops += stats.ops;
+    latency_us += stats.latency_us;
+    sample.max_inflight = std::max(sample.max_inflight, stats.max_inflight);
+    stats.ops = 0;
+    stats.latency_us = 0;
+    stats.max_inflight = stats.inflight;
+  }
+
+  sample.mean_latency_us = sample.ops ? latency_us / sample.ops : 0;
+
+  return sample;
+}
+
+int StripeWidthController::NextWidth(const Options& options,
+    const Sample& sample, int width, bool can_change, Periods *periods)
+{
+  bool saturated = sample.ops > 0 &&
+    (sample.mean_latency_us > options.stripe_latency_high_us ||
+     sample.max_inflight > options.stripe_queue_depth_high);
+  bool quiet = sample.mean_latency_us < options.stripe_latency_low_us &&
+    sample.max_inflight <= 1;
+
+  if (saturated) {
+    periods->widen++;
+    periods->narrow = 0;
+  } else if (quiet) {
+    periods->narrow++;
+    periods->widen = 0;
+  } else {
+    periods->widen = 0;
+    periods->narrow = 0;
+  }
+
+  if (!can_change)
+    return 0;
+
+  const int min_width = options.stripe_width_min;
+  const int max_width = options.stripe_width_max;
+
+  if (periods->widen >= STRIPE_CONTROLLER_PERIODS && width < max_width)
+    return std::min(width * 2, max_width);
+
+  if (periods->narrow >= STRIPE_CONTROLLER_PERIODS && width > min_width)
+    return std::max(width / 2, min_width);
+
+  return 0;
+}
+
+void StripeWidthController::Run()
+{
+  std::unique_lock<std::mutex> l(lock_);
+
+  for (;;) {
+    cond_.wait_for(l, std::chrono::seconds(1), [&]{ return stop_; });
+    if (stop_)
+      break;
+
+    int width = log_->GetProjection()->mapper.LatestWidth();
+    bool can_change =
+      std::chrono::steady_clock::now() - last_change_ >= reconfig_interval_;
+    int next_width = NextWidth(options_, TakeSample(), width, can_change,
+        &periods_);
+    if (!next_width)
+      continue;
+
+    l.unlock();
+    int ret = log_->SetStripeWidth(next_width);
+    l.lock();
+
+    if (ret) {
+      std::cerr << "stripe controller: failed to set width " << next_width
+        << " ret " << ret << std::endl;
+      continue;
+    }
+
+    // objects from the old stripe no longer receive appends
+    for (auto it = stats_.begin(); it != stats_.end();) {
+      if (it->second.inflight == 0)
+        it = stats_.erase(it);
+      else
+        it++;
+    }
+
+    periods_ = Periods();
+    last_change_ = std::chrono::steady_clock::now();
+  }
+}
+
+}
@@ -0,0 +1,109 @@
+#ifndef ZLOG_STRIPE_CONTROLLER_H_
+#define ZLOG_STRIPE_CONTROLLER_H_
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "include/zlog/log.h"
+
+/*
+ * Number of consecutive sampling periods that must agree before the stripe
+ * width is changed.
+ */
+#define STRIPE_CONTROLLER_PERIODS 3
+
+namespace zlog {
+
+class LogImpl;
+
+/*
+ * Adjusts the stripe width of a log to its append load. Appends issued by
+ * the log handle report the latency and queue depth of each stripe object,
+ * and once per second the controller samples these statistics. The stripe
+ * is doubled when objects are saturated (high latency or deep queues) and
+ * halved when the log is quiet, within [stripe_width_min, stripe_width_max].
+ *
+ * A change is only made once the same decision has been reached for
+ * STRIPE_CONTROLLER_PERIODS periods in a row, and at most once per
+ * stripe_reconfig_interval_sec, since every change seals the log.
+ */
+class StripeWidthController {
+ public:
+  StripeWidthController(LogImpl *log, const Options& options);
+  ~StripeWidthController();
+
+  /*
+   * Instrumentation for an operation on a stripe object.
+   */
+  void OpStart(const std::string& oid);
+  void OpFinish(const std::string& oid, uint64_t latency_us);
+
+  /*
+   * Statistics for one sampling period across all stripe objects.
+   */
+  struct Sample {
+    Sample() :
+      ops(0), mean_latency_us(0), max_inflight(0)
+    {}
+
+    uint64_t ops;
+    uint64_t mean_latency_us;
+    int max_inflight;
+  };
+
+  /*
+   * Number of consecutive periods in which the stripe was found saturated
+   * (widen) or quiet (narrow).
+   */
+  struct Periods {
+    Periods() :
+      widen(0), narrow(0)
+    {}
+
+    int widen;
+    int narrow;
+  };
+
+  /*
+   * The decision made at the end of a sampling period. Updates the period
+   * counts with the sample and returns the width that the stripe should be
+   * changed to, or 0 to keep the current width. No change is made unless
+   * can_change is set (the reconfiguration interval has passed).
+   */
+  static int NextWidth(const Options& options, const Sample& sample,
+      int width, bool can_change, Periods *periods);
+
+ private:
+  struct ObjectStats {
+    ObjectStats() :
+      ops(0), latency_us(0), inflight(0), max_inflight(0)
+    {}
+
+    uint64_t ops;
+    uint64_t latency_us;
+    int inflight;
+    int max_inflight;
+  };
+
+  void Run();
+  Sample TakeSample();
+
+  LogImpl *log_;
+  const Options options_;
+  const std::chrono::seconds reconfig_interval_;
+
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::unordered_map<std::string, ObjectStats> stats_;
+  Periods periods_;
+  std::chrono::steady_clock::time_point last_change_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}
+
+#endif
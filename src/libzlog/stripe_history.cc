@@ -1,4 +1,7 @@
 #include "stripe_history.h"
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
 #include "proto/zlog.pb.h"
 #include "proto/protobuf_bufferlist_adapter.h"
 
@@ -15,8 +18,15 @@ ceph::bufferlist StripeHistory::Serialize() const
     entry->set_pos(position);
     entry->set_epoch(s.epoch);
     entry->set_width(s.width);
+    if (s.mapping == MAPPING_BLOCK) {
+      entry->set_mapping(zlog_proto::MetaLog_StripeHistoryEntry::BLOCK);
+      entry->set_block_size(s.block_size);
+    }
   }
 
+  if (max_pos_)
+    config.set_max_pos(max_pos_);
+
   ceph::bufferlist bl;
   pack_msg<zlog_proto::MetaLog>(bl, config);
 
@@ -31,14 +41,51 @@ int StripeHistory::Deserialize(ceph::bufferlist& bl)
     return -EIO;
   }
 
-  for (unsigned i = 0; i < config.stripe_history_size(); i++) {
+  std::map<uint64_t, Stripe> history;
+  for (int i = 0; i < config.stripe_history_size(); i++) {
     const zlog_proto::MetaLog_StripeHistoryEntry& e = config.stripe_history(i);
     uint64_t position = e.pos();
-    assert(history_.find(position) == history_.end());
-    Stripe stripe = { e.epoch(), (int)e.width() };
-    history_[position] = stripe;
+    if (history.find(position) != history.end()) {
+      std::cerr << "duplicate stripe at " << position << std::endl;
+      return -EIO;
+    }
+    Stripe stripe = { e.epoch(), (int)e.width(), MAPPING_ROUND_ROBIN, 0 };
+    if (e.mapping() == zlog_proto::MetaLog_StripeHistoryEntry::BLOCK) {
+      if (e.block_size() == 0) {
+        std::cerr << "invalid block size" << std::endl;
+        return -EIO;
+      }
+      stripe.mapping = MAPPING_BLOCK;
+      stripe.block_size = e.block_size();
+    }
+    history[position] = stripe;
   }
 
+  history_.swap(history);
+  max_pos_ = config.has_max_pos() ? config.max_pos() : 0;
+
+  return 0;
+}
+
+int StripeHistory::ApplyDelta(const StripeHistory& delta)
+{
+  const uint64_t latest = history_.empty() ? 0 : LatestPosition();
+
+  for (const auto& it : delta.history_) {
+    const Stripe& s = it.second;
+    if (it.first < latest)
+      return -EINVAL;
+    auto cur = history_.find(it.first);
+    if (cur != history_.end() && (cur->second.epoch != s.epoch ||
+          cur->second.width != s.width || cur->second.mapping != s.mapping ||
+          cur->second.block_size != s.block_size))
+      return -EINVAL;
+  }
+
+  for (const auto& it : delta.history_)
+    history_[it.first] = it.second;
+  SetMaxPosition(delta.max_pos_);
+
   return 0;
 }
 
@@ -46,16 +93,34 @@ bool StripeHistory::Empty() const {
   return history_.empty();
 }
 
-void StripeHistory::AddStripe(uint64_t position, uint64_t epoch, int width)
+void StripeHistory::AddStripe(uint64_t position, uint64_t epoch, int width,
+    Mapping mapping, uint32_t block_size)
 {
   const auto it = history_.lower_bound(position);
   assert(it == history_.end());
   assert(width > 0);
-  Stripe stripe = { epoch, width };
+  assert(mapping != MAPPING_BLOCK || block_size > 0);
+  Stripe stripe = { epoch, width, mapping, block_size };
   history_[position] = stripe;
 }
 
-StripeHistory::Stripe StripeHistory::FindStripe(uint64_t position) const
+void StripeHistory::SetMaxPosition(uint64_t position)
+{
+  max_pos_ = std::max(max_pos_, position);
+}
+
+/*
+ * Projections written before the max position was recorded only tell us
+ * where the latest stripe starts, which is the max position of the cut that
+ * created it.
+ */
+uint64_t StripeHistory::MaxPosition() const
+{
+  assert(!history_.empty());
+  return std::max(max_pos_, LatestPosition());
+}
+
+const StripeHistory::Stripe& StripeHistory::FindStripe(uint64_t position) const
 {
   assert(!history_.empty());
   auto it = history_.upper_bound(position);
@@ -64,9 +129,24 @@ StripeHistory::Stripe StripeHistory::FindStripe(uint64_t position) const
   return it->second;
 }
 
-StripeHistory::Stripe StripeHistory::LatestStripe() const
+const StripeHistory::Stripe& StripeHistory::LatestStripe() const
 {
   const auto it = history_.rbegin();
   assert(it != history_.rend());
   return it->second;
 }
+
+uint64_t StripeHistory::LatestPosition() const
+{
+  const auto it = history_.rbegin();
+  assert(it != history_.rend());
+  return it->first;
+}
+
+int StripeHistory::MaxWidth() const
+{
+  int width = 0;
+  for (const auto& stripe : history_)
+    width = std::max(width, stripe.second.width);
+  return width;
+}
@@ -5,23 +5,77 @@
 
 class StripeHistory {
  public:
+  /*
+   * How positions are assigned to the objects of a stripe. Round robin puts
+   * consecutive positions on different objects. Block striping puts
+   * block_size consecutive positions on each object before moving on to the
+   * next, which keeps neighbouring entries together for readers.
+   */
+  enum Mapping {
+    MAPPING_ROUND_ROBIN,
+    MAPPING_BLOCK,
+  };
+
   struct Stripe {
     uint64_t epoch;
     int width;
+    Mapping mapping;
+    uint32_t block_size;
+
+    int Slot(uint64_t position) const {
+      if (mapping == MAPPING_BLOCK)
+        return (position / block_size) % width;
+      return position % width;
+    }
   };
 
-  void AddStripe(uint64_t position, uint64_t epoch, int width);
+  StripeHistory() :
+    max_pos_(0)
+  {}
+
+  void AddStripe(uint64_t position, uint64_t epoch, int width,
+      Mapping mapping = MAPPING_ROUND_ROBIN, uint32_t block_size = 0);
 
-  Stripe FindStripe(uint64_t position) const;
-  Stripe LatestStripe() const;
+  /*
+   * The max position sealed by the most recent cut. Positions beyond it
+   * weren't invalidated by the cut.
+   */
+  void SetMaxPosition(uint64_t position);
+  uint64_t MaxPosition() const;
+
+  const Stripe& FindStripe(uint64_t position) const;
+  const Stripe& LatestStripe() const;
+
+  /*
+   * The first position of the latest stripe.
+   */
+  uint64_t LatestPosition() const;
+
+  /*
+   * The largest width of any stripe.
+   */
+  int MaxWidth() const;
 
   bool Empty() const;
 
+  /*
+   * Deserialize replaces the contents of the history.
+   */
   ceph::bufferlist Serialize() const;
   int Deserialize(ceph::bufferlist& bl);
 
+  /*
+   * Apply the changes recorded for a projection change: the stripes it
+   * added, which must start at or after the latest stripe, and the max
+   * position of its cut. A stripe already in the history must match.
+   * Returns -EINVAL if the delta doesn't fit the history, which is then
+   * unchanged.
+   */
+  int ApplyDelta(const StripeHistory& delta);
+
  private:
   std::map<uint64_t, Stripe> history_;
+  uint64_t max_pos_;
 };
 
 #endif
@@ -0,0 +1,55 @@
+#include "tail_combiner.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "log_impl.h"
+
+namespace zlog {
+
+/*
+ * A batch holds at most CHECK_TAIL_BATCH_MAX waiters, so a combiner that
+ * isn't in the batch it sent keeps combining until it has been served.
+ */
+int TailCombiner::Next(uint64_t *pposition)
+{
+  Waiter self;
+
+  std::unique_lock<std::mutex> l(lock_);
+  waiting_.push_back(&self);
+
+  while (!self.done) {
+    if (busy_) {
+      cond_.wait(l);
+      continue;
+    }
+
+    busy_ = true;
+
+    size_t count = std::min(waiting_.size(), (size_t)CHECK_TAIL_BATCH_MAX);
+    std::vector<Waiter*> batch(waiting_.begin(), waiting_.begin() + count);
+    waiting_.erase(waiting_.begin(), waiting_.begin() + count);
+
+    l.unlock();
+    uint64_t start;
+    int ret = log_->CheckTailRange(count, &start);
+    l.lock();
+
+    for (size_t i = 0; i < batch.size(); i++) {
+      batch[i]->ret = ret;
+      if (ret == 0)
+        batch[i]->position = start + i;
+      batch[i]->done = true;
+    }
+
+    busy_ = false;
+    cond_.notify_all();
+  }
+
+  if (self.ret == 0)
+    *pposition = self.position;
+
+  return self.ret;
+}
+
+}
@@ -1,19 +1,40 @@
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <csignal>
 #include <cstdlib>
 #include <deque>
 #include <iostream>
+#include <random>
 #include <thread>
 #include <vector>
+#include <endian.h>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/program_options.hpp>
 #include <rados/librados.hpp>
 #include "proto/zlog.pb.h"
 #include "libzlog/log_impl.h"
+#include "libseq/seqr_frame.h"
+#include "libseq/shm_ring.h"
 
 namespace po = boost::program_options;
 
+/*
+ * Size of the table of log handles. Logs beyond this many are only
+ * reachable by name.
+ */
+#define SEQR_MAX_LOGS 65536
+#define SEQR_NO_HANDLE (~0ULL)
+
+/*
+ * Size of a session's input buffer. A session stops reading requests while
+ * SEQR_SESSION_OUT_MAX bytes of replies are waiting to be written, and
+ * resumes once the writes drain.
+ */
+#define SEQR_SESSION_IN_SIZE 65536
+#define SEQR_SESSION_OUT_MAX (4 * SEQR_SESSION_IN_SIZE)
+
 static int report_sec;
 
 static uint64_t get_time(void)
@@ -35,9 +56,9 @@ static uint64_t get_time(void)
 class Sequence {
  public:
   Sequence(uint64_t seq, std::string pool,
-      std::string name, uint64_t epoch) :
+      std::string name, uint64_t epoch, uint64_t handle) :
     seq_(seq), pool_(pool), name_(name),
-    epoch_(epoch)
+    epoch_(epoch), handle_(handle)
   {}
 
   uint64_t read() {
@@ -49,12 +70,12 @@ class Sequence {
     return prev;
   }
 
-  void next(std::vector<uint64_t>& positions, int count) {
+  /*
+   * Hand out count consecutive positions and return the first.
+   */
+  uint64_t next(uint64_t count) {
     assert(count > 0);
-    uint64_t prev = seq_.fetch_add(count);
-    for (uint64_t i = 0; i < (uint64_t)count; i++) {
-      positions.push_back(prev + i);
-    }
+    return seq_.fetch_add(count);
   }
 
   /*
@@ -151,20 +172,23 @@ class Sequence {
     return 0;
   }
 
-  inline int match(const std::string& pool,
-      const std::string& name,
-      const uint64_t epoch) const {
-    if (pool != pool_ || name != name_)
-      return -EINVAL;
-    if (epoch < epoch_)
-      return -ERANGE;
-    return 0;
+  inline bool match(const std::string& pool,
+      const std::string& name) const {
+    return pool == pool_ && name == name_;
   }
 
   void set_streams(std::map<uint64_t, std::deque<uint64_t>>& ptrs) {
     streams_.swap(ptrs);
   }
 
+  uint64_t epoch() const {
+    return epoch_;
+  }
+
+  uint64_t handle() const {
+    return handle_;
+  }
+
  private:
   typedef std::deque<uint64_t> stream_backpointers_t;
   typedef std::map<uint64_t, stream_backpointers_t> stream_index_t;
@@ -174,26 +198,41 @@ class Sequence {
   std::string pool_;
   std::string name_;
   uint64_t epoch_;
+  uint64_t handle_;
 
   stream_index_t streams_;
 };
 
+/*
+ * Clients name a log by pool and name, or by a handle: the log's slot in a
+ * fixed table in the low 32 bits and a generation number in the high 32
+ * bits. Handles are looked up without taking the manager's lock. Each new
+ * handle takes the next generation, starting from a random value, so a
+ * handle from a sequencer that has since restarted, or from another
+ * sequencer the client failed over from, is rejected rather than naming
+ * some other log. The generation also allows a slot to be reused once logs
+ * can be removed.
+ */
 class LogManager {
  public:
-  LogManager() {
+  LogManager() :
+    num_handles_(0)
+  {
+    std::random_device rd;
+    generation_ = rd();
+    for (size_t i = 0; i < SEQR_MAX_LOGS; i++)
+      handles_[i] = NULL;
     thread_ = std::thread(&LogManager::Run, this);
     if (report_sec > 0)
       bench_thread_ = std::thread(&LogManager::BenchMonitor, this);
   }
 
   /*
-   * Read and optionally increment the log sequence number.
+   * Find the sequence for a log by name. If the log isn't known yet it is
+   * queued for initialization and -EAGAIN is returned.
    */
-  int ReadSequence(const std::string& pool, const std::string& name,
-      uint64_t epoch, bool increment, std::vector<uint64_t>& positions,
-      int count, const std::vector<uint64_t>& stream_ids,
-      std::vector<std::vector<uint64_t>>& stream_backpointers,
-      Sequence **cached_seq)
+  int GetSequence(const std::string& pool, const std::string& name,
+      Sequence **seq)
   {
     std::unique_lock<std::mutex> g(lock_);
 
@@ -205,33 +244,24 @@ class LogManager {
       return -EAGAIN;
     }
 
-    if (epoch < it->second.epoch)
-      return -ERANGE;
+    *seq = it->second.seq;
 
-    if (stream_ids.size() == 0) {
-      if (increment)
-        it->second.seq->next(positions, count);
-      else {
-        assert(count == 1);
-        uint64_t seq = it->second.seq->read();
-        positions.push_back(seq);
-      }
-    } else {
-      int ret = 0;
-      uint64_t seq;
-      assert(count == 1);
-      if (increment)
-        ret = it->second.seq->stream_next(stream_ids, stream_backpointers, &seq);
-      else
-        ret = it->second.seq->stream_read(stream_ids, stream_backpointers, &seq);
-      if (ret)
-        return ret;
-      positions.push_back(seq);
-    }
+    return 0;
+  }
 
-    *cached_seq = it->second.seq;
+  /*
+   * Find the sequence for a log handle. Returns NULL for unknown handles.
+   */
+  Sequence *LookupHandle(uint64_t handle) {
+    uint64_t index = handle & 0xffffffffULL;
+    if (index >= SEQR_MAX_LOGS)
+      return NULL;
 
-    return 0;
+    Sequence *seq = handles_[index].load(std::memory_order_acquire);
+    if (!seq || seq->handle() != handle)
+      return NULL;
+
+    return seq;
   }
 
  private:
@@ -239,8 +269,8 @@ class LogManager {
     Log() {}
     Log(uint64_t pos, uint64_t epoch,
         std::string pool, std::string name,
-        std::map<uint64_t, std::deque<uint64_t>>& ptrs) :
-      seq(new Sequence(pos, pool, name, epoch)), epoch(epoch)
+        std::map<uint64_t, std::deque<uint64_t>>& ptrs, uint64_t handle) :
+      seq(new Sequence(pos, pool, name, epoch, handle)), epoch(epoch)
     {
       seq->set_streams(ptrs);
     }
@@ -460,8 +490,13 @@ class LogManager {
         assert(pending_logs_.count(key) == 1);
         pending_logs_.erase(key);
         assert(logs_.count(key) == 0);
-        Log log(position, epoch, pool, name, ptrs);
+        uint64_t handle = SEQR_NO_HANDLE;
+        if (num_handles_ < SEQR_MAX_LOGS)
+          handle = (((uint64_t)generation_++) << 32) | num_handles_;
+        Log log(position, epoch, pool, name, ptrs, handle);
         logs_[key] = log;
+        if (handle != SEQR_NO_HANDLE)
+          handles_[num_handles_++].store(log.seq, std::memory_order_release);
       }
     }
   }
@@ -472,176 +507,146 @@ class LogManager {
   std::condition_variable cond_;
   std::map<std::pair<std::string, std::string>, LogManager::Log > logs_;
   std::set<std::pair<std::string, std::string> > pending_logs_;
+
+  uint32_t generation_;
+  size_t num_handles_;
+  std::atomic<Sequence*> handles_[SEQR_MAX_LOGS];
 };
 
 static LogManager *log_mgr;
 
-class Session {
+/*
+ * Handles sequencer requests for one client, whatever the transport.
+ */
+class RequestHandler {
  public:
-  Session(boost::asio::io_service& io_service)
-    : socket_(io_service)
-  {
-    cached_seq = NULL;
-  }
-
-  boost::asio::ip::tcp::socket& socket() {
-    return socket_;
-  }
-
-  void start() {
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(buffer_, sizeof(uint32_t)),
-        boost::bind(&Session::handle_hdr, this,
-          boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
-  }
-
- private:
-  void handle_hdr(const boost::system::error_code& err, size_t size) {
-    if (err) {
-      delete this;
-      return;
-    }
-
-    uint32_t msg_size = ntohl(*((uint32_t*)buffer_));
-
-    if (msg_size > sizeof(buffer_)) {
-      std::cerr << "message is too large" << std::endl;
-      delete this;
-      return;
-    }
-
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(buffer_, msg_size),
-        boost::bind(&Session::handle_msg, this,
-          boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
-  }
-
-  void handle_msg(const boost::system::error_code& err, size_t size) {
-    if (err) {
-      delete this;
-      return;
-    }
+  RequestHandler() :
+    cached_seq(NULL)
+  {}
 
+  /*
+   * Handle one request and append its reply to out. Returns false if the
+   * request can't be parsed. A request that parses but breaks the rules is
+   * answered with the INVALID status.
+   */
+  bool handle(const char *data, size_t size, std::string& out) {
     req_.Clear();
 
-    if (!req_.ParseFromArray(buffer_, size)) {
+    if (!req_.ParseFromArray(data, size)) {
       std::cerr << "failed to parse message" << std::endl;
-      delete this;
-      return;
+      return false;
     }
 
     if (!req_.IsInitialized()) {
       std::cerr << "received incomplete message" << std::endl;
-      delete this;
-      return;
+      return false;
     }
 
     reply_.Clear();
 
     /*
-     * Try to do a fast sequencer read. The basic idea is that for a
-     * particular session a client will likely be referencing the same log
-     * repeatedly.
-     *
-     * 1. if we haven't cached a sequencer then do a slow lookup which will
-     * search for it in an index and return a pointer to the sequencer object.
-     *
-     * 2. If we have a cached sequencer object then check to see if it is for
-     * the correct pool/name/epoch. If so, read directly.
-     *
-     * 3. Otherwise, do a slow lookup and update the cached sequencer.
+     * Batches are only supported for new positions outside of streams. A
+     * batch is answered with a range, except to clients that only take a
+     * list of positions, which are held to a smaller batch.
+     */
+    const bool range = req_.features() & SEQR_FEATURE_RANGE_REPLY;
+    if (req_.count() == 0 || req_.count() > SEQR_MAX_BATCH ||
+        (!range && req_.count() > SEQR_MAX_LIST_BATCH) ||
+        (req_.count() > 1 && (!req_.next() || req_.stream_ids_size() > 0))) {
+      std::cerr << "received invalid request (count "
+        << req_.count() << ")" << std::endl;
+      reply_.set_status(zlog_proto::MSeqReply::INVALID);
+      append_reply(out);
+      return true;
+    }
+
+    if (!req_.has_log_handle() && (!req_.has_pool() || !req_.has_name())) {
+      std::cerr << "received request without a log" << std::endl;
+      reply_.set_status(zlog_proto::MSeqReply::INVALID);
+      append_reply(out);
+      return true;
+    }
+
+    /*
+     * Find the log. A handle is looked up directly. A request by name
+     * checks the sequence cached from the session's last request by name,
+     * which is the common case of a client using one log, and otherwise
+     * does a slow lookup that updates the cache.
      *
-     * Important:
-     *  - This is currently safe because once a sequencer object is created
-     *  it is never modified. But for instance we might want to change a
-     *  configuraiton and update the epoch. We may also need to add a
-     *  generation number and reference counting to deal with logs that come
-     *  and go. Currently they are created and never deleted.
+     * This is currently safe because once a sequence object is created it
+     * is never modified or deleted.
      */
     int ret;
-    std::vector<uint64_t> positions;
-    assert(req_.count() > 0 && req_.count() < 100);
+    Sequence *seq = NULL;
+    if (req_.has_log_handle()) {
+      seq = log_mgr->LookupHandle(req_.log_handle());
+      ret = seq ? 0 : -ENOENT;
+    } else if (cached_seq && cached_seq->match(req_.pool(), req_.name())) {
+      seq = cached_seq;
+      ret = 0;
+    } else {
+      ret = log_mgr->GetSequence(req_.pool(), req_.name(), &seq);
+      if (ret == 0)
+        cached_seq = seq;
+    }
+
+    if (ret == 0 && !req_.register_log() && req_.epoch() < seq->epoch())
+      ret = -ERANGE;
+
+    uint64_t position = 0;
 
     // per-stream backpointers
     std::vector<std::vector<uint64_t>> stream_backpointers;
-    const std::vector<uint64_t> stream_ids(req_.stream_ids().begin(),
-        req_.stream_ids().end());
 
-    if (cached_seq) {
-      ret = cached_seq->match(req_.pool(), req_.name(), req_.epoch());
-      if (!ret) {
+    if (ret == 0 && !req_.register_log()) {
+      /*
+       * If this request doesn't contain any stream ids then we are only
+       * interacting with the log tail (i.e. query or increment).
+       */
+      if (req_.stream_ids_size() == 0) {
         /*
-         * If this request doesn't contain any stream ids then we are only
-         * interacting with the log tail (i.e. query or increment).
+         * If only one position is being requested then it might be a query
+         * or an increment request. When the count is larger than 1 then it
+         * must be a request for multiple new positions.
          */
-        if (req_.stream_ids_size() == 0) {
-          /*
-           * If only one position is being requested then it might be a query
-           * or an increment request.
-           */
-          if (req_.count() == 1) {
-            uint64_t seq;
-            if (req_.next())
-              seq = cached_seq->next();
-            else
-              seq = cached_seq->read();
-            positions.push_back(seq);
-          } else {
-            /*
-             * When the count is larger than 1 then it must be a request for
-             * multiple new positions.
-             */
-            assert(req_.next());
-            cached_seq->next(positions, req_.count());
-          }
-        } else { // req_.stream_ids_size() > 0
-          /*
-           * This is a request involving streams, and might be a query or a
-           * request for incrementing the log tail.
-           */
-
-          // batch stream requests not yet supported
-          assert(req_.count() == 1);
-
-          /*
-           * If a stream hasn't been initialized then we may return -EAGAIN
-           * and instruct the client to try again later.
-           */
-          uint64_t seq;
+        if (req_.count() == 1) {
           if (req_.next())
-            ret = cached_seq->stream_next(stream_ids, stream_backpointers, &seq);
+            position = seq->next();
           else
-            ret = cached_seq->stream_read(stream_ids, stream_backpointers, &seq);
-          positions.push_back(seq);
-        }
+            position = seq->read();
+        } else
+          position = seq->next(req_.count());
       } else {
-        if (req_.count() > 1)
-          assert(req_.next());
-        ret = log_mgr->ReadSequence(req_.pool(), req_.name(),
-            req_.epoch(), req_.next(), positions, req_.count(),
-            stream_ids, stream_backpointers, &cached_seq);
+        /*
+         * This is a request involving streams, and might be a query or a
+         * request for incrementing the log tail.
+         */
+        const std::vector<uint64_t> stream_ids(req_.stream_ids().begin(),
+            req_.stream_ids().end());
+        if (req_.next())
+          ret = seq->stream_next(stream_ids, stream_backpointers, &position);
+        else
+          ret = seq->stream_read(stream_ids, stream_backpointers, &position);
       }
-    } else {
-      if (req_.count() > 1)
-        assert(req_.next());
-      ret = log_mgr->ReadSequence(req_.pool(), req_.name(),
-          req_.epoch(), req_.next(), positions, req_.count(),
-          stream_ids, stream_backpointers, &cached_seq);
     }
 
     if (ret == -EAGAIN)
       reply_.set_status(zlog_proto::MSeqReply::INIT_LOG);
     else if (ret == -ERANGE)
       reply_.set_status(zlog_proto::MSeqReply::STALE_EPOCH);
+    else if (ret == -ENOENT)
+      reply_.set_status(zlog_proto::MSeqReply::BAD_HANDLE);
     else
       assert(!ret);
 
-    for (std::vector<uint64_t>::const_iterator it = positions.begin();
-         it != positions.end(); it++) {
-      uint64_t pos = *it;
-      reply_.add_position(pos);
+    if (ret == 0 && !req_.register_log()) {
+      if (req_.count() > 1 && range) {
+        reply_.set_start(position);
+        reply_.set_count(req_.count());
+      } else {
+        for (uint64_t i = 0; i < req_.count(); i++)
+          reply_.add_position(position + i);
+      }
     }
 
     size_t stream_index = 0;
@@ -656,54 +661,353 @@ class Session {
       }
     }
 
+    /*
+     * Return the handle of a log named by pool and name to clients that
+     * asked for it. Logs beyond the size of the handle table don't have one.
+     */
+    const uint32_t features = req_.features() & SEQR_FEATURES;
+    if (features)
+      reply_.set_features(features);
+    if (ret == 0 && !req_.has_log_handle() &&
+        seq->handle() != SEQR_NO_HANDLE &&
+        (req_.register_log() || (features & SEQR_FEATURE_LOG_HANDLE)))
+      reply_.set_log_handle(seq->handle());
+
+    append_reply(out);
+
+    return true;
+  }
+
+  /*
+   * Handle one binary frame request and append its reply to out. Nothing
+   * is allocated. Returns false if the frame has the wrong size.
+   */
+  bool handle_frame(const char *data, size_t size, std::string& out) {
+    SeqrFrameRequest req;
+    if (size != sizeof(req)) {
+      std::cerr << "received invalid frame (size " << size << ")" << std::endl;
+      return false;
+    }
+    memcpy(&req, data, sizeof(req));
+
+    SeqrFrameReply reply;
+    reply.req_id = req.req_id;
+    reply.count = req.count;
+    reply.position = 0;
+
+    uint32_t op = le32toh(req.op);
+    uint32_t count = le32toh(req.count);
+    Sequence *seq;
+    if ((op != SEQR_FRAME_OP_READ && op != SEQR_FRAME_OP_NEXT) ||
+        count == 0 || count > SEQR_MAX_BATCH ||
+        (op == SEQR_FRAME_OP_READ && count != 1)) {
+      std::cerr << "received invalid frame (op " << op
+        << " count " << count << ")" << std::endl;
+      reply.status = htole32(SEQR_FRAME_INVALID);
+    } else if (!(seq = log_mgr->LookupHandle(le64toh(req.handle))))
+      reply.status = htole32(SEQR_FRAME_BAD_HANDLE);
+    else if (le64toh(req.epoch) < seq->epoch())
+      reply.status = htole32(SEQR_FRAME_STALE_EPOCH);
+    else {
+      uint64_t pos;
+      if (op == SEQR_FRAME_OP_NEXT)
+        pos = seq->next(count);
+      else
+        pos = seq->read();
+      reply.status = htole32(SEQR_FRAME_OK);
+      reply.position = htole64(pos);
+    }
+
+    out.append((const char*)&reply, sizeof(reply));
+
+    return true;
+  }
+
+ private:
+  /*
+   * Serialize the reply to the current request onto out.
+   */
+  void append_reply(std::string& out) {
+    if (req_.has_req_id())
+      reply_.set_req_id(req_.req_id());
+
     assert(reply_.IsInitialized());
 
-    uint32_t msg_size = reply_.ByteSize();
-    assert(msg_size < sizeof(buffer_));
-    assert(reply_.SerializeToArray(buffer_, msg_size));
+    size_t msg_size = reply_.ByteSize();
+    size_t off = out.size();
+    out.resize(off + msg_size);
+    bool ok = reply_.SerializeToArray(&out[off], msg_size);
+    assert(ok);
+    (void)ok;
+  }
+
+  zlog_proto::MSeqRequest req_;
+  zlog_proto::MSeqReply reply_;
+
+  Sequence *cached_seq;
+};
+
+/*
+ * A client session. Requests are handled as soon as they are read and the
+ * replies are queued, so a client can keep many requests in flight on one
+ * connection. Every reply carries the id of the request it answers. All the
+ * replies produced while a write is in progress go out in the next write.
+ * A client that doesn't read its replies stops being read from, so the
+ * replies queued for it stay bounded.
+ *
+ * Handlers run through the session's strand, so a session is used by one
+ * thread at a time even when the server runs several io_service threads.
+ */
+class Session {
+ public:
+  Session(boost::asio::io_service& io_service)
+    : socket_(io_service), strand_(io_service), in_len_(0),
+      reading_(false), writing_(false), closed_(false)
+  {}
+
+  boost::asio::generic::stream_protocol::socket& socket() {
+    return socket_;
+  }
 
-    // scatter/gather buffers
-    std::vector<boost::asio::const_buffer> out;
-    be_msg_size_ = htonl(msg_size);
-    out.push_back(boost::asio::buffer(&be_msg_size_, sizeof(be_msg_size_)));
-    out.push_back(boost::asio::buffer(buffer_, msg_size));
+  void start() {
+    reading_ = true;
+    start_read();
+  }
 
-    boost::asio::async_write(socket_, out,
-        boost::bind(&Session::handle_reply, this,
+ private:
+  void start_read() {
+    socket_.async_read_some(
+        boost::asio::buffer(in_buf_ + in_len_, sizeof(in_buf_) - in_len_),
+        strand_.wrap(boost::bind(&Session::handle_read, this,
           boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
+          boost::asio::placeholders::bytes_transferred)));
   }
 
-  void handle_reply(const boost::system::error_code& err, size_t size) {
+  /*
+   * Handle every complete request in the input buffer. A partial request is
+   * moved to the front of the buffer and completed by the next read.
+   */
+  void handle_read(const boost::system::error_code& err, size_t size) {
     if (err) {
-      delete this;
+      reading_ = false;
+      close();
       return;
     }
 
-    start();
+    in_len_ += size;
+
+    size_t off = 0;
+    while (in_len_ - off >= sizeof(uint32_t)) {
+      uint32_t be_msg_size;
+      memcpy(&be_msg_size, in_buf_ + off, sizeof(be_msg_size));
+      uint32_t msg_size = ntohl(be_msg_size);
+      bool frame = msg_size & SEQR_FRAME_FLAG;
+      msg_size &= ~SEQR_FRAME_FLAG;
+
+      if (msg_size > sizeof(in_buf_) - sizeof(uint32_t)) {
+        std::cerr << "message is too large" << std::endl;
+        reading_ = false;
+        close();
+        return;
+      }
+
+      if (in_len_ - off - sizeof(uint32_t) < msg_size)
+        break;
+
+      if (!handle_msg(in_buf_ + off + sizeof(uint32_t), msg_size, frame)) {
+        reading_ = false;
+        close();
+        return;
+      }
+
+      off += sizeof(uint32_t) + msg_size;
+    }
+
+    if (off) {
+      memmove(in_buf_, in_buf_ + off, in_len_ - off);
+      in_len_ -= off;
+    }
+
+    start_write();
+
+    if (out_pending_.size() >= SEQR_SESSION_OUT_MAX) {
+      reading_ = false;
+      return;
+    }
+
+    start_read();
   }
 
-  boost::asio::ip::tcp::socket socket_;
+  /*
+   * Handle one request and queue its length-prefixed reply, answering a
+   * binary frame with a binary frame. Returns false if the request is
+   * malformed and the session should be closed.
+   */
+  bool handle_msg(const char *data, size_t size, bool frame) {
+    size_t hdr = out_pending_.size();
+    out_pending_.resize(hdr + sizeof(uint32_t));
+
+    if (frame) {
+      if (!handler_.handle_frame(data, size, out_pending_))
+        return false;
+    } else if (!handler_.handle(data, size, out_pending_))
+      return false;
+
+    uint32_t msg_size = out_pending_.size() - hdr - sizeof(uint32_t);
+    if (frame)
+      msg_size |= SEQR_FRAME_FLAG;
+    uint32_t be_msg_size = htonl(msg_size);
+    memcpy(&out_pending_[hdr], &be_msg_size, sizeof(be_msg_size));
+
+    return true;
+  }
 
-  char buffer_[1024];
-  uint32_t be_msg_size_;
+  void start_write() {
+    if (writing_ || closed_ || out_pending_.empty())
+      return;
 
-  zlog_proto::MSeqRequest req_;
-  zlog_proto::MSeqReply reply_;
+    out_inflight_.swap(out_pending_);
+    out_pending_.clear();
 
-  Sequence *cached_seq;
+    writing_ = true;
+    boost::asio::async_write(socket_, boost::asio::buffer(out_inflight_),
+        strand_.wrap(boost::bind(&Session::handle_write, this,
+          boost::asio::placeholders::error,
+          boost::asio::placeholders::bytes_transferred)));
+  }
+
+  void handle_write(const boost::system::error_code& err, size_t size) {
+    writing_ = false;
+
+    if (err) {
+      close();
+      return;
+    }
+
+    start_write();
+
+    // resume reading once the replies drain
+    if (!reading_ && !closed_ && out_pending_.size() < SEQR_SESSION_OUT_MAX) {
+      reading_ = true;
+      start_read();
+    }
+  }
+
+  /*
+   * Closing the socket cancels any outstanding read or write. The session
+   * is deleted once neither is in progress.
+   */
+  void close() {
+    if (!closed_) {
+      closed_ = true;
+      boost::system::error_code ec;
+      socket_.close(ec);
+    }
+
+    if (!reading_ && !writing_)
+      delete this;
+  }
+
+  boost::asio::generic::stream_protocol::socket socket_;
+  boost::asio::io_service::strand strand_;
+
+  char in_buf_[SEQR_SESSION_IN_SIZE];
+  size_t in_len_;
+
+  std::string out_pending_;
+  std::string out_inflight_;
+
+  bool reading_;
+  bool writing_;
+  bool closed_;
+
+  RequestHandler handler_;
 };
 
+/*
+ * Serves requests from the shared memory ring. A single thread polls the
+ * ring, spinning while there is work and backing off briefly when idle,
+ * and periodically frees slots held by clients that have exited.
+ */
+class ShmServer {
+ public:
+  explicit ShmServer(zlog::ShmRing *ring) :
+    ring_(ring), stop_(false)
+  {
+    thread_ = std::thread(&ShmServer::Run, this);
+  }
+
+  /*
+   * Removes the ring, which tells attached clients it's gone.
+   */
+  ~ShmServer() {
+    stop_ = true;
+    thread_.join();
+    delete ring_;
+  }
+
+ private:
+  void Run() {
+    RequestHandler handler;
+    auto handle = [&](const char *data, size_t size, std::string& out) {
+      return handler.handle(data, size, out);
+    };
+
+    auto next_reap = std::chrono::steady_clock::now();
+    unsigned idle = 0;
+    for (uint64_t loops = 0; !stop_; loops++) {
+      if ((loops % 4096) == 0 &&
+          std::chrono::steady_clock::now() >= next_reap) {
+        ring_->Reap();
+        next_reap = std::chrono::steady_clock::now() +
+          std::chrono::milliseconds(SEQR_SHM_REAP_MS);
+      }
+      if (ring_->Poll(handle)) {
+        idle = 0;
+        continue;
+      }
+      if (++idle < 10000)
+        continue;
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+
+  zlog::ShmRing *ring_;
+  std::atomic<bool> stop_;
+  std::thread thread_;
+};
+
+/*
+ * Accepts TCP connections, and optionally connections on a unix domain
+ * socket, for clients on the same host. Sessions on either are handled the
+ * same way.
+ */
 class Server {
  public:
-  Server(short port, std::size_t nthreads)
+  Server(short port, std::size_t nthreads, const std::string& unix_path)
     : acceptor_(io_service_,
         boost::asio::ip::tcp::endpoint(
           boost::asio::ip::tcp::v4(), port)),
+      signals_(io_service_, SIGINT, SIGTERM),
       nthreads_(nthreads)
   {
     acceptor_.set_option(boost::asio::ip::tcp::no_delay(true));
     start_accept();
+
+    // run() returns so that the server can clean up
+    signals_.async_wait([this](const boost::system::error_code& err,
+          int signo) {
+      if (!err)
+        io_service_.stop();
+    });
+
+    if (!unix_path.empty()) {
+      unlink(unix_path.c_str());
+      unix_acceptor_.reset(new boost::asio::local::stream_protocol::acceptor(
+            io_service_,
+            boost::asio::local::stream_protocol::endpoint(unix_path)));
+      start_unix_accept();
+    }
   }
 
   void run() {
@@ -734,8 +1038,26 @@ class Server {
     start_accept();
   }
 
+  void start_unix_accept() {
+    Session* new_session = new Session(io_service_);
+    unix_acceptor_->async_accept(new_session->socket(),
+        boost::bind(&Server::handle_unix_accept, this, new_session,
+          boost::asio::placeholders::error));
+  }
+
+  void handle_unix_accept(Session* new_session,
+      const boost::system::error_code& error) {
+    if (!error)
+      new_session->start();
+    else
+      delete new_session;
+    start_unix_accept();
+  }
+
   boost::asio::io_service io_service_;
   boost::asio::ip::tcp::acceptor acceptor_;
+  std::unique_ptr<boost::asio::local::stream_protocol::acceptor> unix_acceptor_;
+  boost::asio::signal_set signals_;
   std::size_t nthreads_;
 };
 
@@ -744,12 +1066,18 @@ int main(int argc, char* argv[])
   int port;
   std::string host;
   int nthreads;
+  std::string unix_path;
+  std::string shm_name;
+  std::string shm_mode;
 
   po::options_description desc("Allowed options");
   desc.add_options()
     ("port", po::value<int>(&port)->required(), "Server port")
     ("nthreads", po::value<int>(&nthreads)->default_value(1), "Num threads")
     ("report-sec", po::value<int>(&report_sec)->default_value(0), "Time between rate reports")
+    ("unix-socket", po::value<std::string>(&unix_path)->default_value(""), "Also listen on a unix domain socket")
+    ("shm", po::value<std::string>(&shm_name)->default_value(""), "Also serve a shared memory ring")
+    ("shm-mode", po::value<std::string>(&shm_mode)->default_value("0600"), "Permissions of the shared memory ring (octal)")
     ("daemon,d", "Run in background")
   ;
 
@@ -760,6 +1088,13 @@ int main(int argc, char* argv[])
   if (nthreads <= 0 || nthreads > 64)
     nthreads = 1;
 
+  char *end;
+  mode_t mode = strtoul(shm_mode.c_str(), &end, 8);
+  if (shm_mode.empty() || *end != '\0' || mode > 0777) {
+    std::cerr << "invalid shm mode " << shm_mode << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
   Server *s;
 
   if (vm.count("daemon")) {
@@ -772,7 +1107,7 @@ int main(int argc, char* argv[])
       exit(EXIT_SUCCESS);
     }
 
-    s = new Server(port, nthreads);
+    s = new Server(port, nthreads, unix_path);
 
     pid_t sid = setsid();
     if (sid < 0) {
@@ -785,12 +1120,22 @@ int main(int argc, char* argv[])
     close(1);
     close(2);
   } else {
-    s = new Server(port, nthreads);
+    s = new Server(port, nthreads, unix_path);
   }
 
   log_mgr = new LogManager();
 
+  ShmServer *shm = NULL;
+  if (!shm_name.empty()) {
+    zlog::ShmRing *ring = zlog::ShmRing::Create(shm_name, mode);
+    if (!ring)
+      exit(EXIT_FAILURE);
+    shm = new ShmServer(ring);
+  }
+
   s->run();
 
+  delete shm;
+
   return 0;
 }
@@ -1,5 +1,9 @@
+#include <atomic>
 #include <cerrno>
 #include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <rados/librados.hpp>
 #include <rados/librados.h>
 #include <gtest/gtest.h>
@@ -170,6 +174,71 @@ TEST(LibZlog, Open) {
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
 }
 
+TEST(LibZlog, AioOpen) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  zlog::Log *log = NULL;
+
+  zlog::AioCompletion *c = zlog::Log::aio_create_completion();
+  int ret = zlog::Log::AioOpen(ioctx, "", NULL, c, &log);
+  ASSERT_EQ(ret, -EINVAL);
+  delete c;
+
+  c = zlog::Log::aio_create_completion();
+  ret = zlog::Log::AioOpen(ioctx, "dne", NULL, c, &log);
+  ASSERT_EQ(ret, 0);
+  c->WaitForComplete();
+  ASSERT_EQ(c->ReturnValue(), -ENOENT);
+  ASSERT_EQ(log, nullptr);
+  delete c;
+
+  ret = zlog::Log::Create(ioctx, "mylog", NULL, &log);
+  ASSERT_EQ(ret, 0);
+  delete log;
+  log = NULL;
+
+  c = zlog::Log::aio_create_completion();
+  ret = zlog::Log::AioOpen(ioctx, "mylog", NULL, c, &log);
+  ASSERT_EQ(ret, 0);
+  c->WaitForComplete();
+  ASSERT_EQ(c->ReturnValue(), 0);
+  ASSERT_NE(log, nullptr);
+  delete c;
+
+  delete log;
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibZlog, OpenOrCreate) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  zlog::Log *log = NULL;
+
+  int ret = zlog::Log::OpenOrCreate(ioctx, "mylog", NULL, &log);
+  ASSERT_EQ(ret, 0);
+  ASSERT_NE(log, nullptr);
+
+  delete log;
+  log = NULL;
+
+  ret = zlog::Log::OpenOrCreate(ioctx, "mylog", NULL, &log);
+  ASSERT_EQ(ret, 0);
+  ASSERT_NE(log, nullptr);
+
+  delete log;
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
 TEST(LibZlog, CheckTail) {
   librados::Rados rados;
   librados::IoCtx ioctx;
@@ -198,6 +267,126 @@ TEST(LibZlog, CheckTail) {
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
 }
 
+TEST(LibZlog, SharedClient) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  // fewer connections than threads
+  zlog::SeqrClient client("localhost", "5678", 2);
+  ASSERT_NO_THROW(client.Connect());
+  ASSERT_NO_THROW(client.Connect());
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(ioctx, "mylog", &client, &log);
+  ASSERT_EQ(ret, 0);
+
+  const int num_threads = 16;
+  const int per_thread = 50;
+
+  std::mutex lock;
+  std::set<uint64_t> positions;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.push_back(std::thread([&] {
+      for (int j = 0; j < per_thread; j++) {
+        ceph::bufferlist bl;
+        bl.append("foo");
+        uint64_t pos;
+        int ret = log->Append(bl, &pos);
+        ASSERT_EQ(ret, 0);
+        std::lock_guard<std::mutex> l(lock);
+        ASSERT_TRUE(positions.insert(pos).second);
+      }
+    }));
+  }
+
+  for (auto& thread : threads)
+    thread.join();
+
+  ASSERT_EQ(positions.size(), (unsigned)(num_threads * per_thread));
+
+  delete log;
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibZlog, SeqrFailover) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  // nothing is listening on the first endpoint
+  std::vector<std::string> endpoints;
+  endpoints.push_back("localhost:1");
+  endpoints.push_back("localhost:5678");
+  zlog::SeqrClient client(endpoints);
+  ASSERT_NO_THROW(client.Connect());
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(ioctx, "mylog", &client, &log);
+  ASSERT_EQ(ret, 0);
+
+  uint64_t pos;
+  ret = log->CheckTail(&pos);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(pos, (unsigned)0);
+
+  delete log;
+
+  // no endpoint can be reached
+  std::vector<std::string> bad_endpoints;
+  bad_endpoints.push_back("localhost:1");
+  zlog::SeqrClient bad_client(bad_endpoints);
+  ASSERT_ANY_THROW(bad_client.Connect());
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+/*
+ * Destroying a client runs the callback of every request it still holds,
+ * including ones waiting to be retried while the sequencer initializes the
+ * log.
+ */
+TEST(LibZlog, SeqrShutdown) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(ioctx, "mylog", NULL, &log);
+  ASSERT_EQ(ret, 0);
+  delete log;
+
+  zlog::SeqrClient *client = new zlog::SeqrClient("localhost", "5678");
+  ASSERT_NO_THROW(client->Connect());
+
+  const int count = 100;
+  std::atomic<int> done(0);
+  std::atomic<int> failed(0);
+  for (int i = 0; i < count; i++) {
+    client->AsyncCheckTail(0, pool_name, "mylog", true,
+        [&](int ret, uint64_t position) {
+      if (ret != 0 && ret != -ESHUTDOWN)
+        failed++;
+      done++;
+    });
+  }
+
+  delete client;
+
+  ASSERT_EQ(done, count);
+  ASSERT_EQ(failed, 0);
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
 TEST(LibZlog, Append) {
   librados::Rados rados;
   librados::IoCtx ioctx;
@@ -245,6 +434,441 @@ TEST(LibZlog, Append) {
   ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
 }
 
+TEST(LibZlog, AppendBatch) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  zlog::SeqrClient client("localhost", "5678");
+  ASSERT_NO_THROW(client.Connect());
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(ioctx, "mylog", &client, &log);
+  ASSERT_EQ(ret, 0);
+
+  std::vector<ceph::bufferlist> empty;
+  ret = log->AppendBatch(empty, NULL);
+  ASSERT_EQ(ret, -EINVAL);
+
+  uint64_t tail;
+  ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+
+  // larger than a single sequencer batch
+  std::vector<ceph::bufferlist> data;
+  for (int i = 0; i < 250; i++) {
+    ceph::bufferlist bl;
+    bl.append(std::to_string(i));
+    data.push_back(bl);
+  }
+
+  std::vector<uint64_t> positions;
+  ret = log->AppendBatch(data, &positions);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(positions.size(), data.size());
+
+  std::set<uint64_t> unique(positions.begin(), positions.end());
+  ASSERT_EQ(unique.size(), positions.size());
+
+  for (size_t i = 0; i < data.size(); i++) {
+    ASSERT_GE(positions[i], tail);
+    ceph::bufferlist bl;
+    ret = log->Read(positions[i], bl);
+    ASSERT_EQ(ret, 0);
+    ASSERT_TRUE(bl == data[i]);
+  }
+
+  zlog::AioCompletion *c = zlog::Log::aio_create_completion();
+  ret = log->AioAppendBatch(c, data, &positions);
+  ASSERT_EQ(ret, 0);
+  c->WaitForComplete();
+  ASSERT_EQ(c->ReturnValue(), 0);
+  delete c;
+  ASSERT_EQ(positions.size(), data.size());
+
+  for (size_t i = 0; i < data.size(); i++) {
+    ceph::bufferlist bl;
+    ret = log->Read(positions[i], bl);
+    ASSERT_EQ(ret, 0);
+    ASSERT_TRUE(bl == data[i]);
+  }
+
+  delete log;
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibZlog, AppendReservations) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  zlog::SeqrClient client("localhost", "5678");
+  ASSERT_NO_THROW(client.Connect());
+
+  zlog::Options options;
+  options.reservation_size = 10;
+  options.reservation_low_water = 10;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(ioctx, "mylog", &client, options, &log);
+  ASSERT_EQ(ret, -EINVAL);
+
+  options.reservation_low_water = 5;
+  ret = zlog::Log::Create(ioctx, "mylog", NULL, options, &log);
+  ASSERT_EQ(ret, -EINVAL);
+
+  ret = zlog::Log::Create(ioctx, "mylog", &client, options, &log);
+  ASSERT_EQ(ret, 0);
+
+  std::set<uint64_t> positions;
+  for (int i = 0; i < 50; i++) {
+    uint64_t pos;
+    ceph::bufferlist bl;
+    bl.append(std::to_string(i));
+    ret = log->Append(bl, &pos);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(positions.count(pos), 0u);
+    positions.insert(pos);
+
+    ceph::bufferlist bl2;
+    ret = log->Read(pos, bl2);
+    ASSERT_EQ(ret, 0);
+    ASSERT_TRUE(bl == bl2);
+  }
+
+  // unused reserved positions are filled on close
+  delete log;
+
+  ret = zlog::Log::Open(ioctx, "mylog", &client, &log);
+  ASSERT_EQ(ret, 0);
+
+  uint64_t tail;
+  ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+
+  for (uint64_t pos = 0; pos < tail; pos++) {
+    if (positions.count(pos))
+      continue;
+    ceph::bufferlist bl;
+    ret = log->Read(pos, bl);
+    ASSERT_EQ(ret, -EFAULT);
+  }
+
+  delete log;
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibZlog, AioAppendCoalesced) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  zlog::SeqrClient client("localhost", "5678");
+  ASSERT_NO_THROW(client.Connect());
+
+  zlog::Options options;
+  options.append_window_entries = 16;
+  options.append_window_us = 1000;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(ioctx, "mylog", &client, options, &log);
+  ASSERT_EQ(ret, 0);
+
+  /*
+   * Entries whose positions were filled in the meantime fail within their
+   * compound write and are retried on their own at new positions.
+   */
+  uint64_t tail;
+  ret = log->CheckTail(&tail);
+  ASSERT_EQ(ret, 0);
+  std::set<uint64_t> filled;
+  for (uint64_t pos = tail; pos < tail + 20; pos += 7) {
+    ret = log->Fill(pos);
+    ASSERT_EQ(ret, 0);
+    filled.insert(pos);
+  }
+
+  const int count = 100;
+  std::vector<zlog::AioCompletion*> completions;
+  std::vector<uint64_t> positions(count);
+  std::vector<ceph::bufferlist> data(count);
+  for (int i = 0; i < count; i++) {
+    data[i].append(std::to_string(i));
+    zlog::AioCompletion *c = zlog::Log::aio_create_completion();
+    ret = log->AioAppend(c, data[i], &positions[i]);
+    ASSERT_EQ(ret, 0);
+    completions.push_back(c);
+  }
+
+  for (auto c : completions) {
+    c->WaitForComplete();
+    ASSERT_EQ(c->ReturnValue(), 0);
+    delete c;
+  }
+
+  std::set<uint64_t> unique(positions.begin(), positions.end());
+  ASSERT_EQ(unique.size(), positions.size());
+
+  for (int i = 0; i < count; i++) {
+    ASSERT_EQ(filled.count(positions[i]), 0u);
+    ceph::bufferlist bl;
+    ret = log->Read(positions[i], bl);
+    ASSERT_EQ(ret, 0);
+    ASSERT_TRUE(bl == data[i]);
+  }
+
+  delete log;
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibZlog, EntryCache) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  zlog::SeqrClient client("localhost", "5678");
+  ASSERT_NO_THROW(client.Connect());
+
+  zlog::Options options;
+  options.entry_cache_size = 100;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(ioctx, "mylog", &client, options, &log);
+  ASSERT_EQ(ret, 0);
+
+  ceph::bufferlist bl;
+  bl.append("foo");
+  uint64_t pos;
+  ret = log->Append(bl, &pos);
+  ASSERT_EQ(ret, 0);
+
+  uint64_t hits, misses;
+  log->CacheStats(&hits, &misses);
+  ASSERT_EQ(hits, 0u);
+  ASSERT_EQ(misses, 0u);
+
+  // first read misses, second is served from the cache
+  for (int i = 0; i < 2; i++) {
+    ceph::bufferlist bl2;
+    ret = log->Read(pos, bl2);
+    ASSERT_EQ(ret, 0);
+    ASSERT_TRUE(bl == bl2);
+  }
+
+  zlog::AioCompletion *c = zlog::Log::aio_create_completion();
+  ceph::bufferlist bl3;
+  ret = log->AioRead(pos, c, &bl3);
+  ASSERT_EQ(ret, 0);
+  c->WaitForComplete();
+  ASSERT_EQ(c->ReturnValue(), 0);
+  ASSERT_TRUE(bl == bl3);
+  delete c;
+
+  log->CacheStats(&hits, &misses);
+  ASSERT_EQ(hits, 2u);
+  ASSERT_EQ(misses, 1u);
+
+  // trimmed entries are dropped from the cache
+  ret = log->Trim(pos);
+  ASSERT_EQ(ret, 0);
+  ceph::bufferlist bl4;
+  ret = log->Read(pos, bl4);
+  ASSERT_EQ(ret, -EFAULT);
+
+  delete log;
+
+  // write-through caches appended entries
+  options.entry_cache_write_through = true;
+  ret = zlog::Log::Open(ioctx, "mylog", &client, options, &log);
+  ASSERT_EQ(ret, 0);
+
+  ret = log->Append(bl, &pos);
+  ASSERT_EQ(ret, 0);
+
+  ceph::bufferlist bl5;
+  ret = log->Read(pos, bl5);
+  ASSERT_EQ(ret, 0);
+  ASSERT_TRUE(bl == bl5);
+
+  log->CacheStats(&hits, &misses);
+  ASSERT_EQ(hits, 1u);
+  ASSERT_EQ(misses, 0u);
+
+  delete log;
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibZlog, Scan) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  zlog::SeqrClient client("localhost", "5678");
+  ASSERT_NO_THROW(client.Connect());
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(ioctx, "mylog", &client, &log);
+  ASSERT_EQ(ret, 0);
+
+  zlog::Scanner *scanner;
+  ret = log->Scan(10, 5, &scanner);
+  ASSERT_EQ(ret, -EINVAL);
+
+  std::vector<uint64_t> positions;
+  for (int i = 0; i < 20; i++) {
+    ceph::bufferlist bl;
+    bl.append(std::to_string(i));
+    uint64_t pos;
+    ret = log->Append(bl, &pos);
+    ASSERT_EQ(ret, 0);
+    positions.push_back(pos);
+  }
+
+  ret = log->Trim(positions[3]);
+  ASSERT_EQ(ret, 0);
+
+  // scan past the tail with a window smaller than the range
+  uint64_t start = positions.front();
+  uint64_t end = positions.back() + 3;
+  ret = log->Scan(start, end, &scanner, 4);
+  ASSERT_EQ(ret, 0);
+
+  for (uint64_t expected = start; expected < end; expected++) {
+    ceph::bufferlist bl;
+    uint64_t pos;
+    ret = scanner->Next(bl, &pos);
+    ASSERT_EQ(pos, expected);
+    size_t i = expected - start;
+    if (i == 3) {
+      ASSERT_EQ(ret, -EFAULT);
+    } else if (i < positions.size()) {
+      ASSERT_EQ(ret, 0);
+      ceph::bufferlist bl2;
+      bl2.append(std::to_string(i));
+      ASSERT_TRUE(bl == bl2);
+    } else {
+      ASSERT_EQ(ret, -ENODEV);
+    }
+  }
+
+  ceph::bufferlist bl;
+  ret = scanner->Next(bl);
+  ASSERT_EQ(ret, -EBADF);
+
+  delete scanner;
+  delete log;
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibZlog, ReadMany) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  zlog::SeqrClient client("localhost", "5678");
+  ASSERT_NO_THROW(client.Connect());
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(ioctx, "mylog", &client, &log);
+  ASSERT_EQ(ret, 0);
+
+  std::vector<uint64_t> positions;
+  for (int i = 0; i < 50; i++) {
+    ceph::bufferlist bl;
+    bl.append(std::to_string(i));
+    uint64_t pos;
+    ret = log->Append(bl, &pos);
+    ASSERT_EQ(ret, 0);
+    positions.push_back(pos);
+  }
+
+  ret = log->Trim(positions[7]);
+  ASSERT_EQ(ret, 0);
+
+  // an unwritten position
+  positions.push_back(positions.back() + 100);
+
+  std::vector<ceph::bufferlist> bls;
+  std::vector<int> results;
+  ret = log->ReadMany(positions, bls, results);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(bls.size(), positions.size());
+  ASSERT_EQ(results.size(), positions.size());
+
+  for (size_t i = 0; i < 50; i++) {
+    if (i == 7) {
+      ASSERT_EQ(results[i], -EFAULT);
+      continue;
+    }
+    ASSERT_EQ(results[i], 0);
+    ceph::bufferlist bl;
+    bl.append(std::to_string(i));
+    ASSERT_TRUE(bl == bls[i]);
+  }
+  ASSERT_EQ(results[50], -ENODEV);
+
+  delete log;
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
+TEST(LibZlog, StripeWidthController) {
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name = get_temp_pool_name();
+  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+
+  zlog::SeqrClient client("localhost", "5678");
+  ASSERT_NO_THROW(client.Connect());
+
+  zlog::Options options;
+  options.stripe_width_min = 10;
+  options.stripe_width_max = 5;
+
+  zlog::Log *log;
+  int ret = zlog::Log::Create(ioctx, "mylog", &client, options, &log);
+  ASSERT_EQ(ret, -EINVAL);
+
+  options.stripe_width_max = 20;
+  options.stripe_latency_low_us = options.stripe_latency_high_us;
+  ret = zlog::Log::Create(ioctx, "mylog", &client, options, &log);
+  ASSERT_EQ(ret, -EINVAL);
+
+  options.stripe_latency_low_us = 1000;
+  ret = zlog::Log::Create(ioctx, "mylog", &client, options, &log);
+  ASSERT_EQ(ret, 0);
+
+  for (int i = 0; i < 100; i++) {
+    ceph::bufferlist bl;
+    bl.append(std::to_string(i));
+    uint64_t pos;
+    ret = log->Append(bl, &pos);
+    ASSERT_EQ(ret, 0);
+  }
+
+  delete log;
+
+  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+}
+
 TEST(LibZlogStream, MultiAppend) {
   librados::Rados rados;
   librados::IoCtx ioctx;
@@ -326,7 +950,7 @@ TEST(LibZlogStream, StreamId) {
   ret = log->OpenStream(0, &stream0);
   ASSERT_EQ(ret, 0);
 
-  ASSERT_EQ(stream0->Id(), 0);
+  ASSERT_EQ(stream0->Id(), (unsigned)0);
 
   delete stream0;
 
@@ -334,7 +958,7 @@ TEST(LibZlogStream, StreamId) {
   ret = log->OpenStream(33, &stream33);
   ASSERT_EQ(ret, 0);
 
-  ASSERT_EQ(stream33->Id(), 33);
+  ASSERT_EQ(stream33->Id(), (unsigned)33);
 
   delete stream33;
 
@@ -366,7 +990,7 @@ TEST(LibZlogStream, Append) {
   ceph::bufferlist bl;
   ret = stream->ReadNext(bl, &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   // add something to stream
   uint64_t pos2;
@@ -376,7 +1000,7 @@ TEST(LibZlogStream, Append) {
   // still don't see it...
   ret = stream->ReadNext(bl, &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   // update view
   ret = stream->Sync();
@@ -417,7 +1041,7 @@ TEST(LibZlogStream, ReadNext) {
   ceph::bufferlist bl;
   ret = stream->ReadNext(bl, &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   ret = stream->Sync();
   ASSERT_EQ(ret, 0);
@@ -425,7 +1049,7 @@ TEST(LibZlogStream, ReadNext) {
   // still empty
   ret = stream->ReadNext(bl, &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   char data[1234];
 
@@ -504,7 +1128,7 @@ TEST(LibZlogStream, Reset) {
   ceph::bufferlist bl;
   ret = stream->ReadNext(bl, &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   ret = stream->Reset();
   ASSERT_EQ(ret, 0);
@@ -512,7 +1136,7 @@ TEST(LibZlogStream, Reset) {
   // still empty
   ret = stream->ReadNext(bl, &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   // append something to the stream
   char data[1234];
@@ -596,7 +1220,7 @@ TEST(LibZlogStream, Sync) {
 
     std::set<uint64_t> stream_ids;
     int count = rand() % 9 + 1;
-    for (unsigned j = 0; j < count; j++)
+    for (int j = 0; j < count; j++)
       stream_ids.insert(indicies[j]);
 
     uint64_t pos;
@@ -633,7 +1257,7 @@ TEST(LibZlogStream, Sync) {
 
     std::set<uint64_t> stream_ids;
     int count = rand() % 9 + 1;
-    for (unsigned j = 0; j < count; j++)
+    for (int j = 0; j < count; j++)
       stream_ids.insert(indicies[j]);
 
     uint64_t pos;
@@ -1058,7 +1682,7 @@ TEST(LibZlogC, Read) {
   char data2[4096];
   memset(data2, 0, sizeof(data2));
   ret = zlog_read(log, pos, data2, sizeof(data2));
-  ASSERT_EQ(ret, sizeof(data2));
+  ASSERT_EQ(ret, (int)sizeof(data2));
 
   ASSERT_TRUE(strcmp(data2, s) == 0);
 
@@ -1172,7 +1796,7 @@ TEST(LibZlogCStream, ReadNext) {
   uint64_t pos = 99;
   ret = zlog_stream_readnext(stream, data, sizeof(data), &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   ret = zlog_stream_sync(stream);
   ASSERT_EQ(ret, 0);
@@ -1180,7 +1804,7 @@ TEST(LibZlogCStream, ReadNext) {
   // still empty
   ret = zlog_stream_readnext(stream, data, sizeof(data), &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   char data2[1234];
 
@@ -1194,7 +1818,7 @@ TEST(LibZlogCStream, ReadNext) {
 
   // we should see it now..
   ret = zlog_stream_readnext(stream, data, sizeof(data), &pos);
-  ASSERT_EQ(ret, sizeof(data2));
+  ASSERT_EQ(ret, (int)sizeof(data2));
   ASSERT_EQ(pos, pos2);
   //ASSERT_EQ(bl, bl_out);
 
@@ -1216,7 +1840,7 @@ TEST(LibZlogCStream, ReadNext) {
 
   // we should see it now..
   ret = zlog_stream_readnext(stream, data4, sizeof(data4), &pos);
-  ASSERT_EQ(ret, sizeof(data3));
+  ASSERT_EQ(ret, (int)sizeof(data3));
   ASSERT_EQ(pos, pos2);
   //ASSERT_EQ(bl, bl_out);
 
@@ -1253,7 +1877,7 @@ TEST(LibZlogCStream, Reset) {
   ceph::bufferlist bl;
   ret = zlog_stream_readnext(stream, data, sizeof(data), &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   ret = zlog_stream_reset(stream);
   ASSERT_EQ(ret, 0);
@@ -1261,7 +1885,7 @@ TEST(LibZlogCStream, Reset) {
   // still empty
   ret = zlog_stream_readnext(stream, data, sizeof(data), &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   // append something to the stream
   char data2[1234];
@@ -1277,7 +1901,7 @@ TEST(LibZlogCStream, Reset) {
 
   // we should see it now..
   ret = zlog_stream_readnext(stream, data3, sizeof(data3), &pos);
-  ASSERT_EQ(ret, sizeof(data2));
+  ASSERT_EQ(ret, (int)sizeof(data2));
   ASSERT_EQ(pos, pos2);
   //ASSERT_EQ(bl, bl_out); FIXME
 
@@ -1292,7 +1916,7 @@ TEST(LibZlogCStream, Reset) {
 
   // we see the same thing again
   ret = zlog_stream_readnext(stream, data3, sizeof(data3), &pos);
-  ASSERT_EQ(ret, sizeof(data2));
+  ASSERT_EQ(ret, (int)sizeof(data2));
   ASSERT_EQ(pos, pos2);
   //ASSERT_EQ(bl, bl_out);
 
@@ -1321,7 +1945,7 @@ TEST(LibZlogCStream, Sync) {
   }
 
   // an empty stream sync is OK
-  ASSERT_EQ(zlog_stream_history(streams[4], NULL, 0), 0);
+  ASSERT_EQ(zlog_stream_history(streams[4], NULL, 0), (size_t)0);
   ret = zlog_stream_sync(streams[4]);
   ASSERT_EQ(ret, 0);
 
@@ -1339,7 +1963,7 @@ TEST(LibZlogCStream, Sync) {
 
     std::set<uint64_t> stream_ids;
     int count = rand() % 9 + 1;
-    for (unsigned j = 0; j < count; j++)
+    for (int j = 0; j < count; j++)
       stream_ids.insert(indicies[j]);
 
     char data[1];
@@ -1367,7 +1991,7 @@ TEST(LibZlogCStream, Sync) {
     size_t history_size = zlog_stream_history(streams[i], NULL, 0);
     std::vector<uint64_t> h(history_size);
     ret = zlog_stream_history(streams[i], &h[0], history_size);
-    ASSERT_EQ(ret, history_size);
+    ASSERT_EQ(ret, (int)history_size);
     ASSERT_EQ(stream_history[i], h);
   }
 
@@ -1384,7 +2008,7 @@ TEST(LibZlogCStream, Sync) {
 
     std::set<uint64_t> stream_ids;
     int count = rand() % 9 + 1;
-    for (unsigned j = 0; j < count; j++)
+    for (int j = 0; j < count; j++)
       stream_ids.insert(indicies[j]);
 
     char data[1];
@@ -1410,7 +2034,7 @@ TEST(LibZlogCStream, Sync) {
     size_t history_size = zlog_stream_history(streams[i], NULL, 0);
     std::vector<uint64_t> h(history_size);
     ret = zlog_stream_history(streams[i], &h[0], history_size);
-    ASSERT_EQ(ret, history_size);
+    ASSERT_EQ(ret, (int)history_size);
     ASSERT_EQ(stream_history[i], h);
   }
 
@@ -1435,13 +2059,13 @@ TEST(LibZlogCStream, StreamId) {
   ret = zlog_stream_open(log, 0, &stream0);
   ASSERT_EQ(ret, 0);
 
-  ASSERT_EQ(zlog_stream_id(stream0), 0);
+  ASSERT_EQ(zlog_stream_id(stream0), (unsigned)0);
 
   zlog_stream_t stream33;
   ret = zlog_stream_open(log, 33, &stream33);
   ASSERT_EQ(ret, 0);
 
-  ASSERT_EQ(zlog_stream_id(stream33), 33);
+  ASSERT_EQ(zlog_stream_id(stream33), (unsigned)33);
 
   ret = zlog_destroy(log);
   ASSERT_EQ(ret, 0);
@@ -1468,7 +2092,7 @@ TEST(LibZlogCStream, Append) {
   uint64_t pos = 99;
   ret = zlog_stream_readnext(stream, NULL, 0, &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   // add something to stream
   char data[5];
@@ -1479,7 +2103,7 @@ TEST(LibZlogCStream, Append) {
   // still don't see it...
   ret = zlog_stream_readnext(stream, NULL, 0, &pos);
   ASSERT_EQ(ret, -EBADF);
-  ASSERT_EQ(pos, 99);
+  ASSERT_EQ(pos, (unsigned)99);
 
   // update view
   ret = zlog_stream_sync(stream);
@@ -1487,7 +2111,7 @@ TEST(LibZlogCStream, Append) {
 
   // we should see it now..
   ret = zlog_stream_readnext(stream, data, sizeof(data), &pos);
-  ASSERT_EQ(ret, sizeof(data));
+  ASSERT_EQ(ret, (int)sizeof(data));
   ASSERT_EQ(pos, pos2);
 
   ret = zlog_destroy(log);
@@ -1,11 +1,23 @@
 #include "libzlog/log_impl.h"
+#include <atomic>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <rados/librados.hpp>
 #include <rados/librados.h>
+#include <rados/cls_zlog_client.h>
 #include <gtest/gtest.h>
 #include "include/zlog/log.h"
 #include "libzlog/log_impl.h"
+#include "libseq/shm_ring.h"
 
 /*
  * Helper function from ceph/src/test/librados/test.cc
@@ -110,38 +122,73 @@ static int destroy_one_pool_pp(const std::string &pool_name, librados::Rados &cl
   return 0;
 }
 
-TEST(LibZlogInternal, CheckTailBatch) {
-  librados::Rados rados;
-  librados::IoCtx ioctx;
-  std::string pool_name = get_temp_pool_name();
-  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
-  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+/*
+ * Each test gets a temporary pool, a sequencer client and a log named
+ * "mylog" (blog, or log for the internal interface). The handle and the pool
+ * go away with the test.
+ */
+class LibZlogInternal : public ::testing::Test {
+ protected:
+  LibZlogInternal() :
+    client("localhost", "5678"), blog(NULL), log(NULL)
+  {}
 
-  zlog::SeqrClient client("localhost", "5678");
-  ASSERT_NO_THROW(client.Connect());
+  virtual void SetUp() {
+    pool_name = get_temp_pool_name();
+    ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
+    ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
 
+    ASSERT_NO_THROW(client.Connect());
+
+    int ret = CreateLog("mylog", zlog::Options());
+    ASSERT_EQ(ret, 0);
+  }
+
+  virtual void TearDown() {
+    delete blog;
+    blog = NULL;
+    ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+  }
+
+  /*
+   * Replace the test's log handle with one on a new log.
+   */
+  int CreateLog(const std::string& name, const zlog::Options& options) {
+    delete blog;
+    blog = NULL;
+    log = NULL;
+    int ret = zlog::Log::Create(ioctx, name, &client, options, &blog);
+    if (ret == 0)
+      log = reinterpret_cast<zlog::LogImpl*>(blog);
+    return ret;
+  }
+
+  librados::Rados rados;
+  librados::IoCtx ioctx;
+  std::string pool_name;
+  zlog::SeqrClient client;
   zlog::Log *blog;
-  int ret = zlog::Log::Create(ioctx, "mylog", &client, &blog);
-  ASSERT_EQ(ret, 0);
-  zlog::LogImpl *log = reinterpret_cast<zlog::LogImpl*>(blog);
+  zlog::LogImpl *log;
+};
 
+TEST_F(LibZlogInternal, CheckTailBatch) {
   uint64_t pos;
-  ret = log->CheckTail(&pos, false);
+  int ret = log->CheckTail(&pos, false);
   ASSERT_EQ(ret, 0);
   ASSERT_EQ(pos, (unsigned)0);
 
   std::vector<uint64_t> result;
   ret = log->CheckTail(result, 1);
   ASSERT_EQ(ret, 0);
-  ASSERT_EQ(result[0], 0);
+  ASSERT_EQ(result[0], (unsigned)0);
 
   ret = log->CheckTail(result, 5);
   ASSERT_EQ(ret, 0);
-  ASSERT_EQ(result[0], 1);
-  ASSERT_EQ(result[1], 2);
-  ASSERT_EQ(result[2], 3);
-  ASSERT_EQ(result[3], 4);
-  ASSERT_EQ(result[4], 5);
+  ASSERT_EQ(result[0], (unsigned)1);
+  ASSERT_EQ(result[1], (unsigned)2);
+  ASSERT_EQ(result[2], (unsigned)3);
+  ASSERT_EQ(result[3], (unsigned)4);
+  ASSERT_EQ(result[4], (unsigned)5);
 
   ret = log->CheckTail(&pos, false);
   ASSERT_EQ(ret, 0);
@@ -153,29 +200,55 @@ TEST(LibZlogInternal, CheckTailBatch) {
 
   ret = log->CheckTail(result, 2);
   ASSERT_EQ(ret, 0);
-  ASSERT_EQ(result[0], 7);
-  ASSERT_EQ(result[1], 8);
+  ASSERT_EQ(result[0], (unsigned)7);
+  ASSERT_EQ(result[1], (unsigned)8);
 
-  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
-}
+  // large batches are reserved as a range
+  ret = log->CheckTailRange(10000, &pos);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(pos, (unsigned)9);
 
-TEST(LibZlogInternal, CheckTail) {
-  librados::Rados rados;
-  librados::IoCtx ioctx;
-  std::string pool_name = get_temp_pool_name();
-  ASSERT_EQ("", create_one_pool_pp(pool_name, rados));
-  ASSERT_EQ(0, rados.ioctx_create(pool_name.c_str(), ioctx));
+  ret = log->CheckTail(result, 1000);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(result.size(), (unsigned)1000);
+  ASSERT_EQ(result[0], (unsigned)10009);
+  ASSERT_EQ(result[999], (unsigned)11008);
 
-  zlog::SeqrClient client("localhost", "5678");
-  ASSERT_NO_THROW(client.Connect());
+  // the largest batch the client splits into is accepted by the sequencer
+  ret = log->CheckTailRange(CHECK_TAIL_BATCH_MAX, &pos);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(pos, (unsigned)11009);
 
-  zlog::Log *blog;
-  int ret = zlog::Log::Create(ioctx, "mylog", &client, &blog);
+  ret = log->CheckTail(&pos, false);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(pos, (unsigned)(11009 + CHECK_TAIL_BATCH_MAX));
+
+  // ranges can also be reserved asynchronously
+  std::mutex lock;
+  std::condition_variable cond;
+  bool done = false;
+  uint64_t start;
+  log->AioNextRange(100, [&](int rv, uint64_t s) {
+    std::lock_guard<std::mutex> l(lock);
+    ret = rv;
+    start = s;
+    done = true;
+    cond.notify_one();
+  });
+  {
+    std::unique_lock<std::mutex> l(lock);
+    cond.wait(l, [&]{ return done; });
+  }
   ASSERT_EQ(ret, 0);
-  zlog::LogImpl *log = reinterpret_cast<zlog::LogImpl*>(blog);
+  ASSERT_EQ(start, pos);
 
+  ret = log->CheckTailRange(CHECK_TAIL_BATCH_MAX + 1, &pos);
+  ASSERT_EQ(ret, -EINVAL);
+}
+
+TEST_F(LibZlogInternal, CheckTail) {
   uint64_t pos;
-  ret = log->CheckTail(&pos, false);
+  int ret = log->CheckTail(&pos, false);
   ASSERT_EQ(ret, 0);
   ASSERT_EQ(pos, (unsigned)0);
 
@@ -190,6 +263,716 @@ TEST(LibZlogInternal, CheckTail) {
   ret = log->CheckTail(&pos, true);
   ASSERT_EQ(ret, 0);
   ASSERT_EQ(pos, (unsigned)1);
+}
+
+TEST_F(LibZlogInternal, CheckTailCombined) {
+  // concurrent increments on one handle each get their own position
+  const int nthreads = 16;
+  const int per_thread = 200;
+  std::mutex lock;
+  std::set<uint64_t> positions;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nthreads; i++) {
+    threads.push_back(std::thread([&] {
+      for (int j = 0; j < per_thread; j++) {
+        uint64_t pos;
+        int ret = log->CheckTail(&pos, true);
+        ASSERT_EQ(ret, 0);
+        std::lock_guard<std::mutex> l(lock);
+        ASSERT_TRUE(positions.insert(pos).second);
+      }
+    }));
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  ASSERT_EQ(positions.size(), (unsigned)(nthreads * per_thread));
+  ASSERT_EQ(*positions.begin(), (unsigned)0);
+  ASSERT_EQ(*positions.rbegin(), (unsigned)(nthreads * per_thread - 1));
+}
+
+TEST_F(LibZlogInternal, ProjectionNotify) {
+  zlog::Log *blog2;
+  int ret = zlog::Log::Open(ioctx, "mylog", &client, &blog2);
+  ASSERT_EQ(ret, 0);
+  zlog::LogImpl *log2 = reinterpret_cast<zlog::LogImpl*>(blog2);
+
+  uint64_t epoch, maxpos;
+  ret = log2->CreateCut(&epoch, &maxpos);
+  ASSERT_EQ(ret, 0);
+
+  // the cut was announced, so this shouldn't wait out the timeout
+  auto start = std::chrono::steady_clock::now();
+  log->WaitForProjection(epoch - 1);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_LT(elapsed, std::chrono::milliseconds(500));
+
+  delete blog2;
+}
+
+TEST_F(LibZlogInternal, ProjectionNotifyAio) {
+  zlog::Log *blog2;
+  int ret = zlog::Log::Open(ioctx, "mylog", &client, &blog2);
+  ASSERT_EQ(ret, 0);
+  zlog::LogImpl *log2 = reinterpret_cast<zlog::LogImpl*>(blog2);
+
+  // the installed projection counts as announced
+  uint64_t cur = log->GetProjection()->epoch;
+  ASSERT_EQ(log->notified_epoch_, cur);
+
+  // make sure the notification can't be missed
+  ASSERT_EQ(log->watch_c_->wait_for_complete(), 0);
+  ASSERT_EQ(log->watch_c_->get_return_value(), 0);
+
+  std::mutex lock;
+  std::condition_variable cond;
+  bool woken = false;
+  log->AioWaitForProjection(cur, 10000, [&]() {
+    std::lock_guard<std::mutex> l(lock);
+    woken = true;
+    cond.notify_all();
+  });
+
+  uint64_t epoch, maxpos;
+  ret = log2->CreateCut(&epoch, &maxpos);
+  ASSERT_EQ(ret, 0);
+
+  // nothing refreshed the projection, so only the notification can wake it
+  {
+    std::unique_lock<std::mutex> l(lock);
+    cond.wait_for(l, std::chrono::seconds(5), [&]{ return woken; });
+    ASSERT_TRUE(woken);
+  }
+  ASSERT_EQ(log->GetProjection()->epoch, cur);
+  ASSERT_EQ(log->notified_epoch_, epoch);
+
+  delete blog2;
+}
+
+TEST_F(LibZlogInternal, AppendRetrySamePosition) {
+  zlog::Log *blog2;
+  int ret = zlog::Log::Open(ioctx, "mylog", &client, &blog2);
+  ASSERT_EQ(ret, 0);
+  zlog::LogImpl *log2 = reinterpret_cast<zlog::LogImpl*>(blog2);
+
+  char data[1234];
+  ceph::bufferlist bl;
+  bl.append(data, sizeof(data));
+
+  uint64_t pos1;
+  ret = log->Append(bl, &pos1);
+  ASSERT_EQ(ret, 0);
+
+  uint64_t epoch, maxpos;
+  ret = log2->CreateCut(&epoch, &maxpos);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(maxpos, pos1);
+
+  // the first write hits the stale epoch and is retried in place
+  uint64_t pos2;
+  ret = log->Append(bl, &pos2);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(pos2, pos1 + 1);
+
+  ASSERT_TRUE(log->PositionSealed(maxpos));
+  ASSERT_FALSE(log->PositionSealed(maxpos + 1));
+
+  delete blog2;
+}
+
+TEST_F(LibZlogInternal, AioAppendEpochChange) {
+  zlog::Log *blog2;
+  int ret = zlog::Log::Open(ioctx, "mylog", &client, &blog2);
+  ASSERT_EQ(ret, 0);
+  zlog::LogImpl *log2 = reinterpret_cast<zlog::LogImpl*>(blog2);
+
+  ceph::bufferlist bl;
+  bl.append("foo");
+
+  uint64_t pos1;
+  zlog::AioCompletion *c = zlog::Log::aio_create_completion();
+  ret = log->AioAppend(c, bl, &pos1);
+  ASSERT_EQ(ret, 0);
+  c->WaitForComplete();
+  ASSERT_EQ(c->ReturnValue(), 0);
+  delete c;
+
+  uint64_t epoch, maxpos;
+  ret = log2->CreateCut(&epoch, &maxpos);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(maxpos, pos1);
+  ASSERT_LT(log->GetProjection()->epoch, epoch);
+
+  // the write hits the stale epoch, waits for the cut and is retried in place
+  uint64_t pos2;
+  c = zlog::Log::aio_create_completion();
+  ret = log->AioAppend(c, bl, &pos2);
+  ASSERT_EQ(ret, 0);
+  c->WaitForComplete();
+  ASSERT_EQ(c->ReturnValue(), 0);
+  delete c;
+
+  ASSERT_EQ(pos2, pos1 + 1);
+  ASSERT_EQ(log->GetProjection()->epoch, epoch);
+
+  ceph::bufferlist bl2;
+  ret = log->Read(pos2, bl2);
+  ASSERT_EQ(ret, 0);
+  ASSERT_TRUE(bl == bl2);
+
+  delete blog2;
+}
+
+TEST_F(LibZlogInternal, AioAppendSequencerStale) {
+  /*
+   * The sequencer cuts a log when it first sees it, so the epoch of the new
+   * handle is stale and the position request fails with -ERANGE until the
+   * projection is refreshed.
+   */
+  ASSERT_EQ(log->GetProjection()->epoch, (unsigned)0);
+
+  ceph::bufferlist bl;
+  bl.append("foo");
+
+  uint64_t pos;
+  zlog::AioCompletion *c = zlog::Log::aio_create_completion();
+  int ret = log->AioAppend(c, bl, &pos);
+  ASSERT_EQ(ret, 0);
+  c->WaitForComplete();
+  ASSERT_EQ(c->ReturnValue(), 0);
+  delete c;
+
+  ASSERT_GT(log->GetProjection()->epoch, (unsigned)0);
+
+  ceph::bufferlist bl2;
+  ret = log->Read(pos, bl2);
+  ASSERT_EQ(ret, 0);
+  ASSERT_TRUE(bl == bl2);
+
+}
+
+TEST_F(LibZlogInternal, ReservationsEpochChange) {
+  zlog::Options options;
+  options.reservation_size = 10;
+  options.reservation_low_water = 5;
+
+  int ret = CreateLog("reslog", options);
+  ASSERT_EQ(ret, 0);
+
+  zlog::Log *blog2;
+  ret = zlog::Log::Open(ioctx, "reslog", &client, &blog2);
+  ASSERT_EQ(ret, 0);
+  zlog::LogImpl *log2 = reinterpret_cast<zlog::LogImpl*>(blog2);
+
+  std::set<uint64_t> positions;
+  for (int i = 0; i < 5; i++) {
+    uint64_t pos;
+    ceph::bufferlist bl;
+    bl.append(std::to_string(i));
+    ret = blog->Append(bl, &pos);
+    ASSERT_EQ(ret, 0);
+    positions.insert(pos);
+  }
+
+  // everything below the tail has been reserved
+  uint64_t tail;
+  ret = log2->CheckTail(&tail, false);
+  ASSERT_EQ(ret, 0);
+
+  uint64_t epoch, maxpos;
+  ret = log2->CreateCut(&epoch, &maxpos);
+  ASSERT_EQ(ret, 0);
+  ret = log2->RefreshProjection();
+  ASSERT_EQ(ret, 0);
+
+  // reservations after the cut are still handed out in the new epoch
+  uint64_t pos;
+  ceph::bufferlist bl;
+  bl.append("after");
+  ret = blog->Append(bl, &pos);
+  ASSERT_EQ(ret, 0);
+  ASSERT_GT(pos, maxpos);
+  ASSERT_LT(pos, tail);
+  positions.insert(pos);
+
+  // the unused reservations are filled on close
+  delete blog;
+  blog = NULL;
+
+  for (uint64_t pos = 0; pos < tail; pos++) {
+    ceph::bufferlist bl;
+    ret = log2->Read(pos, bl);
+    ASSERT_EQ(ret, positions.count(pos) ? 0 : -EFAULT);
+  }
+
+  delete blog2;
+}
+
+TEST_F(LibZlogInternal, BlockStriping) {
+  zlog::Options options;
+  options.stripe_block_size = 4;
+
+  int ret = CreateLog("blocklog", options);
+  ASSERT_EQ(ret, 0);
+
+  auto proj = log->GetProjection();
+  ASSERT_EQ(proj->mapper.FindObject(0), "blocklog.0");
+  ASSERT_EQ(proj->mapper.FindObject(3), "blocklog.0");
+  ASSERT_EQ(proj->mapper.FindObject(4), "blocklog.1");
+
+  for (int i = 0; i < 20; i++) {
+    ceph::bufferlist bl;
+    bl.append(std::to_string(i));
+    uint64_t pos;
+    ret = log->Append(bl, &pos);
+    ASSERT_EQ(ret, 0);
+
+    ceph::bufferlist bl2;
+    ret = log->Read(pos, bl2);
+    ASSERT_EQ(ret, 0);
+    ASSERT_TRUE(bl == bl2);
+  }
+
+  // switch to round robin
+  ret = log->SetStripe(10, 0);
+  ASSERT_EQ(ret, 0);
+
+  for (int i = 0; i < 20; i++) {
+    ceph::bufferlist bl;
+    bl.append(std::to_string(i));
+    uint64_t pos;
+    ret = log->Append(bl, &pos);
+    ASSERT_EQ(ret, 0);
+  }
+
+  proj = log->GetProjection();
+  uint64_t pos;
+  ret = log->CheckTail(&pos);
+  ASSERT_EQ(ret, 0);
+  ASSERT_NE(proj->mapper.FindObject(pos), proj->mapper.FindObject(pos + 1));
+
+  // the old block striped entries are still readable
+  ceph::bufferlist bl;
+  ret = log->Read(3, bl);
+  ASSERT_EQ(ret, 0);
+}
+
+TEST_F(LibZlogInternal, SharedProjection) {
+  zlog::Log *blog2;
+  int ret = zlog::Log::Open(ioctx, "mylog", &client, &blog2);
+  ASSERT_EQ(ret, 0);
+  zlog::LogImpl *log2 = reinterpret_cast<zlog::LogImpl*>(blog2);
+
+  // handles on the same log share one projection
+  ASSERT_EQ(log->GetProjection(), log2->GetProjection());
+
+  // and see each other's refreshes
+  uint64_t epoch, maxpos;
+  ret = log->CreateCut(&epoch, &maxpos);
+  ASSERT_EQ(ret, 0);
+  ret = log2->RefreshProjection();
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(log->GetProjection()->epoch, epoch);
+
+  // a handle that saw the old epoch as stale doesn't read it again
+  uint64_t started = log->shared_->refresh_started;
+  ret = log->RefreshProjection(epoch - 1);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(log->shared_->refresh_started, started);
+
+  std::mutex lock;
+  std::condition_variable cond;
+  int aio_ret = 1;
+  log->AioRefreshProjectionOnce(epoch - 1, [&](int ret) {
+    std::lock_guard<std::mutex> l(lock);
+    aio_ret = ret;
+    cond.notify_all();
+  });
+  {
+    std::unique_lock<std::mutex> l(lock);
+    cond.wait(l, [&]{ return aio_ret != 1; });
+  }
+  ASSERT_EQ(aio_ret, 0);
+  ASSERT_EQ(log->shared_->refresh_started, started);
+
+  // but one that saw the current epoch as stale does
+  ret = log->RefreshProjection(epoch);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(log->shared_->refresh_started, started + 1);
+
+  // a registered projection doesn't make a deleted log openable
+  zlog::Log *blog3 = NULL;
+  ASSERT_EQ(0, ioctx.remove(zlog::LogImpl::metalog_oid_from_name("mylog")));
+  ret = zlog::Log::Open(ioctx, "mylog", &client, &blog3);
+  ASSERT_EQ(ret, -ENOENT);
+  ASSERT_EQ(blog3, nullptr);
+
+  delete blog2;
+}
+
+TEST_F(LibZlogInternal, ProjectionDeltas) {
+  auto proj = log->GetProjection();
+
+  int ret = log->SetStripeWidth(5);
+  ASSERT_EQ(ret, 0);
+  uint64_t epoch, maxpos;
+  ret = log->CreateCut(&epoch, &maxpos);
+  ASSERT_EQ(ret, 0);
+  ret = log->SetStripe(7, 3);
+  ASSERT_EQ(ret, 0);
+
+  // catch up using only the per-epoch deltas
+  ret = log->ReadProjectionDeltas(proj);
+  ASSERT_EQ(ret, 0);
+
+  auto proj2 = log->GetProjection();
+  ASSERT_EQ(proj2->epoch, proj->epoch + 3);
+  ASSERT_EQ(proj2->mapper.LatestWidth(), 7);
+
+  // matches the full projection
+  int rv;
+  ceph::bufferlist bl;
+  librados::ObjectReadOperation op;
+  zlog::cls_zlog_get_latest_projection(op, &rv, &epoch, &bl);
+  ceph::bufferlist unused;
+  ret = ioctx.operate(log->metalog_oid_, &op, &unused);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(rv, 0);
+  ASSERT_EQ(epoch, proj2->epoch);
+  ASSERT_TRUE(bl == proj2->mapper.History().Serialize());
+
+  // nothing new to apply
+  ret = log->ReadProjectionDeltas(proj2);
+  ASSERT_EQ(ret, -ENOENT);
+
+  // a delta that doesn't extend the history is rejected
+  StripeHistory hist = proj2->mapper.History();
+  StripeHistory bad;
+  bad.AddStripe(0, proj2->epoch + 1, 3);
+  ASSERT_EQ(hist.ApplyDelta(bad), -EINVAL);
+  ASSERT_TRUE(hist.Serialize() == proj2->mapper.History().Serialize());
+
+  // only the last PROJECTION_DELTA_MAX deltas are kept
+  for (uint64_t e = 1; e <= PROJECTION_DELTA_MAX + 5; e++) {
+    StripeHistory delta;
+    delta.AddStripe(e, e, 1);
+    librados::ObjectWriteOperation wop;
+    log->SetProjectionDelta(wop, e, delta);
+    ret = ioctx.operate("deltas", &wop);
+    ASSERT_EQ(ret, 0);
+  }
+  std::map<std::string, ceph::bufferlist> vals;
+  ret = ioctx.omap_get_vals("deltas", "", PROJECTION_DELTA_MAX * 2, &vals);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(vals.size(), (unsigned)PROJECTION_DELTA_MAX);
+  ASSERT_EQ(vals.begin()->first, zlog::LogImpl::projection_delta_key(6));
+
+}
+
+TEST(LibZlogInternalUnit, StripeWidthDecision) {
+  zlog::Options options;
+  options.stripe_width_min = 4;
+  options.stripe_width_max = 16;
+  options.stripe_latency_high_us = 10000;
+  options.stripe_latency_low_us = 1000;
+  options.stripe_queue_depth_high = 8;
+
+  typedef zlog::StripeWidthController Controller;
+
+  Controller::Sample saturated;
+  saturated.ops = 1000;
+  saturated.mean_latency_us = 20000;
+  saturated.max_inflight = 4;
+
+  Controller::Sample queued;
+  queued.ops = 1000;
+  queued.mean_latency_us = 5000;
+  queued.max_inflight = 32;
+
+  Controller::Sample quiet;
+  quiet.ops = 10;
+  quiet.mean_latency_us = 500;
+  quiet.max_inflight = 1;
+
+  Controller::Sample steady;
+  steady.ops = 1000;
+  steady.mean_latency_us = 5000;
+  steady.max_inflight = 4;
+
+  // widen only after enough saturated periods in a row
+  Controller::Periods periods;
+  for (int i = 1; i < STRIPE_CONTROLLER_PERIODS; i++)
+    ASSERT_EQ(Controller::NextWidth(options, saturated, 8, true, &periods), 0);
+  ASSERT_EQ(Controller::NextWidth(options, saturated, 8, true, &periods), 16);
+
+  // deep queues count as saturated, and the width is capped at the max
+  periods = Controller::Periods();
+  for (int i = 1; i < STRIPE_CONTROLLER_PERIODS; i++)
+    ASSERT_EQ(Controller::NextWidth(options, queued, 12, true, &periods), 0);
+  ASSERT_EQ(Controller::NextWidth(options, queued, 12, true, &periods), 16);
+  ASSERT_EQ(Controller::NextWidth(options, queued, 16, true, &periods), 0);
+
+  // narrow when quiet, down to the min
+  periods = Controller::Periods();
+  for (int i = 1; i < STRIPE_CONTROLLER_PERIODS; i++)
+    ASSERT_EQ(Controller::NextWidth(options, quiet, 6, true, &periods), 0);
+  ASSERT_EQ(Controller::NextWidth(options, quiet, 6, true, &periods), 4);
+  ASSERT_EQ(Controller::NextWidth(options, quiet, 4, true, &periods), 0);
+
+  // hold under moderate load, and a steady period resets the count
+  periods = Controller::Periods();
+  for (int i = 0; i < 2 * STRIPE_CONTROLLER_PERIODS; i++)
+    ASSERT_EQ(Controller::NextWidth(options, steady, 8, true, &periods), 0);
+  for (int i = 1; i < STRIPE_CONTROLLER_PERIODS; i++)
+    ASSERT_EQ(Controller::NextWidth(options, saturated, 8, true, &periods), 0);
+  ASSERT_EQ(Controller::NextWidth(options, steady, 8, true, &periods), 0);
+  ASSERT_EQ(Controller::NextWidth(options, saturated, 8, true, &periods), 0);
+
+  // hold within the reconfiguration interval, then change once it passes
+  periods = Controller::Periods();
+  for (int i = 0; i < 2 * STRIPE_CONTROLLER_PERIODS; i++)
+    ASSERT_EQ(Controller::NextWidth(options, saturated, 8, false, &periods), 0);
+  ASSERT_EQ(Controller::NextWidth(options, saturated, 8, true, &periods), 16);
+}
+
+TEST_F(LibZlogInternal, SeqrPipelined) {
+  // wait for the sequencer to initialize the log
+  uint64_t pos;
+  int ret = log->CheckTail(&pos);
+  ASSERT_EQ(ret, 0);
+
+  // many requests in flight on the one connection
+  const int count = 500;
+  std::mutex lock;
+  std::condition_variable cond;
+  std::set<uint64_t> positions;
+  int done = 0;
+  uint64_t epoch = log->GetProjection()->epoch;
+  for (int i = 0; i < count; i++) {
+    client.AsyncCheckTail(epoch, ioctx.get_pool_name(), "mylog", true,
+        [&](int ret, uint64_t position) {
+      std::lock_guard<std::mutex> l(lock);
+      ASSERT_EQ(ret, 0);
+      positions.insert(position);
+      done++;
+      cond.notify_one();
+    });
+  }
+
+  {
+    std::unique_lock<std::mutex> l(lock);
+    cond.wait(l, [&]{ return done == count; });
+  }
+
+  ASSERT_EQ(positions.size(), (unsigned)count);
+  ASSERT_EQ(*positions.begin(), pos);
+  ASSERT_EQ(*positions.rbegin(), pos + count - 1);
+
+}
+
+/*
+ * The first request for a log goes out as protobuf and the rest as binary
+ * frames. Both must draw from the same sequence.
+ */
+TEST_F(LibZlogInternal, SeqrBinaryFrames) {
+  // wait for the sequencer to initialize the log
+  uint64_t pos;
+  int ret = log->CheckTail(&pos);
+  ASSERT_EQ(ret, 0);
+
+  uint64_t epoch = log->GetProjection()->epoch;
+  std::string pool = ioctx.get_pool_name();
+
+  uint64_t next;
+  for (int i = 0; i < 10; i++) {
+    ret = client.CheckTail(epoch, pool, "mylog", &next, true);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(next, pos + i);
+  }
+
+  std::vector<uint64_t> positions;
+  ret = client.CheckTail(epoch, pool, "mylog", positions, 20);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(positions.size(), 20u);
+  for (size_t i = 0; i < positions.size(); i++)
+    ASSERT_EQ(positions[i], pos + 10 + i);
+
+  ret = client.CheckTail(epoch, pool, "mylog", &next, false);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(next, pos + 30);
+
+  // stream requests still use protobuf
+  std::set<uint64_t> stream_ids;
+  stream_ids.insert(1);
+  std::map<uint64_t, std::vector<uint64_t>> ptrs;
+  ret = client.CheckTail(epoch, pool, "mylog", stream_ids, ptrs, &next, true);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(next, pos + 30);
+
+  ret = client.CheckTail(epoch, pool, "mylog", &next, true);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(next, pos + 31);
+
+}
+
+/*
+ * Requests for several logs on one connection, each named by its handle.
+ */
+TEST_F(LibZlogInternal, SeqrRegisterLog) {
+  zlog::SeqrClient one_conn_client("localhost", "5678", 1);
+  ASSERT_NO_THROW(one_conn_client.Connect());
+
+  zlog::Log *blog1, *blog2;
+  int ret = zlog::Log::Create(ioctx, "mylog1", &one_conn_client, &blog1);
+  ASSERT_EQ(ret, 0);
+  ret = zlog::Log::Create(ioctx, "mylog2", &one_conn_client, &blog2);
+  ASSERT_EQ(ret, 0);
+  zlog::LogImpl *log1 = reinterpret_cast<zlog::LogImpl*>(blog1);
+  zlog::LogImpl *log2 = reinterpret_cast<zlog::LogImpl*>(blog2);
+
+  std::string pool = ioctx.get_pool_name();
+
+  // wait for the sequencer to initialize the logs
+  uint64_t handle1, handle2;
+  while ((ret = one_conn_client.RegisterLog(pool, "mylog1", &handle1)) == -EAGAIN)
+    sleep(1);
+  ASSERT_EQ(ret, 0);
+  while ((ret = one_conn_client.RegisterLog(pool, "mylog2", &handle2)) == -EAGAIN)
+    sleep(1);
+  ASSERT_EQ(ret, 0);
+  ASSERT_NE(handle1, handle2);
+
+  // registering again returns the same handle
+  uint64_t handle;
+  ret = one_conn_client.RegisterLog(pool, "mylog1", &handle);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(handle, handle1);
+
+  uint64_t epoch1 = log1->GetProjection()->epoch;
+  uint64_t epoch2 = log2->GetProjection()->epoch;
+
+  for (uint64_t i = 0; i < 10; i++) {
+    uint64_t pos;
+    ret = one_conn_client.CheckTail(epoch1, pool, "mylog1", &pos, true);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(pos, i);
+
+    ret = one_conn_client.CheckTail(epoch2, pool, "mylog2", &pos, true);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(pos, 3 * i);
+
+    std::vector<uint64_t> positions;
+    ret = one_conn_client.CheckTail(epoch2, pool, "mylog2", positions, 2);
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(positions[0], 3 * i + 1);
+    ASSERT_EQ(positions[1], 3 * i + 2);
+  }
+
+  // streams go by handle too
+  std::set<uint64_t> stream_ids;
+  stream_ids.insert(1);
+  std::map<uint64_t, std::vector<uint64_t>> ptrs;
+  uint64_t pos;
+  ret = one_conn_client.CheckTail(epoch1, pool, "mylog1", stream_ids, ptrs, &pos, true);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(pos, 10u);
+
+  delete blog1;
+  delete blog2;
+}
+
+TEST(LibZlogInternalUnit, ShmRing) {
+  std::stringstream name;
+  name << "zlog-test-shm-" << getpid();
+
+  ASSERT_EQ(zlog::ShmRing::Open(name.str()), nullptr);
+
+  zlog::ShmRing *server = zlog::ShmRing::Create(name.str());
+  ASSERT_NE(server, nullptr);
+
+  zlog::ShmRing *client = zlog::ShmRing::Open(name.str());
+  ASSERT_NE(client, nullptr);
+
+  // nobody is serving the ring
+  std::string reply;
+  ASSERT_EQ(client->Call("hello", reply), -ETIMEDOUT);
+  uint32_t slot;
+  ASSERT_EQ(client->Submit("hello", &slot), 0);
+  ASSERT_EQ(client->Complete(slot, reply), -EINPROGRESS);
+  ASSERT_TRUE(client->Cancel(slot));
+
+  auto echo = [](const char *data, size_t size, std::string& out) {
+    if (std::string(data, size) == "slow")
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(SEQR_SHM_TIMEOUT_US * 2));
+    out.assign(data, size);
+    return true;
+  };
+
+  // a client that exits leaves its slot behind until it's reaped
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    zlog::ShmRing *child = zlog::ShmRing::Open(name.str());
+    std::string unused;
+    child->Call("hello", unused);
+    _exit(0);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ASSERT_EQ(kill(pid, SIGKILL), 0);
+  ASSERT_EQ(waitpid(pid, NULL, 0), pid);
+  ASSERT_EQ(server->Poll(echo), (unsigned)1);
+  ASSERT_EQ(server->Reap(), (unsigned)1);
+  ASSERT_EQ(server->Reap(), (unsigned)0);
+
+  // echo server
+  std::atomic<bool> stop(false);
+  std::thread poller([&] {
+    while (!stop)
+      server->Poll(echo);
+  });
+
+  // a request the server is too slow to answer is abandoned
+  ASSERT_EQ(client->Call("slow", reply), -ETIMEDOUT);
+
+  // let the server finish with it
+  std::this_thread::sleep_for(
+      std::chrono::microseconds(SEQR_SHM_TIMEOUT_US * 2));
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.push_back(std::thread([&, i] {
+      for (int j = 0; j < 1000; j++) {
+        std::stringstream ss;
+        ss << i << "." << j;
+        std::string reply;
+        ASSERT_EQ(client->Call(ss.str(), reply), 0);
+        ASSERT_EQ(reply, ss.str());
+      }
+    }));
+  }
+
+  for (auto& thread : threads)
+    thread.join();
+
+  // one thread with a request in every slot
+  std::vector<uint32_t> slots(SEQR_SHM_SLOTS);
+  for (size_t i = 0; i < slots.size(); i++)
+    ASSERT_EQ(client->Submit(std::to_string(i), &slots[i]), 0);
+  for (size_t i = 0; i < slots.size(); i++) {
+    int ret;
+    while ((ret = client->Complete(slots[i], reply)) == -EINPROGRESS)
+      std::this_thread::yield();
+    ASSERT_EQ(ret, 0);
+    ASSERT_EQ(reply, std::to_string(i));
+  }
+
+  stop = true;
+  poller.join();
+
+  // clients notice that the server removed the ring
+  delete server;
+  ASSERT_EQ(client->Call("hello", reply), -ESTALE);
 
-  ASSERT_EQ(0, destroy_one_pool_pp(pool_name, rados));
+  delete client;
 }
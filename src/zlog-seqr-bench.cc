@@ -1,3 +1,6 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
 #include <sstream>
 #include <thread>
 #include <boost/program_options.hpp>
@@ -9,6 +12,9 @@
 
 namespace po = boost::program_options;
 
+static std::atomic<uint64_t> ops_done;
+static std::atomic<uint64_t> ops_latency_us;
+
 void client_thread(zlog::LogImpl *log, bool check_tail)
 {
   // buffer with random bytes
@@ -21,6 +27,7 @@ void client_thread(zlog::LogImpl *log, bool check_tail)
 
   for (;;) {
     uint64_t pos;
+    auto start = std::chrono::steady_clock::now();
     if (check_tail) {
       ret = log->CheckTail(&pos, true);
     } else {
@@ -29,6 +36,10 @@ void client_thread(zlog::LogImpl *log, bool check_tail)
       ret = log->Append(bl, &pos);
     }
     assert(ret == 0);
+    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    ops_latency_us += latency.count();
+    ops_done++;
   }
 }
 
@@ -40,15 +51,25 @@ int main(int argc, char **argv)
   std::string port;
   std::string logname_req;
   bool check_tail;
+  bool shared;
+  int connections;
+  std::string transport;
+  std::string unix_path;
+  std::string shm_name;
 
   po::options_description desc("Allowed options");
   desc.add_options()
-    ("server", po::value<std::string>(&server)->required(), "Server host")
+    ("server", po::value<std::string>(&server)->required(), "Server host (comma separated for failover)")
     ("pool", po::value<std::string>(&pool)->required(), "Pool name")
     ("port", po::value<std::string>(&port)->required(), "Server port")
     ("threads", po::value<int>(&num_threads)->required(), "Number of threads")
     ("logname", po::value<std::string>(&logname_req)->default_value(""), "Log name")
     ("checktail", po::value<bool>(&check_tail)->default_value(false), "Only check tail")
+    ("shared", po::value<bool>(&shared)->default_value(true), "Share one client and log handle between threads")
+    ("connections", po::value<int>(&connections)->default_value(SEQR_DEFAULT_CONNECTIONS), "Sequencer connections per client")
+    ("transport", po::value<std::string>(&transport)->default_value("tcp"), "Sequencer transport (tcp, unix, shm)")
+    ("unix-socket", po::value<std::string>(&unix_path)->default_value("/tmp/zlog-seqr.sock"), "Sequencer unix domain socket")
+    ("shm", po::value<std::string>(&shm_name)->default_value("zlog-seqr"), "Sequencer shared memory ring")
   ;
 
   po::variables_map vm;
@@ -77,21 +98,52 @@ int main(int argc, char **argv)
   }
   logname << ".log";
 
+  if (connections <= 0)
+    connections = 1;
+
+  std::vector<std::string> endpoints;
+  if (transport == "unix")
+    endpoints.push_back("unix:" + unix_path);
+  else if (transport == "shm")
+    endpoints.push_back("shm:" + shm_name);
+  else if (transport == "tcp") {
+    std::stringstream servers(server);
+    std::string host;
+    while (std::getline(servers, host, ','))
+      endpoints.push_back(host + ":" + port);
+  } else {
+    std::cerr << "unknown transport " << transport << std::endl;
+    return -1;
+  }
+
   std::vector<std::thread> threads;
 
+  zlog::LogImpl *log = NULL;
   for (int i = 0; i < num_threads; i++) {
-    zlog::SeqrClient *client = new zlog::SeqrClient(server.c_str(), port.c_str());
-    client->Connect();
-    zlog::Log *baselog;
-    ret = zlog::LogImpl::OpenOrCreate(ioctx, logname.str(), client, &baselog);
-    zlog::LogImpl *log = reinterpret_cast<zlog::LogImpl*>(baselog);
-    assert(ret == 0);
+    if (!log || !shared) {
+      zlog::SeqrClient *client = new zlog::SeqrClient(endpoints, connections);
+      client->Connect();
+      zlog::Log *baselog;
+      ret = zlog::LogImpl::OpenOrCreate(ioctx, logname.str(), client, &baselog);
+      assert(ret == 0);
+      log = reinterpret_cast<zlog::LogImpl*>(baselog);
+    }
     std::thread t(client_thread, log, check_tail);
     threads.push_back(std::move(t));
   }
 
-  for (auto it = threads.begin(); it != threads.end(); it++)
-    it->join();
+  // report throughput and mean latency for the chosen transport
+  for (;;) {
+    uint64_t start_ops = ops_done;
+    uint64_t start_latency = ops_latency_us;
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    uint64_t ops = ops_done - start_ops;
+    uint64_t latency = ops_latency_us - start_latency;
+    std::cout << transport << ": " << ops << " ops/sec";
+    if (ops)
+      std::cout << ", " << (latency / ops) << " us/op";
+    std::cout << std::endl;
+  }
 
   return 0;
 }
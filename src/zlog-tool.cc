@@ -12,6 +12,7 @@ int main(int argc, char **argv)
   std::string server;
   std::string port;
   int width;
+  int block_size;
 
   po::options_description desc("Allowed options");
   desc.add_options()
@@ -19,6 +20,8 @@ int main(int argc, char **argv)
     ("logname", po::value<std::string>(&log_name)->required(), "Log name")
     ("create-cut", po::bool_switch()->default_value(false), "Create a cut")
     ("set-width", po::value<int>(&width)->default_value(-1), "Set stripe width")
+    ("block-size", po::value<int>(&block_size)->default_value(-1),
+     "Stripe block size for set-width (0: round robin, default: unchanged)")
   ;
 
   po::variables_map vm;
@@ -49,7 +52,7 @@ int main(int argc, char **argv)
 
   if (width != -1) {
     if (width > 0) {
-      ret = log->SetStripeWidth(width);
+      ret = log->SetStripe(width, block_size);
       if (ret)
         std::cerr << "set-width: failed to set width " << width
           << " ret " << ret << std::endl;
@@ -24,20 +24,34 @@ int SkyObject::query_helper()
   if (ret)
     return ret;
 
-  while (position_ <= tail) {
+  zlog::Scanner *scanner;
+  ret = log_->Scan(position_, tail + 1, &scanner);
+  if (ret)
+    return ret;
+
+  for (;;) {
     ceph::bufferlist bl;
-    ret = log_->Read(position_, bl);
+    ret = scanner->Next(bl);
+    if (ret == -EBADF)
+      break;
+
+    if (ret == -ENODEV) {
+      ret = log_->Fill(position_);
+      if (ret == -EROFS) {
+        // written after the scan read it
+        ret = log_->Read(position_, bl);
+      } else if (ret == 0) {
+        ret = -EFAULT;
+      } else {
+        delete scanner;
+        return ret;
+      }
+    }
+
     switch (ret) {
       case 0:
         apply(bl.c_str());
         break;
-      case -ENODEV:
-        ret = log_->Fill(position_);
-        if (ret == -EROFS)
-          continue; // try again
-        else if (ret)
-          return ret;
-        break;
       case -EFAULT:
         break;
       default:
@@ -46,5 +60,7 @@ int SkyObject::query_helper()
     position_++;
   }
 
+  delete scanner;
+
   return 0;
 }